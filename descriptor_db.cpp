@@ -2,18 +2,25 @@
 
 #include "postgres_protobuf_common.hpp"
 #include "postgres_utils.hpp"
+#include "shared_cache.hpp"
 
 #include <cstring>
 
 #include <google/protobuf/descriptor.pb.h>
+#include <google/protobuf/io/coded_stream.h>
 #include <google/protobuf/util/type_resolver_util.h>
+#include <google/protobuf/wire_format_lite.h>
 
 extern "C" {
 // Must be included before other Postgres headers
 #include <postgres.h>
 
+#include <access/xact.h>
+#include <catalog/pg_type.h>
 #include <executor/spi.h>
 #include <funcapi.h>
+#include <utils/builtins.h>
+#include <utils/inval.h>
 }
 
 using namespace postgres_protobuf::postgres_utils;
@@ -21,60 +28,150 @@ using namespace postgres_protobuf::postgres_utils;
 namespace postgres_protobuf {
 namespace descriptor_db {
 
+namespace {
+
+// OID of `protobuf_file_descriptor_sets`, as of the last cache rebuild.
+Oid desc_table_oid = InvalidOid;
+bool relcache_callback_registered = false;
+
+// The trigger on `protobuf_file_descriptor_sets` invalidates the table's
+// relcache entry on every change, which gets here in every backend once the
+// change is committed (and immediately in the backend that made the change).
+// The shared cache is cleared once per change by `shared_cache` itself, not
+// here, since every backend gets here, some of them much later.
+void RelcacheCallback(Datum, Oid relid) {
+  if (relid == InvalidOid || relid == desc_table_oid) {
+    PGPROTO_DEBUG("Descriptor table invalidated");
+    DescDb::ClearCache();
+  }
+}
+
+}  // namespace
+
 const std::shared_ptr<DescDb>& DescDb::GetOrCreateCached() {
-  if (cached_ != nullptr) {
-    return cached_;
+  if (cached_ == nullptr) {
+    if (!relcache_callback_registered) {
+      CacheRegisterRelcacheCallback(&RelcacheCallback, (Datum)0);
+      relcache_callback_registered = true;
+    }
+    cached_ = std::shared_ptr<DescDb>(new DescDb());
+  }
+  return cached_;
+}
+
+const DescSet* DescDb::GetDescSet(const std::string& name) {
+  auto di = desc_sets_.find(name);
+  if (di != desc_sets_.end()) {
+    return di->second.get();
   }
 
+  std::unique_ptr<DescSet> desc_set = LoadDescSet(name);
+  const DescSet* result = desc_set.get();
+  desc_sets_.emplace(name, std::move(desc_set));
+  return result;
+}
+
+std::unique_ptr<DescSet> DescDb::LoadDescSet(const std::string& name) {
   MemoryContext outer_mctx = CurrentMemoryContext;
 
+  // We can keep the cache beyond this transaction only if we read the table
+  // with a snapshot taken after we've processed all invalidations that were
+  // sent before it. That means a fresh snapshot in READ COMMITTED mode.
+  // Transaction-level snapshots may be older than the invalidations we've
+  // already seen, and parallel mode doesn't allow taking new snapshots.
+  bool fresh_snapshot = !IsInParallelMode() && !IsolationUsesXactSnapshot();
+  bool read_only = !fresh_snapshot;
+
   if (SPI_connect() != SPI_OK_CONNECT) {
     ereport(ERROR,
             (errcode(ERRCODE_INTERNAL_ERROR), errmsg("SPI_connect failed")));
   }
 
-  const char* sql =
-      "SELECT name, file_descriptor_set "
-      "FROM protobuf_file_descriptor_sets";
-  int status = SPI_execute(sql, true, 0);
-  if (status != SPI_OK_SELECT) {
-    ereport(ERROR,
-            (errcode(ERRCODE_INTERNAL_ERROR),
-             errmsg("SPI_execute failed: %s", SPI_result_code_string(status))));
+  // Older versions of the extension's SQL script don't create the trigger.
+  // Without it we'd never find out about changes, so the cache then lasts
+  // only for the current transaction. Without a fresh snapshot it does so
+  // anyway, so there's no need to check. That spares parallel workers, whose
+  // caches are new for every query, one SPI query each.
+  if (fresh_snapshot && !table_checked_) {
+    const char* table_sql =
+        "SELECT 'protobuf_file_descriptor_sets'::regclass::oid, "
+        "EXISTS (SELECT 1 FROM pg_catalog.pg_trigger "
+        "WHERE tgrelid = 'protobuf_file_descriptor_sets'::regclass "
+        "AND tgname = 'protobuf_file_descriptor_sets_changed' "
+        "AND tgenabled = 'A')";
+    int status = SPI_execute(table_sql, read_only, 0);
+    if (status != SPI_OK_SELECT || SPI_processed != 1) {
+      ereport(ERROR, (errcode(ERRCODE_INTERNAL_ERROR),
+                      errmsg("SPI_execute failed: %s",
+                             SPI_result_code_string(status))));
+    }
+    bool isnull;
+    desc_table_oid = DatumGetObjectId(SPI_getbinval(
+        SPI_tuptable->vals[0], SPI_tuptable->tupdesc, 1, &isnull));
+    has_trigger_ = DatumGetBool(SPI_getbinval(
+        SPI_tuptable->vals[0], SPI_tuptable->tupdesc, 2, &isnull));
+    table_checked_ = true;
   }
 
-  // Read all rows before allocating anything on the C++ heap.
-  // We do this because there may be a Postgres error while reading rows.
-  // We allocate the rows in the memory context of the caller, which outlasts
-  // `SPI_finish`. (We do this after `SPI_execute` because `SPI_execute` would
-  // switch the context back. `SPI_getvalue` and `SPI_getbinval` don't do that)
-  MemoryContextSwitchTo(outer_mctx);
-  pvector<std::tuple<pstring, pstring>> rows;
-  rows.reserve(SPI_processed);
-  TupleDesc tupdesc = SPI_tuptable->tupdesc;
-  for (uint64 i = 0; i < SPI_processed; ++i) {
-    HeapTuple row = SPI_tuptable->vals[i];
+  // Descriptor sets that may be cached beyond this transaction may also be
+  // shared with other backends.
+  bool shared = fresh_snapshot && has_trigger_ && shared_cache::IsEnabled();
+  uint64_t shared_generation = 0;
+  bytea* shared_binary = nullptr;
+  if (shared) {
+    shared_generation = shared_cache::Generation();
+    MemoryContext spi_mctx = MemoryContextSwitchTo(outer_mctx);
+    shared_binary = reinterpret_cast<bytea*>(shared_cache::Lookup(name));
+    MemoryContextSwitchTo(spi_mctx);
+  }
 
-    char* name_cstr = SPI_getvalue(row, tupdesc, 1);
-    pstring name(name_cstr);
-    pfree(name_cstr);
-    name_cstr = nullptr;
+  if (shared_binary == nullptr) {
+    const char* sql =
+        "SELECT file_descriptor_set "
+        "FROM protobuf_file_descriptor_sets "
+        "WHERE name = $1";
+    Oid arg_types[1] = {TEXTOID};
+    Datum args[1] = {PointerGetDatum(
+        cstring_to_text_with_len(name.data(), static_cast<int>(name.size())))};
+    int status =
+        SPI_execute_with_args(sql, 1, arg_types, args, nullptr, read_only, 1);
+    if (status != SPI_OK_SELECT) {
+      ereport(ERROR, (errcode(ERRCODE_INTERNAL_ERROR),
+                      errmsg("SPI_execute failed: %s",
+                             SPI_result_code_string(status))));
+    }
+  }
 
+  // Copy the row out before allocating anything on the C++ heap.
+  // We do this because there may be a Postgres error while reading it.
+  // We allocate it in the memory context of the caller, which outlasts
+  // `SPI_finish`. (We do this after `SPI_execute` because `SPI_execute` would
+  // switch the context back. `SPI_getbinval` doesn't do that)
+  MemoryContextSwitchTo(outer_mctx);
+  bool found = false;
+  pstring fds;
+  if (shared_binary != nullptr) {
+    PGPROTO_DEBUG("Descriptor set %s found in shared cache", name.c_str());
+    fds.assign(VARDATA(shared_binary), VARSIZE(shared_binary) - VARHDRSZ);
+    found = true;
+  } else if (SPI_processed > 0) {
     bool isnull;
-    bytea* fds_binary = (bytea*)PG_DETOAST_DATUM_PACKED(
-        SPI_getbinval(row, tupdesc, 2, &isnull));
-    if (isnull) {
+    Datum fds_datum = SPI_getbinval(SPI_tuptable->vals[0],
+                                    SPI_tuptable->tupdesc, 1, &isnull);
+    if (!isnull) {
+      bytea* fds_binary = (bytea*)PG_DETOAST_DATUM_PACKED(fds_datum);
+      fds.assign(VARDATA_ANY(fds_binary), VARSIZE_ANY_EXHDR(fds_binary));
+      found = true;
+      if (shared) {
+        shared_cache::Store(shared_generation, name,
+                            std::string_view(fds.data(), fds.size()));
+      }
+    } else {
       ereport(WARNING,
               (errcode(ERRCODE_INTERNAL_ERROR),
                errmsg("Didn't expect postgres_protobuf_file_descriptor_sets to "
                       "contain nulls")));
-      continue;
     }
-
-    pstring fds =
-        pstring(VARDATA_ANY(fds_binary), VARSIZE_ANY_EXHDR(fds_binary));
-
-    rows.emplace_back(std::move(name), std::move(fds));
   }
 
   if (SPI_finish() != SPI_OK_FINISH) {
@@ -82,72 +179,272 @@ const std::shared_ptr<DescDb>& DescDb::GetOrCreateCached() {
             (errcode(ERRCODE_INTERNAL_ERROR), errmsg("SPI_finish failed")));
   }
 
-  // We start creating RAII objects that allocate on the C++ heap now.
-  // No more Postgres operations, which may throw Postgres exceptions,
-  // are allowed in this block.
-  {
-    std::unordered_map<std::string, std::unique_ptr<DescSet>> desc_sets;
-    for (const auto& row : rows) {
-      pb::FileDescriptorSet fds;
-      const pstring& name = std::get<0>(row);
-      const pstring& fds_data = std::get<1>(row);
-
-      if (!fds.ParseFromArray(fds_data.data(), fds_data.size())) {
-        throw BadProto("failed to parse FileDescriptorSet");
-      }
-
-      std::unique_ptr<DescSet>& desc_set = desc_sets[std::string(name)];
-      if (desc_set == nullptr) {
-        desc_set = std::make_unique<DescSet>();
-      }
-      while (fds.file_size() > 0) {
-        auto* fd = fds.mutable_file()->ReleaseLast();
-        desc_set->desc_db->AddAndOwn(fd);
-      }
+  if (!(fresh_snapshot && has_trigger_) && !clears_at_transaction_end_) {
+    MemoryContextCallback* callback =
+        static_cast<MemoryContextCallback*>(MemoryContextAllocExtended(
+            CurTransactionContext, sizeof(MemoryContextCallback),
+            MCXT_ALLOC_ZERO | MCXT_ALLOC_NO_OOM));
+    if (callback == nullptr) {
+      throw std::bad_alloc();
     }
-
-    cached_ = std::shared_ptr<DescDb>(new DescDb(std::move(desc_sets)));
+    memset(callback, 0, sizeof(*callback));
+    callback->func = &DescDb::ClearCacheCallback;
+    callback->arg = nullptr;
+    MemoryContextRegisterResetCallback(CurTransactionContext, callback);
+    clears_at_transaction_end_ = true;
+    PGPROTO_DEBUG("DescDb cache will be cleared at the end of the transaction");
   }
 
-  // TODO: can we safely make the cache outlive the transaction?
-  // We'd need an efficient way to check whether the source table
-  // has changed.
-  // These posts suggest checking `xmin` and `ctid` on all rows:
-  // https://www.postgresql.org/message-id/24054.1077121761@sss.pgh.pa.us
-  // https://www.postgresql.org/message-id/4599.1171052901@sss.pgh.pa.us
-  MemoryContextCallback* callback =
-      static_cast<MemoryContextCallback*>(MemoryContextAllocExtended(
-          CurTransactionContext, sizeof(MemoryContextCallback),
-          MCXT_ALLOC_ZERO | MCXT_ALLOC_NO_OOM));
-  if (callback == nullptr) {
-    throw std::bad_alloc();
+  if (!found) {
+    PGPROTO_DEBUG("Descriptor set not found: %s", name.c_str());
+    return nullptr;
   }
-  memset(callback, 0, sizeof(*callback));
-  callback->func = &DescDb::ClearCacheCallback;
-  callback->arg = nullptr;
-  MemoryContextRegisterResetCallback(CurTransactionContext, callback);
 
-  PGPROTO_DEBUG("DescDb cache rebuilt");
-  return cached_;
+  // No more Postgres operations, which may throw Postgres exceptions,
+  // are allowed from here on.
+  PGPROTO_DEBUG("Loaded descriptor set %s (%lu bytes)", name.c_str(),
+                fds.size());
+  return std::make_unique<DescSet>(std::string(fds.data(), fds.size()));
 }
 
 void DescDb::ClearCache() {
   cached_.reset();
 }
 
-DescDb::DescDb(
-    std::unordered_map<std::string, std::unique_ptr<DescSet>> desc_sets)
-    : desc_sets(std::move(desc_sets)) {}
+DescDb::DescDb()
+    : generation(++last_generation_),
+      table_checked_(false),
+      has_trigger_(false),
+      clears_at_transaction_end_(false) {}
 
 std::shared_ptr<DescDb> DescDb::cached_;
+uint64_t DescDb::last_generation_ = 0;
 
 void DescDb::ClearCacheCallback(void*) { ClearCache(); }
 
-DescSet::DescSet()
-    : desc_db(std::make_unique<pb::SimpleDescriptorDatabase>()),
+namespace {
+
+using WFL = pb::internal::WireFormatLite;
+
+#define LENGTH_DELIMITED_TAG(number) \
+  GOOGLE_PROTOBUF_WIRE_FORMAT_MAKE_TAG(number, WFL::WIRETYPE_LENGTH_DELIMITED)
+
+constexpr uint32 kFileTag =
+    LENGTH_DELIMITED_TAG(pb::FileDescriptorSet::kFileFieldNumber);
+constexpr uint32 kFileNameTag =
+    LENGTH_DELIMITED_TAG(pb::FileDescriptorProto::kNameFieldNumber);
+constexpr uint32 kFilePackageTag =
+    LENGTH_DELIMITED_TAG(pb::FileDescriptorProto::kPackageFieldNumber);
+constexpr uint32 kFileMessageTypeTag =
+    LENGTH_DELIMITED_TAG(pb::FileDescriptorProto::kMessageTypeFieldNumber);
+constexpr uint32 kFileEnumTypeTag =
+    LENGTH_DELIMITED_TAG(pb::FileDescriptorProto::kEnumTypeFieldNumber);
+constexpr uint32 kFileServiceTag =
+    LENGTH_DELIMITED_TAG(pb::FileDescriptorProto::kServiceFieldNumber);
+constexpr uint32 kFileExtensionTag =
+    LENGTH_DELIMITED_TAG(pb::FileDescriptorProto::kExtensionFieldNumber);
+// The `name` field has the same number in all of the above message types.
+constexpr uint32 kNameTag = LENGTH_DELIMITED_TAG(1);
+
+#undef LENGTH_DELIMITED_TAG
+
+// Reads the `name` field of a serialized DescriptorProto,
+// EnumDescriptorProto, ServiceDescriptorProto or FieldDescriptorProto.
+bool ReadNameField(pb::io::CodedInputStream* stream, std::string* name) {
+  while (uint32 tag = stream->ReadTag()) {
+    if (tag == kNameTag) {
+      return WFL::ReadString(stream, name);
+    } else if (!WFL::SkipField(stream, tag)) {
+      return false;
+    }
+  }
+  return false;
+}
+
+bool HasExtensionOf(const pb::DescriptorProto& desc,
+                    const std::string& extendee, int field_number) {
+  for (const auto& ext : desc.extension()) {
+    if (ext.extendee() == extendee && ext.number() == field_number) {
+      return true;
+    }
+  }
+  for (const auto& nested : desc.nested_type()) {
+    if (HasExtensionOf(nested, extendee, field_number)) {
+      return true;
+    }
+  }
+  return false;
+}
+
+}  // namespace
+
+LazyDescriptorDatabase::LazyDescriptorDatabase(
+    std::string&& file_descriptor_set)
+    : data_(std::move(file_descriptor_set)) {
+  pb::io::CodedInputStream stream(
+      reinterpret_cast<const uint8*>(data_.data()), data_.size());
+  while (uint32 tag = stream.ReadTag()) {
+    if (tag == kFileTag) {
+      int size;
+      if (!stream.ReadVarintSizeAsInt(&size)) {
+        throw BadProto("failed to parse FileDescriptorSet");
+      }
+      int offset = stream.CurrentPosition();
+      if (!stream.Skip(size)) {
+        throw BadProto("failed to parse FileDescriptorSet");
+      }
+      IndexFile(offset, size);
+    } else if (!WFL::SkipField(&stream, tag)) {
+      throw BadProto("failed to parse FileDescriptorSet");
+    }
+  }
+  if (!stream.ConsumedEntireMessage()) {
+    throw BadProto("failed to parse FileDescriptorSet");
+  }
+}
+
+void LazyDescriptorDatabase::IndexFile(int offset, int size) {
+  pb::io::CodedInputStream stream(
+      reinterpret_cast<const uint8*>(data_.data()) + offset, size);
+
+  std::string name;
+  std::string package;
+  std::vector<std::string> symbols;
+  while (uint32 tag = stream.ReadTag()) {
+    bool ok;
+    switch (tag) {
+      case kFileNameTag:
+        ok = WFL::ReadString(&stream, &name);
+        break;
+      case kFilePackageTag:
+        ok = WFL::ReadString(&stream, &package);
+        break;
+      case kFileMessageTypeTag:
+      case kFileEnumTypeTag:
+      case kFileServiceTag:
+      case kFileExtensionTag: {
+        int symbol_size;
+        ok = stream.ReadVarintSizeAsInt(&symbol_size);
+        if (ok) {
+          auto limit = stream.PushLimit(symbol_size);
+          symbols.emplace_back();
+          ok = ReadNameField(&stream, &symbols.back());
+          ok = ok && stream.Skip(stream.BytesUntilLimit());
+          stream.PopLimit(limit);
+        }
+        break;
+      }
+      default:
+        ok = WFL::SkipField(&stream, tag);
+        break;
+    }
+    if (!ok) {
+      throw BadProto("failed to parse FileDescriptorProto");
+    }
+  }
+  if (!stream.ConsumedEntireMessage()) {
+    throw BadProto("failed to parse FileDescriptorProto");
+  }
+
+  size_t index = files_.size();
+  files_.push_back(File{offset, size});
+  // Like `SimpleDescriptorDatabase`, the first definition wins.
+  files_by_name_.emplace(std::move(name), index);
+  for (const std::string& symbol : symbols) {
+    if (package.empty()) {
+      files_by_symbol_.emplace(symbol, index);
+    } else {
+      files_by_symbol_.emplace(package + "." + symbol, index);
+    }
+  }
+}
+
+bool LazyDescriptorDatabase::ParseFile(size_t index,
+                                       pb::FileDescriptorProto* output) const {
+  const File& file = files_[index];
+  PGPROTO_DEBUG("Parsing FileDescriptorProto #%lu (%d bytes)", index,
+                file.size);
+  return output->ParseFromArray(data_.data() + file.offset, file.size);
+}
+
+bool LazyDescriptorDatabase::FindFileByName(const std::string& filename,
+                                            pb::FileDescriptorProto* output) {
+  auto fi = files_by_name_.find(filename);
+  if (fi == files_by_name_.end()) {
+    return false;
+  }
+  return ParseFile(fi->second, output);
+}
+
+bool LazyDescriptorDatabase::FindFileContainingSymbol(
+    const std::string& symbol_name, pb::FileDescriptorProto* output) {
+  // Nested symbols are found by stripping components off the end until we
+  // reach a top-level one.
+  std::string name = symbol_name;
+  while (true) {
+    auto fi = files_by_symbol_.find(name);
+    if (fi != files_by_symbol_.end()) {
+      return ParseFile(fi->second, output);
+    }
+    std::string::size_type dot = name.rfind('.');
+    if (dot == std::string::npos) {
+      return false;
+    }
+    name.resize(dot);
+  }
+}
+
+bool LazyDescriptorDatabase::FindFileContainingExtension(
+    const std::string& containing_type, int field_number,
+    pb::FileDescriptorProto* output) {
+  // Extensions are rarely looked up, so we don't index them
+  // and just parse everything when that happens.
+  std::string extendee = "." + containing_type;
+  for (size_t i = 0; i < files_.size(); ++i) {
+    pb::FileDescriptorProto file;
+    if (!ParseFile(i, &file)) {
+      continue;
+    }
+    bool found = false;
+    for (const auto& ext : file.extension()) {
+      found = found || (ext.extendee() == extendee &&
+                        ext.number() == field_number);
+    }
+    for (const auto& desc : file.message_type()) {
+      found = found || HasExtensionOf(desc, extendee, field_number);
+    }
+    if (found) {
+      output->Swap(&file);
+      return true;
+    }
+  }
+  return false;
+}
+
+DescSet::DescSet(std::string&& file_descriptor_set)
+    : desc_db(std::make_unique<LazyDescriptorDatabase>(
+          std::move(file_descriptor_set))),
       pool(std::make_unique<pb::DescriptorPool>(desc_db.get())),
       type_resolver(pb::util::NewTypeResolverForDescriptorPool(
           "type.googleapis.com", pool.get())) {}
 
+const pb::FieldDescriptor* DescSet::FindJsonField(const pb::Descriptor* desc,
+                                                  std::string_view name) const {
+  auto it = json_fields_.find(desc);
+  if (it == json_fields_.end()) {
+    JsonFields fields;
+    // JSON names take precedence if they clash with another field's name.
+    for (int i = 0; i < desc->field_count(); ++i) {
+      fields.emplace(desc->field(i)->json_name(), desc->field(i));
+    }
+    for (int i = 0; i < desc->field_count(); ++i) {
+      fields.emplace(desc->field(i)->name(), desc->field(i));
+    }
+    it = json_fields_.emplace(desc, std::move(fields)).first;
+  }
+  auto field_it = it->second.find(name);
+  return field_it != it->second.end() ? field_it->second : nullptr;
+}
+
 }  // namespace descriptor_db
 }  // namespace postgres_protobuf
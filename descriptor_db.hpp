@@ -2,7 +2,10 @@
 #define POSTGRES_PROTOBUF_DESCRIPTOR_DB_HPP_
 
 #include <memory>
+#include <string>
+#include <string_view>
 #include <unordered_map>
+#include <vector>
 
 #include <google/protobuf/descriptor.h>
 #include <google/protobuf/descriptor_database.h>
@@ -19,27 +22,85 @@ struct DescSet;
 // NOTE: This currently lives outside of Postgres's memory management,
 // because the protobuf library doesn't support alternative allocators.
 struct DescDb {
-  // TODO: load DescSets lazily
-  const std::unordered_map<std::string, std::unique_ptr<DescSet>> desc_sets;
+  // Distinct for every DescDb built by this backend, so that things compiled
+  // against one (e.g. cached queries) can tell when it has been replaced.
+  const uint64_t generation;
+
+  // Loads the named descriptor set from `protobuf_file_descriptor_sets`
+  // on first use. Returns nullptr if there is no such descriptor set.
+  //
+  // This may run SPI queries, which may in turn clear the cache, so callers
+  // must hold on to their own `shared_ptr` to the DescDb.
+  const DescSet* GetDescSet(const std::string& name);
 
   static const std::shared_ptr<DescDb>& GetOrCreateCached();
   static void ClearCache();
 
  private:
-  DescDb(std::unordered_map<std::string, std::unique_ptr<DescSet>> desc_sets);
+  DescDb();
+
+  // Null values record descriptor sets that don't exist.
+  std::unordered_map<std::string, std::unique_ptr<DescSet>> desc_sets_;
+  bool table_checked_;
+  bool has_trigger_;
+  bool clears_at_transaction_end_;
 
   static std::shared_ptr<DescDb> cached_;
+  static uint64_t last_generation_;
+
+  std::unique_ptr<DescSet> LoadDescSet(const std::string& name);
 
-  static uint64_t GetTableXmin();
   static void ClearCacheCallback(void*);
 };
 
+// Indexes a serialized FileDescriptorSet without fully parsing it.
+// Each FileDescriptorProto is parsed only when the DescriptorPool asks for it.
+class LazyDescriptorDatabase : public pb::DescriptorDatabase {
+ public:
+  // Throws BadProto if the FileDescriptorSet is malformed.
+  explicit LazyDescriptorDatabase(std::string&& file_descriptor_set);
+
+  bool FindFileByName(const std::string& filename,
+                      pb::FileDescriptorProto* output) override;
+  bool FindFileContainingSymbol(const std::string& symbol_name,
+                                pb::FileDescriptorProto* output) override;
+  bool FindFileContainingExtension(const std::string& containing_type,
+                                   int field_number,
+                                   pb::FileDescriptorProto* output) override;
+
+ private:
+  struct File {
+    int offset;
+    int size;
+  };
+
+  const std::string data_;
+  std::vector<File> files_;
+  std::unordered_map<std::string, size_t> files_by_name_;
+  // Only top-level symbols. Nested ones are found by their outermost parent.
+  std::unordered_map<std::string, size_t> files_by_symbol_;
+
+  void IndexFile(int offset, int size);
+  bool ParseFile(size_t index, pb::FileDescriptorProto* output) const;
+};
+
 struct DescSet {
-  std::unique_ptr<pb::SimpleDescriptorDatabase> desc_db;
+  std::unique_ptr<LazyDescriptorDatabase> desc_db;
   std::unique_ptr<pb::DescriptorPool> pool;
   std::unique_ptr<pb::util::TypeResolver> type_resolver;
 
-  DescSet();
+  explicit DescSet(std::string&& file_descriptor_set);
+
+  // Finds a field by its JSON name or its original name, as the JSON mapping
+  // accepts both. The lookup table is built on first use for each message.
+  const pb::FieldDescriptor* FindJsonField(const pb::Descriptor* desc,
+                                           std::string_view name) const;
+
+ private:
+  // Keys point into the descriptors.
+  using JsonFields =
+      std::unordered_map<std::string_view, const pb::FieldDescriptor*>;
+  mutable std::unordered_map<const pb::Descriptor*, JsonFields> json_fields_;
 };
 
 }  // namespace descriptor_db
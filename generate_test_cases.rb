@@ -101,6 +101,7 @@ EOS
     generate_version_check
     test_sql("INSERT INTO protobuf_file_descriptor_sets (name, file_descriptor_set) VALUES ('default', #{descriptor_set_data_hex("main_descriptor_set")});", nil)
     test_sql("INSERT INTO protobuf_file_descriptor_sets (name, file_descriptor_set) VALUES ('other', #{descriptor_set_data_hex("other_descriptor_set")});", nil)
+    test_sql("INSERT INTO protobuf_file_descriptor_sets (name, file_descriptor_set) VALUES ('ext', #{descriptor_set_data_hex("extensions_descriptor_set")});", nil)
   end
 
   def generate_version_check
@@ -119,7 +120,7 @@ EOS
     if expected_results != nil
       rows = expected_results.join("\n")
       result = "result\n"
-      result << "#{rows}\n" unless rows.empty?
+      result << "#{rows}\n" unless expected_results.empty?
       result << "(#{expected_results.size} #{if expected_results.size == 1 then 'row' else 'rows' end})\n"
       result
     end
@@ -144,6 +145,15 @@ EOS
     '\\x' + data.unpack('H*')[0]
   end
 
+  def pb_varint(n)
+    bytes = ''.b
+    while n >= 0x80
+      bytes << ((n & 0x7f) | 0x80).chr
+      n >>= 7
+    end
+    bytes << n.chr
+  end
+
   def pg_quote(s)
     # (not sure this is correct, but should be good enough for this test)
     "'" + s.gsub("'", "''") + "'"
@@ -160,224 +170,629 @@ PROTOC = ENV['PROTOC']
 raise "env var PROTOC required" if PROTOC == nil || PROTOC.empty?
 
 TestGen.new(mode).generate do
-  section "Scalar values" do
-    with_proto('scalars { int32_field: 123 }') do
-      test_query('pgpb.test.ExampleMessage:1.3', ['123'])
-      test_query('pgpb.test.ExampleMessage:scalars.int32_field', ['123'])
-    end
-
-    with_proto('scalars { int64_field: 9223372036854775807 }') do
-      test_query('pgpb.test.ExampleMessage:scalars.int64_field', ['9223372036854775807'])
-    end
-    with_proto('scalars { sint64_field: 9223372036854775807 }') do
-      test_query('pgpb.test.ExampleMessage:scalars.sint64_field', ['9223372036854775807'])
-    end
-    with_proto('scalars { sfixed64_field: 9223372036854775807 }') do
-      test_query('pgpb.test.ExampleMessage:scalars.sfixed64_field', ['9223372036854775807'])
-    end
-
-    with_proto('scalars { int64_field: -9223372036854775808 }') do
-      test_query('pgpb.test.ExampleMessage:scalars.int64_field', ['-9223372036854775808'])
-    end
-    with_proto('scalars { sint64_field: -9223372036854775808 }') do
-      test_query('pgpb.test.ExampleMessage:scalars.sint64_field', ['-9223372036854775808'])
-    end
-    with_proto('scalars { sfixed64_field: -9223372036854775808 }') do
-      test_query('pgpb.test.ExampleMessage:scalars.sfixed64_field', ['-9223372036854775808'])
-    end
-
-    with_proto('scalars { uint64_field: 18446744073709551615 }') do
-      test_query('pgpb.test.ExampleMessage:scalars.uint64_field', ['18446744073709551615'])
-    end
-    with_proto('scalars { fixed64_field: 18446744073709551615 }') do
-      test_query('pgpb.test.ExampleMessage:scalars.fixed64_field', ['18446744073709551615'])
-    end
-
-    with_proto('scalars { float_field: 123.456 }') do
-      test_query('pgpb.test.ExampleMessage:scalars.float_field', ['123.456'])
-    end
-    with_proto('scalars { double_field: 123.456 }') do
-      test_query('pgpb.test.ExampleMessage:scalars.double_field', ['123.456'])
-    end
-    with_proto('scalars { double_field: 0.0000001 }') do
-      test_query('pgpb.test.ExampleMessage:scalars.double_field', ['1e-07'])
-    end
-
-    with_proto('scalars { bool_field: true }') do
-      test_query('pgpb.test.ExampleMessage:scalars.bool_field', ['true'])
-    end
-    with_proto('scalars { bool_field: false }') do
-      # Proto3 doesn't store the false value
-      test_query('pgpb.test.ExampleMessage:scalars.bool_field', [])
-    end
-
-    with_proto('scalars { string_field: "xyz" }') do
-      test_query('pgpb.test.ExampleMessage:scalars.string_field', ['xyz'])
-    end
-    with_proto('scalars { bytes_field: "xyz" }') do
-      test_query('pgpb.test.ExampleMessage:scalars.bytes_field', ['\x78797A'])
+  # Both query engines must give the same results
+  ['flat', 'visitor'].each do |engine|
+    section "Query engine #{engine}" do
+      test_sql("SET postgres_protobuf.query_engine = #{engine};", nil)
+
+      section "Scalar values" do
+        with_proto('scalars { int32_field: 123 }') do
+          test_query('pgpb.test.ExampleMessage:1.3', ['123'])
+          test_query('pgpb.test.ExampleMessage:scalars.int32_field', ['123'])
+        end
+
+        with_proto('scalars { int64_field: 9223372036854775807 }') do
+          test_query('pgpb.test.ExampleMessage:scalars.int64_field', ['9223372036854775807'])
+        end
+        with_proto('scalars { sint64_field: 9223372036854775807 }') do
+          test_query('pgpb.test.ExampleMessage:scalars.sint64_field', ['9223372036854775807'])
+        end
+        with_proto('scalars { sfixed64_field: 9223372036854775807 }') do
+          test_query('pgpb.test.ExampleMessage:scalars.sfixed64_field', ['9223372036854775807'])
+        end
+
+        with_proto('scalars { int64_field: -9223372036854775808 }') do
+          test_query('pgpb.test.ExampleMessage:scalars.int64_field', ['-9223372036854775808'])
+        end
+        with_proto('scalars { sint64_field: -9223372036854775808 }') do
+          test_query('pgpb.test.ExampleMessage:scalars.sint64_field', ['-9223372036854775808'])
+        end
+        with_proto('scalars { sfixed64_field: -9223372036854775808 }') do
+          test_query('pgpb.test.ExampleMessage:scalars.sfixed64_field', ['-9223372036854775808'])
+        end
+
+        with_proto('scalars { uint64_field: 18446744073709551615 }') do
+          test_query('pgpb.test.ExampleMessage:scalars.uint64_field', ['18446744073709551615'])
+        end
+        with_proto('scalars { fixed64_field: 18446744073709551615 }') do
+          test_query('pgpb.test.ExampleMessage:scalars.fixed64_field', ['18446744073709551615'])
+        end
+
+        with_proto('scalars { float_field: 123.456 }') do
+          test_query('pgpb.test.ExampleMessage:scalars.float_field', ['123.456'])
+        end
+        with_proto('scalars { double_field: 123.456 }') do
+          test_query('pgpb.test.ExampleMessage:scalars.double_field', ['123.456'])
+        end
+        with_proto('scalars { double_field: 0.0000001 }') do
+          test_query('pgpb.test.ExampleMessage:scalars.double_field', ['1e-07'])
+        end
+
+        with_proto('scalars { bool_field: true }') do
+          test_query('pgpb.test.ExampleMessage:scalars.bool_field', ['true'])
+        end
+        with_proto('scalars { bool_field: false }') do
+          # Proto3 doesn't store the false value
+          test_query('pgpb.test.ExampleMessage:scalars.bool_field', [])
+        end
+
+        with_proto('scalars { string_field: "xyz" }') do
+          test_query('pgpb.test.ExampleMessage:scalars.string_field', ['xyz'])
+        end
+        with_proto('scalars { bytes_field: "xyz" }') do
+          test_query('pgpb.test.ExampleMessage:scalars.bytes_field', ['\x78797A'])
+        end
+      end
+
+      section "Varints of every length" do
+        # Followed by enough bytes for the decoders that load 16 bytes at once
+        padding = 'string_field: "padding after the varint"'
+        # The largest and smallest numbers of each length, up to 10 bytes
+        values = (1..9).flat_map { |bytes| [(1 << (7 * bytes)) - 1, 1 << (7 * bytes)] } + [(1 << 64) - 1]
+        values.each do |n|
+          with_proto("scalars { uint64_field: #{n}, #{padding} }") do
+            test_query('pgpb.test.ExampleMessage:scalars.uint64_field', [n.to_s])
+          end
+        end
+        with_proto("scalars { int64_field: -1, #{padding} }") do
+          test_query('pgpb.test.ExampleMessage:scalars.int64_field', ['-1'])
+        end
+        with_proto("scalars { sint64_field: -9223372036854775808, #{padding} }") do
+          test_query('pgpb.test.ExampleMessage:scalars.sint64_field', ['-9223372036854775808'])
+        end
+      end
+
+      section "Empty results" do
+        with_proto('') do
+          test_query('pgpb.test.ExampleMessage:scalars.int32_field', [])
+        end
+        with_proto('scalars { string_field: "xyz" }') do
+          test_query('pgpb.test.ExampleMessage:scalars.int32_field', [])
+        end
+      end
+
+      section "Indexing into repeated fields" do
+        with_proto('repeated_int32: 123, repeated_int32: 456') do
+          test_query('pgpb.test.ExampleMessage:repeated_int32[0]', ['123'])
+          test_query('pgpb.test.ExampleMessage:repeated_int32[1]', ['456'])
+          test_query('pgpb.test.ExampleMessage:repeated_int32[2]', [])
+          test_query('pgpb.test.ExampleMessage:repeated_int32[*]', ['123', '456'])
+        end
+
+        # Other length-delimited fields must not be mistaken for the packed field
+        with_proto('scalars { bytes_field: "\\377" }, repeated_int32: 123, repeated_int32: 456') do
+          test_query('pgpb.test.ExampleMessage:repeated_int32[1]', ['456'])
+          test_query('pgpb.test.ExampleMessage:repeated_int32[*]', ['123', '456'])
+        end
+
+        with_proto('repeated_string: "aaa", repeated_string: "bbb", repeated_string: "ccc"') do
+          test_query('pgpb.test.ExampleMessage:repeated_string[0]', ['aaa'])
+          test_query('pgpb.test.ExampleMessage:repeated_string[1]', ['bbb'])
+          test_query('pgpb.test.ExampleMessage:repeated_string[2]', ['ccc'])
+          test_query('pgpb.test.ExampleMessage:repeated_string[3]', [])
+          test_query('pgpb.test.ExampleMessage:repeated_string[*]', ['aaa', 'bbb', 'ccc'])
+          test_query('pgpb.test.ExampleMessage:repeated_string[-1]', [])
+        end
+
+        with_proto('repeated_inner: { inner_repeated: "abc", inner_repeated: "def" }, repeated_inner { inner_repeated: "aaa", inner_repeated: "bbb" }') do
+          test_query('pgpb.test.ExampleMessage:repeated_inner[0].inner_repeated[*]', ['abc', 'def'])
+          test_query('pgpb.test.ExampleMessage:repeated_inner[1].inner_repeated[*]', ['aaa', 'bbb'])
+          test_query('pgpb.test.ExampleMessage:repeated_inner[2].inner_repeated[*]', [])
+          test_query('pgpb.test.ExampleMessage:repeated_inner[0].inner_repeated[0]', ['abc'])
+          test_query('pgpb.test.ExampleMessage:repeated_inner[1].inner_repeated[1]', ['bbb'])
+
+          test_query('pgpb.test.ExampleMessage:repeated_inner[*]', ['{"innerRepeated":["abc","def"]}', '{"innerRepeated":["aaa","bbb"]}'])
+          test_query('pgpb.test.ExampleMessage:repeated_inner[*].inner_repeated[*]', ['abc', 'def', 'aaa', 'bbb'])
+          test_query('pgpb.test.ExampleMessage:repeated_inner[*].inner_repeated[0]', ['abc', 'aaa'])
+          test_query('pgpb.test.ExampleMessage:repeated_inner[*].inner_repeated[1]', ['def', 'bbb'])
+
+          test_sql("SELECT protobuf_query('pgpb.test.ExampleMessage:repeated_inner[*].inner_repeated[0]', #{pg_proto}) AS result;", ['abc'])
+          test_sql("SELECT protobuf_query('pgpb.test.ExampleMessage:repeated_inner[*].inner_repeated[1]', #{pg_proto}) AS result;", ['def'])
+          test_sql("SELECT COALESCE(protobuf_query('pgpb.test.ExampleMessage:repeated_inner[*].inner_repeated[2]', #{pg_proto}), 'none') AS result;", ['none'])
+        end
+
+        with_proto('repeated_inner: { repeated_inner: { inner_repeated: "abc", inner_repeated: "def" }, repeated_inner: { inner_repeated: "aaa" }, repeated_inner: {}, repeated_inner: { inner_repeated: "bbb" } }') do
+          test_query('pgpb.test.ExampleMessage:repeated_inner[*].repeated_inner[*]', ['{"innerRepeated":["abc","def"]}', '{"innerRepeated":["aaa"]}', '{}', '{"innerRepeated":["bbb"]}'])
+          test_query('pgpb.test.ExampleMessage:repeated_inner[*].repeated_inner[*].inner_repeated[*]', ['abc', 'def', 'aaa', 'bbb'])
+
+          test_sql("SELECT protobuf_query('pgpb.test.ExampleMessage:repeated_inner[*].repeated_inner[*].inner_repeated[0]', #{pg_proto}) AS result;", ['abc'])
+          test_sql("SELECT protobuf_query('pgpb.test.ExampleMessage:repeated_inner[*].repeated_inner[*].inner_repeated[1]', #{pg_proto}) AS result;", ['def'])
+          test_sql("SELECT COALESCE(protobuf_query('pgpb.test.ExampleMessage:repeated_inner[*].repeated_inner[*].inner_repeated[2]', #{pg_proto}), 'none') AS result;", ['none'])
+
+          test_sql("SELECT protobuf_query('pgpb.test.ExampleMessage:repeated_inner[0].repeated_inner[0].inner_repeated[0]', #{pg_proto}) AS result;", ['abc'])
+          test_sql("SELECT protobuf_query('pgpb.test.ExampleMessage:repeated_inner[0].repeated_inner[0].inner_repeated[1]', #{pg_proto}) AS result;", ['def'])
+          test_sql("SELECT protobuf_query('pgpb.test.ExampleMessage:repeated_inner[0].repeated_inner[1].inner_repeated[0]', #{pg_proto}) AS result;", ['aaa'])
+          test_sql("SELECT protobuf_query('pgpb.test.ExampleMessage:repeated_inner[0].repeated_inner[3].inner_repeated[0]', #{pg_proto}) AS result;", ['bbb'])
+        end
+
+        with_proto('repeated_inner: { repeated_inner: { inner_str: "abc" }, repeated_inner: { inner_str: "def" } }, repeated_inner: { repeated_inner: { inner_str: "aaa" }, repeated_inner: { inner_str: "bbb" } }') do
+          test_query('pgpb.test.ExampleMessage:repeated_inner[*].repeated_inner[*].inner_str', ['abc', 'def', 'aaa', 'bbb'])
+
+          test_sql("SELECT protobuf_query('pgpb.test.ExampleMessage:repeated_inner[0].repeated_inner[0].inner_str', #{pg_proto}) AS result;", ['abc'])
+          test_sql("SELECT protobuf_query('pgpb.test.ExampleMessage:repeated_inner[0].repeated_inner[1].inner_str', #{pg_proto}) AS result;", ['def'])
+          test_sql("SELECT protobuf_query('pgpb.test.ExampleMessage:repeated_inner[1].repeated_inner[0].inner_str', #{pg_proto}) AS result;", ['aaa'])
+          test_sql("SELECT protobuf_query('pgpb.test.ExampleMessage:repeated_inner[1].repeated_inner[1].inner_str', #{pg_proto}) AS result;", ['bbb'])
+        end
+
+        with_proto('repeated_inner: { inner_str: "lvl1", repeated_inner: { inner_str: "lvl2" } }') do
+          test_sql("SELECT protobuf_query('pgpb.test.ExampleMessage:repeated_inner[0].inner_str', #{pg_proto}) AS result;", ['lvl1'])
+          test_sql("SELECT protobuf_query('pgpb.test.ExampleMessage:repeated_inner[0].repeated_inner[0].inner_str', #{pg_proto}) AS result;", ['lvl2'])
+        end
+      end
+
+      section "Indexing into maps" do
+        with_proto('map_str2str: { key: "a", value: "AAA" }, map_str2str { key: "bb", value: "BBB" }') do
+          test_query('pgpb.test.ExampleMessage:map_str2str[a]', ['AAA'])
+          test_query('pgpb.test.ExampleMessage:map_str2str[bb]', ['BBB'])
+          test_query('pgpb.test.ExampleMessage:map_str2str[c]', [])
+          test_query('pgpb.test.ExampleMessage:map_str2str[*]', ['AAA', 'BBB'])
+        end
+
+        with_proto('map_int2str: { key: 123, value: "AAA" }, map_int2str { key: 456, value: "BBB" }') do
+          test_query('pgpb.test.ExampleMessage:map_int2str[123]', ['AAA'])
+          test_query('pgpb.test.ExampleMessage:map_int2str[456]', ['BBB'])
+          test_query('pgpb.test.ExampleMessage:map_int2str[789]', [])
+          test_query('pgpb.test.ExampleMessage:map_int2str[*]', ['AAA', 'BBB'])
+        end
+
+        with_proto('map_int2int: { key: 123, value: 100 }, map_int2int { key: 456, value: 200 }') do
+          test_query('pgpb.test.ExampleMessage:map_int2int[123]', ['100'])
+          test_query('pgpb.test.ExampleMessage:map_int2int[456]', ['200'])
+          test_query('pgpb.test.ExampleMessage:map_int2int[789]', [])
+          test_query('pgpb.test.ExampleMessage:map_int2int[*]', ['100', '200'])
+        end
+
+        with_proto('map_str2inner: { key: "x", value: { inner_str: "A" } }, map_str2inner { key: "y", value: { inner_str: "B" } }') do
+          test_query('pgpb.test.ExampleMessage:map_str2inner[x].inner_str', ['A'])
+          test_query('pgpb.test.ExampleMessage:map_str2inner[y].inner_str', ['B'])
+          test_query('pgpb.test.ExampleMessage:map_str2inner[z].inner_str', [])
+          test_query('pgpb.test.ExampleMessage:map_str2inner[*].inner_str', ['A', 'B'])
+        end
+      end
+
+      section "Selecting all map keys" do
+        with_proto('map_int2str: { key: 123, value: "AAA" }, map_int2str { key: 456, value: "BBB" }') do
+          test_query('pgpb.test.ExampleMessage:map_int2str|keys', ['123', '456'])
+        end
+      end
+
+      section "Queries from explicitly specified file descriptor sets" do
+        with_proto('scalars { int32_field: 123 }') do
+          test_query('default:pgpb.test.ExampleMessage:scalars.int32_field', ['123'])
+        end
+        with_proto('int32_field: 123', proto_file='other_descriptor_set.proto', proto_name='pgpb.test.other.MessageInOtherDescSet') do
+          test_query('other:pgpb.test.other.MessageInOtherDescSet:int32_field', ['123'])
+        end
+        # The file also declares a top-level extension, which gets indexed by its full name
+        with_proto('int32_field: 123, [pgpb.test.ext.ext_str]: "AAA"', proto_file='extensions_descriptor_set.proto', proto_name='pgpb.test.ext.Extended') do
+          test_query('ext:pgpb.test.ext.Extended:int32_field', ['123'])
+        end
+      end
+
+      section "Modifying descriptor sets" do
+        with_proto('int32_field: 123', proto_file='other_descriptor_set.proto', proto_name='pgpb.test.other.MessageInOtherDescSet') do
+          test_query('other:pgpb.test.other.MessageInOtherDescSet:int32_field', ['123'])
+          test_sql("UPDATE protobuf_file_descriptor_sets SET name = 'renamed' WHERE name = 'other';", nil)
+          test_query('renamed:pgpb.test.other.MessageInOtherDescSet:int32_field', ['123'])
+          test_sql("UPDATE protobuf_file_descriptor_sets SET name = 'other' WHERE name = 'renamed';", nil)
+          test_query('other:pgpb.test.other.MessageInOtherDescSet:int32_field', ['123'])
+        end
+        # The shared cache and its setting only exist with `shared_preload_libraries`
+        test_sql("SELECT current_setting('postgres_protobuf.shared_cache_size', true) IS NULL AS result;", ['t'])
+      end
+
+      section "Single result queries" do 
+        with_proto('repeated_int32: 123, repeated_int32: 456') do
+          # Should return just the first result
+          test_sql("SELECT protobuf_query('pgpb.test.ExampleMessage:repeated_int32[*]', #{pg_proto}) AS result;", ['123'])
+        end
+      end
+
+      section "Enums" do
+        with_proto('an_enum: EnumValue2') do
+          test_sql("SELECT protobuf_query('pgpb.test.ExampleMessage:an_enum', #{pg_proto}) AS result;", ['EnumValue2'])
+        end
+      end
+
+      section "Empty query" do
+        # protobuf_to_json() is equivalent to a query that specifies just the proto name
+        with_proto('scalars { int32_field: 123 }') do
+          test_sql("SELECT protobuf_query('pgpb.test.ExampleMessage:', #{pg_proto}) AS result;", ['{"scalars":{"int32Field":123}}'])
+        end
+      end
+
+      section "Changing queries" do
+        # Exercises recompiling a cached query when a call site's query changes
+        with_proto('scalars { int32_field: 123, string_field: "xyz" }') do
+          queries = [
+            'pgpb.test.ExampleMessage:scalars.int32_field',
+            'pgpb.test.ExampleMessage:scalars.string_field',
+            'pgpb.test.ExampleMessage:scalars.int32_field',
+          ].map { |q| "(#{pg_quote(q)})" }.join(', ')
+          test_sql("SELECT protobuf_query(q, #{pg_proto}) AS result FROM (VALUES #{queries}) AS t(q);", ['123', 'xyz', '123'])
+          test_sql("SELECT protobuf_query_array(q, #{pg_proto}) AS result FROM (VALUES #{queries}) AS t(q);", ['{123}', '{xyz}', '{123}'])
+        end
+      end
+
+      section "Array queries" do
+        with_proto('repeated_int32: 123, repeated_int32: 456') do
+          test_sql("SELECT protobuf_query_array('pgpb.test.ExampleMessage:repeated_int32[*]', #{pg_proto}) AS result;", ['{123,456}'])
+        end
+        with_proto('repeated_string: ["a", "bb", "ccc", "ddddd", ""]') do
+          test_sql("SELECT protobuf_query_array('pgpb.test.ExampleMessage:repeated_string[*]', #{pg_proto}) AS result;", ['{a,bb,ccc,ddddd,""}'])
+          test_sql("SELECT (protobuf_query_array('pgpb.test.ExampleMessage:repeated_string[*]', #{pg_proto}))[4] AS result;", ['ddddd'])
+        end
+        with_proto('map_int2str: { key: 123, value: "AAA" }, map_int2str { key: 456, value: "BBB" }') do
+          test_sql("SELECT protobuf_query_array('pgpb.test.ExampleMessage:map_int2str[*]', #{pg_proto}) AS result;", ['{AAA,BBB}'])
+          test_sql("SELECT protobuf_query_array('pgpb.test.ExampleMessage:map_int2str|keys', #{pg_proto}) AS result;", ['{123,456}'])
+        end
+        with_proto('scalars { int32_field: 123 }') do
+          test_sql("SELECT protobuf_query_array('pgpb.test.ExampleMessage:', #{pg_proto}) AS result;", ['{"{\"scalars\":{\"int32Field\":123}}"}'])
+          test_sql("SELECT protobuf_query_array('pgpb.test.ExampleMessage:scalars', #{pg_proto}) AS result;", ['{"{\"int32Field\":123}"}'])
+          test_sql("SELECT protobuf_query_array('pgpb.test.ExampleMessage:scalars.int32_field', #{pg_proto}) AS result;", ['{123}'])
+          test_sql("SELECT protobuf_query_array('pgpb.test.ExampleMessage:scalars.string_field', #{pg_proto}) AS result;", ['{}'])
+        end
+      end
+
+      section "Multi-path queries" do
+        with_proto('scalars { int32_field: 123, string_field: "xyz" }, repeated_int32: 4, repeated_int32: 5, map_str2str { key: "a", value: "AAA" }') do
+          queries = [
+            'pgpb.test.ExampleMessage:scalars.int32_field',
+            'pgpb.test.ExampleMessage:scalars.string_field',
+            'pgpb.test.ExampleMessage:repeated_int32[*]',
+            'pgpb.test.ExampleMessage:repeated_int32[1]',
+            'pgpb.test.ExampleMessage:map_str2str[a]',
+            'pgpb.test.ExampleMessage:map_str2str[b]',
+            'pgpb.test.ExampleMessage:scalars.int32_field',
+          ].map { |q| pg_quote(q) }.join(', ')
+          test_sql("SELECT protobuf_query_paths(ARRAY[#{queries}], #{pg_proto}) AS result;", ['{123,xyz,4,5,AAA,NULL,123}'])
+        end
+        with_proto('scalars { int32_field: 123 }') do
+          test_sql("SELECT protobuf_query_paths(ARRAY['pgpb.test.ExampleMessage:', 'pgpb.test.ExampleMessage:scalars.int32_field'], #{pg_proto}) AS result;", ['{"{\"scalars\":{\"int32Field\":123}}",123}'])
+          test_sql("SELECT protobuf_query_paths(ARRAY[]::TEXT[], #{pg_proto}) AS result;", ['{}'])
+        end
+      end
+
+      section "Batch queries" do
+        protos = ['scalars { string_field: "xyz" }', 'scalars { int32_field: 123 }', 'scalars { string_field: "" }', 'scalars { string_field: "a,b" }'].map do |text_format|
+          pg_binary(textformat_to_binary(text_format, 'main_descriptor_set.proto', 'pgpb.test.ExampleMessage'))
+        end
+        test_sql("SELECT protobuf_query_batch('pgpb.test.ExampleMessage:scalars.string_field', ARRAY[#{protos.join(', ')}]) AS result;", ['{xyz,NULL,NULL,"a,b"}'])
+        test_sql("SELECT protobuf_query_batch('pgpb.test.ExampleMessage:scalars.int32_field', ARRAY[#{protos[1]}, NULL, #{protos[1]}]) AS result;", ['{123,NULL,123}'])
+        test_sql("SELECT protobuf_query_batch('pgpb.test.ExampleMessage:scalars.int32_field', '[0:1]={\\\\x,\\\\x}'::BYTEA[]) AS result;", ['[0:1]={NULL,NULL}'])
+        test_sql("SELECT protobuf_query_batch('pgpb.test.ExampleMessage:scalars.int32_field', ARRAY[]::BYTEA[]) AS result;", ['{}'])
+      end
+
+      section "Nesting depth limit" do
+        with_proto('repeated_inner: { repeated_inner: { inner_str: "lvl2" } }') do
+          test_sql("SET postgres_protobuf.max_depth = 3;", nil)
+          test_query('pgpb.test.ExampleMessage:repeated_inner[*].repeated_inner[*].inner_str', ['lvl2'])
+          # Scans of single fields of the root message count the root too
+          test_sql("SET postgres_protobuf.max_depth = 2;", nil)
+          test_sql(<<~EOS, nil)
+            DO $$ BEGIN
+              PERFORM protobuf_query_paths(ARRAY['pgpb.test.ExampleMessage:repeated_inner[*].repeated_inner[*].inner_str', 'pgpb.test.ExampleMessage:repeated_inner[*].inner_str'], #{pg_proto});
+              RAISE 'expected an error';
+            EXCEPTION WHEN program_limit_exceeded THEN
+            END $$;
+          EOS
+          test_sql("RESET postgres_protobuf.max_depth;", nil)
+        end
+        # Map values are rescanned on their own, but still as deep as they are
+        with_proto('map_str2inner { key: "k", value: { repeated_inner { repeated_inner { inner_str: "lvl3" } } } }') do
+          query = 'pgpb.test.ExampleMessage:map_str2inner[k].repeated_inner[*].repeated_inner[*].inner_str'
+          test_sql("SET postgres_protobuf.max_depth = 4;", nil)
+          test_query(query, ['lvl3'])
+          test_sql("SET postgres_protobuf.max_depth = 3;", nil)
+          test_sql(<<~EOS, nil)
+            DO $$ BEGIN
+              PERFORM protobuf_query(#{pg_quote(query)}, #{pg_proto});
+              RAISE 'expected an error';
+            EXCEPTION WHEN program_limit_exceeded THEN
+            END $$;
+          EOS
+          test_sql("RESET postgres_protobuf.max_depth;", nil)
+        end
+
+        # Nested deeper than protoc's text format allows, so encoded here
+        levels = 150
+        deep = textformat_to_binary('inner_str: "deep"', 'main_descriptor_set.proto', 'pgpb.test.ExampleMessage.InnerMessage')
+        (levels - 1).times { deep = "\x1a".b + pb_varint(deep.bytesize) + deep }
+        deep = "\x2a".b + pb_varint(deep.bytesize) + deep
+        query = 'pgpb.test.ExampleMessage:repeated_inner' + '.repeated_inner' * (levels - 1) + '.inner_str'
+        test_sql("SET postgres_protobuf.max_depth = 200;", nil)
+        test_sql("SELECT protobuf_query(#{pg_quote(query)}, #{pg_binary(deep)}) AS result;", ['deep'])
+        test_sql("RESET postgres_protobuf.max_depth;", nil)
+      end
+
+      section "Streaming results" do
+        with_proto('repeated_int32: 123, repeated_int32: 456, repeated_string: "aaa", repeated_string: "bbb"') do
+          test_sql("SELECT protobuf_query_multi('pgpb.test.ExampleMessage:repeated_int32[*]', #{pg_proto}) AS result LIMIT 1;", ['123'])
+          test_sql("SELECT protobuf_query_multi('pgpb.test.ExampleMessage:repeated_string[*]', #{pg_proto}) AS result LIMIT 1;", ['aaa'])
+          test_sql("SELECT result FROM protobuf_query_multi('pgpb.test.ExampleMessage:repeated_string[*]', #{pg_proto}) AS result;", ['aaa', 'bbb'])
+          # Streams of the same query must not share state with each other or with other calls
+          test_sql("SELECT protobuf_query_multi('pgpb.test.ExampleMessage:repeated_int32[*]', #{pg_proto}) || protobuf_query_multi('pgpb.test.ExampleMessage:repeated_int32[*]', #{pg_proto}) AS result;", ['123123', '456456'])
+          test_sql("SELECT protobuf_query_multi('pgpb.test.ExampleMessage:repeated_int32[*]', #{pg_proto}) || array_length(protobuf_query_array('pgpb.test.ExampleMessage:repeated_int32[*]', #{pg_proto}), 1) AS result;", ['1232', '4562'])
+        end
+      end
+
+      section "Queries by field number" do
+        with_proto('scalars { double_field: 0.25, int32_field: -123, sint32_field: -5, bool_field: true, string_field: "xyz" }, repeated_int32: 4, repeated_int32: 5, repeated_inner { inner_str: "A" }, repeated_inner { inner_str: "B" }') do
+          test_sql("SELECT protobuf_query_by_number('int32:1.3', #{pg_proto}) AS result;", ['-123'])
+          test_sql("SELECT protobuf_query_by_number('sint32:1.7', #{pg_proto}) AS result;", ['-5'])
+          test_sql("SELECT protobuf_query_by_number('double:1.1', #{pg_proto}) AS result;", ['0.25'])
+          test_sql("SELECT protobuf_query_by_number('bool:1.13', #{pg_proto}) AS result;", ['true'])
+          test_sql("SELECT protobuf_query_by_number('string:1.14', #{pg_proto}) AS result;", ['xyz'])
+          test_sql("SELECT protobuf_query_by_number('int32:2[1]', #{pg_proto}) AS result;", ['5'])
+          test_sql("SELECT protobuf_query_by_number('string:5[1].1', #{pg_proto}) AS result;", ['B'])
+          test_sql("SELECT protobuf_query_by_number('bytes:4', #{pg_proto}) AS result;", [''])
+          test_sql("SELECT protobuf_query_by_number_array('int32:2', #{pg_proto}) AS result;", ['{4,5}'])
+          test_sql("SELECT protobuf_query_by_number_array('string:5[*].1', #{pg_proto}) AS result;", ['{A,B}'])
+          test_sql("SELECT protobuf_query_by_number_int8('int32:1.3', #{pg_proto}) AS result;", ['-123'])
+          test_sql("SELECT protobuf_query_by_number_float8('double:1.1', #{pg_proto}) AS result;", ['0.25'])
+          test_sql("SELECT protobuf_query_by_number_bool('bool:1.13', #{pg_proto}) AS result;", ['t'])
+          # Submessages can be extracted as bytes
+          test_sql("SELECT protobuf_query_by_number_bytea('bytes:5[0]', #{pg_proto}) AS result;", ['\\x0a0141'])
+
+          test_sql("CREATE TABLE indexed_protobufs (proto BYTEA);", nil)
+          test_sql("CREATE INDEX ON indexed_protobufs (protobuf_query_by_number_int8('int32:1.3', proto));", nil)
+          test_sql("INSERT INTO indexed_protobufs VALUES (#{pg_proto});", nil)
+          test_sql("SELECT count(*) AS result FROM indexed_protobufs WHERE protobuf_query_by_number_int8('int32:1.3', proto) = -123;", ['1'])
+          test_sql("DROP TABLE indexed_protobufs;", nil)
+        end
+      end
+
+      section "Large toasted protobufs" do
+        test_sql("CREATE TABLE big_protobufs (compressed BYTEA, uncompressed BYTEA);", nil)
+        test_sql("ALTER TABLE big_protobufs ALTER COLUMN uncompressed SET STORAGE EXTERNAL;", nil)
+        # 1 MB of repeated_string between scalars and inner
+        test_sql("INSERT INTO big_protobufs SELECT p, p FROM (SELECT decode('0a021803' || repeat('1a03616263', 200000) || '22030a0141', 'hex') AS p) AS t;", nil)
+        ['compressed', 'uncompressed'].each do |column|
+          test_sql("SELECT protobuf_query('pgpb.test.ExampleMessage:scalars.int32_field', #{column}) AS result FROM big_protobufs;", ['3'])
+          test_sql("SELECT protobuf_query_int8('pgpb.test.ExampleMessage:scalars.int32_field', #{column}) AS result FROM big_protobufs;", ['3'])
+          test_sql("SELECT protobuf_query('pgpb.test.ExampleMessage:repeated_string[199999]', #{column}) AS result FROM big_protobufs;", ['abc'])
+          test_sql("SELECT protobuf_query('pgpb.test.ExampleMessage:inner.inner_str', #{column}) AS result FROM big_protobufs;", ['A'])
+          test_sql("SELECT protobuf_query('pgpb.test.ExampleMessage:an_enum', #{column}) AS result FROM big_protobufs;", [''])
+        end
+        test_sql("DROP TABLE big_protobufs;", nil)
+      end
+
+      section "Typed queries" do
+        with_proto('scalars { int32_field: -123, int64_field: 9223372036854775807, uint64_field: 18446744073709551615, double_field: 0.25, float_field: 0.5, bool_field: true, string_field: "xyz" }, repeated_int32: 4, repeated_int32: 5, an_enum: EnumValue2') do
+          test_sql("SELECT protobuf_query_int8('pgpb.test.ExampleMessage:scalars.int32_field', #{pg_proto}) AS result;", ['-123'])
+          test_sql("SELECT protobuf_query_int8('pgpb.test.ExampleMessage:scalars.int64_field', #{pg_proto}) AS result;", ['9223372036854775807'])
+          test_sql("SELECT protobuf_query_int8('pgpb.test.ExampleMessage:an_enum', #{pg_proto}) AS result;", ['2'])
+          test_sql("SELECT protobuf_query_int8('pgpb.test.ExampleMessage:scalars.sint32_field', #{pg_proto}) AS result;", [''])
+          test_sql("SELECT protobuf_query_float8('pgpb.test.ExampleMessage:scalars.double_field', #{pg_proto}) AS result;", ['0.25'])
+          test_sql("SELECT protobuf_query_float8('pgpb.test.ExampleMessage:scalars.float_field', #{pg_proto}) AS result;", ['0.5'])
+          test_sql("SELECT protobuf_query_float8('pgpb.test.ExampleMessage:scalars.int32_field', #{pg_proto}) AS result;", ['-123'])
+          test_sql("SELECT protobuf_query_numeric('pgpb.test.ExampleMessage:scalars.uint64_field', #{pg_proto}) AS result;", ['18446744073709551615'])
+          test_sql("SELECT protobuf_query_numeric('pgpb.test.ExampleMessage:scalars.int64_field', #{pg_proto}) AS result;", ['9223372036854775807'])
+          test_sql("SELECT protobuf_query_numeric('pgpb.test.ExampleMessage:scalars.double_field', #{pg_proto}) AS result;", ['0.25'])
+          test_sql("SELECT protobuf_query_bool('pgpb.test.ExampleMessage:scalars.bool_field', #{pg_proto}) AS result;", ['t'])
+          test_sql("SELECT protobuf_query_bytea('pgpb.test.ExampleMessage:scalars.string_field', #{pg_proto}) AS result;", ['\\x78797a'])
+          test_sql("SELECT protobuf_query_int8_array('pgpb.test.ExampleMessage:repeated_int32[*]', #{pg_proto}) AS result;", ['{4,5}'])
+          test_sql("SELECT protobuf_query_float8_array('pgpb.test.ExampleMessage:repeated_int32[*]', #{pg_proto}) AS result;", ['{4,5}'])
+          test_sql("SELECT protobuf_query_numeric_array('pgpb.test.ExampleMessage:repeated_int32[*]', #{pg_proto}) AS result;", ['{4,5}'])
+          test_sql("SELECT protobuf_query_bool_array('pgpb.test.ExampleMessage:scalars.bool_field', #{pg_proto}) AS result;", ['{t}'])
+          test_sql("SELECT protobuf_query_bytea_array('pgpb.test.ExampleMessage:scalars.string_field', #{pg_proto}) AS result;", ['{"\\\\x78797a"}'])
+        end
+        # Long enough for packed fields to be decoded in bulk, with runs of
+        # single-byte varints around longer ones
+        numbers = (0...20).to_a + [-1, 300, -300, 2147483647, -2147483648] + (100...120).to_a
+        with_proto(numbers.map { |n| "repeated_int32: #{n}" }.join(', ')) do
+          test_sql("SELECT protobuf_query_int8_array('pgpb.test.ExampleMessage:repeated_int32[*]', #{pg_proto}) AS result;", ["{#{numbers.join(',')}}"])
+          test_sql("SELECT protobuf_query_float8_array('pgpb.test.ExampleMessage:repeated_int32[*]', #{pg_proto}) AS result;", ["{#{numbers.join(',')}}"])
+          test_sql("SELECT protobuf_query_int8_array('pgpb.test.ExampleMessage:repeated_int32[22]', #{pg_proto}) AS result;", ['{-300}'])
+        end
+        # Each wire type and conversion of packed fields. Large numbers aren't
+        # given to float8, whose output differs between Postgres versions.
+        small = (-10..10).to_a
+        sint64s = small + [-9223372036854775808, 9223372036854775807]
+        fixed32s = [0, 1, 123456789, 4294967295]
+        fixed64s = [0, 1, 123456789012, 9223372036854775807]
+        doubles = [0.5, -1.25, 3]
+        fields = [
+          sint64s.map { |n| "repeated_sint64: #{n}" },
+          fixed32s.map { |n| "repeated_fixed32: #{n}" },
+          fixed64s.map { |n| "repeated_fixed64: #{n}" },
+          doubles.map { |n| "repeated_double: #{n}" },
+        ].flatten
+        with_proto(fields.join(', ')) do
+          test_sql("SELECT protobuf_query_int8_array('pgpb.test.ExampleMessage:repeated_sint64[*]', #{pg_proto}) AS result;", ["{#{sint64s.join(',')}}"])
+          test_sql("SELECT protobuf_query_float8_array('pgpb.test.ExampleMessage:repeated_sint64[*]', #{pg_proto})[1:21] AS result;", ["{#{small.join(',')}}"])
+          test_sql("SELECT protobuf_query_int8_array('pgpb.test.ExampleMessage:repeated_fixed32[*]', #{pg_proto}) AS result;", ["{#{fixed32s.join(',')}}"])
+          test_sql("SELECT protobuf_query_float8_array('pgpb.test.ExampleMessage:repeated_fixed32[*]', #{pg_proto}) AS result;", ["{#{fixed32s.join(',')}}"])
+          test_sql("SELECT protobuf_query_int8_array('pgpb.test.ExampleMessage:repeated_fixed64[*]', #{pg_proto}) AS result;", ["{#{fixed64s.join(',')}}"])
+          test_sql("SELECT protobuf_query_float8_array('pgpb.test.ExampleMessage:repeated_fixed64[*]', #{pg_proto})[1:3] AS result;", ['{0,1,123456789012}'])
+          test_sql("SELECT protobuf_query_float8_array('pgpb.test.ExampleMessage:repeated_double[*]', #{pg_proto}) AS result;", ['{0.5,-1.25,3}'])
+        end
+        with_proto('repeated_fixed64: 1, repeated_fixed64: 18446744073709551615') do
+          test_sql("SELECT protobuf_query_float8_array('pgpb.test.ExampleMessage:repeated_fixed64[*]', #{pg_proto}) = ARRAY[1, 18446744073709551615]::FLOAT8[] AS result;", ['t'])
+          # Too large for int8
+          test_sql(<<~EOS, nil)
+            DO $$ BEGIN
+              PERFORM protobuf_query_int8_array('pgpb.test.ExampleMessage:repeated_fixed64[*]', #{pg_proto});
+              RAISE 'expected an error';
+            EXCEPTION WHEN numeric_value_out_of_range THEN
+            END $$;
+          EOS
+        end
+        with_proto('inner { inner_str: "A" }') do
+          # Submessages are returned as serialized protobufs
+          test_sql("SELECT protobuf_query_bytea('pgpb.test.ExampleMessage:inner', #{pg_proto}) AS result;", ['\\x0a0141'])
+        end
+      end
+
+      section "Matching" do
+        with_proto('scalars { int32_field: -123, uint64_field: 18446744073709551615, double_field: 0.25, float_field: 0.1, bool_field: true, string_field: "xyz", bytes_field: "\\377" }, repeated_int32: 4, repeated_int32: 5, repeated_inner { inner_str: "A" }, repeated_inner { inner_str: "B" }, an_enum: EnumValue2') do
+          test_sql("SELECT protobuf_match('pgpb.test.ExampleMessage:scalars.int32_field', '=', '-123', #{pg_proto}) AS result;", ['t'])
+          test_sql("SELECT protobuf_match('pgpb.test.ExampleMessage:scalars.int32_field', '>', '-123', #{pg_proto}) AS result;", ['f'])
+          test_sql("SELECT protobuf_match('pgpb.test.ExampleMessage:scalars.int32_field', '>=', '-123.5', #{pg_proto}) AS result;", ['t'])
+          test_sql("SELECT protobuf_match('pgpb.test.ExampleMessage:scalars.uint64_field', '>', '9223372036854775807', #{pg_proto}) AS result;", ['t'])
+          test_sql("SELECT protobuf_match('pgpb.test.ExampleMessage:scalars.double_field', '<', '0.3', #{pg_proto}) AS result;", ['t'])
+          # Floats compare at float precision, like they're printed
+          test_sql("SELECT protobuf_match('pgpb.test.ExampleMessage:scalars.float_field', '=', '0.1', #{pg_proto}) AS result;", ['t'])
+          test_sql("SELECT protobuf_match('pgpb.test.ExampleMessage:scalars.float_field', '>', '0.1', #{pg_proto}) AS result;", ['f'])
+          test_sql("SELECT protobuf_match_by_number('float:1.2', '=', '0.1', #{pg_proto}) AS result;", ['t'])
+          test_sql("SELECT #{pg_proto} @> 'float:1.2=0.1' AS result;", ['t'])
+          test_sql("SELECT protobuf_match('pgpb.test.ExampleMessage:scalars.bool_field', '!=', 'true', #{pg_proto}) AS result;", ['f'])
+          test_sql("SELECT protobuf_match('pgpb.test.ExampleMessage:scalars.string_field', '>', 'xy', #{pg_proto}) AS result;", ['t'])
+          test_sql("SELECT protobuf_match('pgpb.test.ExampleMessage:scalars.bytes_field', '=', '\\xff', #{pg_proto}) AS result;", ['t'])
+          test_sql("SELECT protobuf_match('pgpb.test.ExampleMessage:an_enum', '=', 'EnumValue2', #{pg_proto}) AS result;", ['t'])
+          test_sql("SELECT protobuf_match('pgpb.test.ExampleMessage:an_enum', '<', '2', #{pg_proto}) AS result;", ['f'])
+          # Any of several results may match
+          test_sql("SELECT protobuf_match('pgpb.test.ExampleMessage:repeated_int32[*]', '>', '4', #{pg_proto}) AS result;", ['t'])
+          test_sql("SELECT protobuf_match('pgpb.test.ExampleMessage:repeated_int32[*]', '>', '5', #{pg_proto}) AS result;", ['f'])
+          test_sql("SELECT protobuf_match('pgpb.test.ExampleMessage:repeated_inner[*].inner_str', '=', 'B', #{pg_proto}) AS result;", ['t'])
+          # Missing values don't match anything
+          test_sql("SELECT protobuf_match('pgpb.test.ExampleMessage:scalars.sint32_field', '!=', '1', #{pg_proto}) AS result;", ['f'])
+          test_sql("SELECT protobuf_match_by_number('int32:1.3', '<', '0', #{pg_proto}) AS result;", ['t'])
+          test_sql("SELECT protobuf_match_by_number('string:5.1', '=', 'C', #{pg_proto}) AS result;", ['f'])
+        end
+        with_proto('scalars { int64_field: 9007199254740992, uint64_field: 9007199254740992 }') do
+          # 64-bit integers compare exactly, also where doubles would round
+          test_sql("SELECT protobuf_match('pgpb.test.ExampleMessage:scalars.int64_field', '=', '9007199254740993', #{pg_proto}) AS result;", ['f'])
+          test_sql("SELECT protobuf_match('pgpb.test.ExampleMessage:scalars.int64_field', '<', '9007199254740993', #{pg_proto}) AS result;", ['t'])
+          test_sql("SELECT protobuf_match('pgpb.test.ExampleMessage:scalars.uint64_field', '=', '9007199254740993', #{pg_proto}) AS result;", ['f'])
+          test_sql("SELECT protobuf_match('pgpb.test.ExampleMessage:scalars.int64_field', '<', '9007199254740992.5', #{pg_proto}) AS result;", ['t'])
+          test_sql("SELECT protobuf_match('pgpb.test.ExampleMessage:scalars.uint64_field', '=', '9007199254740992.0', #{pg_proto}) AS result;", ['t'])
+        end
+      end
     end
   end
 
-  section "Empty results" do
-    with_proto('') do
-      test_query('pgpb.test.ExampleMessage:scalars.int32_field', [])
-    end
-    with_proto('scalars { string_field: "xyz" }') do
-      test_query('pgpb.test.ExampleMessage:scalars.int32_field', [])
-    end
+  section "Protobuf type" do
+    with_proto('scalars { int32_field: 123, string_field: "xyz" }, repeated_int32: 4, repeated_int32: 5') do
+      test_sql("CREATE TABLE typed_protobufs (proto protobuf('pgpb.test.ExampleMessage'), other protobuf('other:pgpb.test.other.MessageInOtherDescSet'));", nil)
+      test_sql("INSERT INTO typed_protobufs VALUES (#{pg_proto}, decode('087b', 'hex'));", nil)
+      test_sql("SELECT format_type(atttypid, atttypmod) AS result FROM pg_attribute WHERE attrelid = 'typed_protobufs'::regclass AND attnum > 0 ORDER BY attnum;", ["protobuf('pgpb.test.ExampleMessage')", "protobuf('other:pgpb.test.other.MessageInOtherDescSet')"])
+      test_sql("SELECT proto AS result FROM typed_protobufs;", [pg_proto_raw])
+      test_sql("SELECT proto -> 'scalars.int32_field' AS result FROM typed_protobufs;", ['123'])
+      test_sql("SELECT proto -> 'scalars.uint32_field' AS result FROM typed_protobufs;", [''])
+      test_sql("SELECT proto #> 'repeated_int32[*]' AS result FROM typed_protobufs;", ['{4,5}'])
+      test_sql("SELECT other -> 'int32_field' AS result FROM typed_protobufs;", ['123'])
+      test_sql("SELECT count(*) AS result FROM typed_protobufs WHERE proto @@ 'repeated_int32[*] > 4';", ['1'])
+      test_sql("SELECT count(*) AS result FROM typed_protobufs WHERE proto @@ 'scalars.string_field = xy';", ['0'])
+      # Functions taking BYTEA take protobufs too
+      test_sql("SELECT protobuf_query('pgpb.test.ExampleMessage:scalars.string_field', proto) AS result FROM typed_protobufs;", ['xyz'])
+      test_sql("CREATE INDEX ON typed_protobufs USING gin (proto protobuf_path_ops);", nil)
+      test_sql("SET enable_seqscan = off;", nil)
+      test_sql("SELECT count(*) AS result FROM typed_protobufs WHERE proto @> 'string:1.14=xyz';", ['1'])
+      test_sql("RESET enable_seqscan;", nil)
+      test_sql("DROP TABLE typed_protobufs;", nil)
+    end
+    # Roles without any grants add new message types too
+    test_sql("CREATE ROLE pgpb_test_plain_role;", nil)
+    test_sql("SET ROLE pgpb_test_plain_role;", nil)
+    test_sql("CREATE TEMP TABLE plain_role_protobufs (proto protobuf('pgpb.test.Scalars'));", nil)
+    test_sql("SELECT format_type(atttypid, atttypmod) AS result FROM pg_attribute WHERE attrelid = 'plain_role_protobufs'::regclass AND attnum > 0;", ["protobuf('pgpb.test.Scalars')"])
+    test_sql("DROP TABLE plain_role_protobufs;", nil)
+    test_sql("RESET ROLE;", nil)
+    test_sql("DROP ROLE pgpb_test_plain_role;", nil)
+    # Read-only transactions can use known message types, but not add new ones
+    test_sql("SET default_transaction_read_only = on;", nil)
+    test_sql(<<~EOS, nil)
+      DO $$ BEGIN
+        PERFORM NULL::protobuf('other:pgpb.test.other.MessageInOtherDescSet');
+        PERFORM NULL::protobuf('ext:pgpb.test.ext.Extended');
+        RAISE 'expected an error';
+      EXCEPTION WHEN read_only_sql_transaction THEN
+      END $$;
+    EOS
+    test_sql("RESET default_transaction_read_only;", nil)
   end
 
-  section "Indexing into repeated fields" do
-    with_proto('repeated_int32: 123, repeated_int32: 456') do
-      test_query('pgpb.test.ExampleMessage:repeated_int32[0]', ['123'])
-      test_query('pgpb.test.ExampleMessage:repeated_int32[1]', ['456'])
-      test_query('pgpb.test.ExampleMessage:repeated_int32[2]', [])
-      test_query('pgpb.test.ExampleMessage:repeated_int32[*]', ['123', '456'])
-    end
-
-    with_proto('repeated_string: "aaa", repeated_string: "bbb", repeated_string: "ccc"') do
-      test_query('pgpb.test.ExampleMessage:repeated_string[0]', ['aaa'])
-      test_query('pgpb.test.ExampleMessage:repeated_string[1]', ['bbb'])
-      test_query('pgpb.test.ExampleMessage:repeated_string[2]', ['ccc'])
-      test_query('pgpb.test.ExampleMessage:repeated_string[3]', [])
-      test_query('pgpb.test.ExampleMessage:repeated_string[*]', ['aaa', 'bbb', 'ccc'])
-      test_query('pgpb.test.ExampleMessage:repeated_string[-1]', [])
-    end
-
-    with_proto('repeated_inner: { inner_repeated: "abc", inner_repeated: "def" }, repeated_inner { inner_repeated: "aaa", inner_repeated: "bbb" }') do
-      test_query('pgpb.test.ExampleMessage:repeated_inner[0].inner_repeated[*]', ['abc', 'def'])
-      test_query('pgpb.test.ExampleMessage:repeated_inner[1].inner_repeated[*]', ['aaa', 'bbb'])
-      test_query('pgpb.test.ExampleMessage:repeated_inner[2].inner_repeated[*]', [])
-      test_query('pgpb.test.ExampleMessage:repeated_inner[0].inner_repeated[0]', ['abc'])
-      test_query('pgpb.test.ExampleMessage:repeated_inner[1].inner_repeated[1]', ['bbb'])
-
-      test_query('pgpb.test.ExampleMessage:repeated_inner[*]', ['{"innerRepeated":["abc","def"]}', '{"innerRepeated":["aaa","bbb"]}'])
-      test_query('pgpb.test.ExampleMessage:repeated_inner[*].inner_repeated[*]', ['abc', 'def', 'aaa', 'bbb'])
-      test_query('pgpb.test.ExampleMessage:repeated_inner[*].inner_repeated[0]', ['abc', 'aaa'])
-      test_query('pgpb.test.ExampleMessage:repeated_inner[*].inner_repeated[1]', ['def', 'bbb'])
-
-      test_sql("SELECT protobuf_query('pgpb.test.ExampleMessage:repeated_inner[*].inner_repeated[0]', #{pg_proto}) AS result;", ['abc'])
-      test_sql("SELECT protobuf_query('pgpb.test.ExampleMessage:repeated_inner[*].inner_repeated[1]', #{pg_proto}) AS result;", ['def'])
-      test_sql("SELECT COALESCE(protobuf_query('pgpb.test.ExampleMessage:repeated_inner[*].inner_repeated[2]', #{pg_proto}), 'none') AS result;", ['none'])
-    end
-
-    with_proto('repeated_inner: { repeated_inner: { inner_repeated: "abc", inner_repeated: "def" }, repeated_inner: { inner_repeated: "aaa" }, repeated_inner: {}, repeated_inner: { inner_repeated: "bbb" } }') do
-      test_query('pgpb.test.ExampleMessage:repeated_inner[*].repeated_inner[*]', ['{"innerRepeated":["abc","def"]}', '{"innerRepeated":["aaa"]}', '{}', '{"innerRepeated":["bbb"]}'])
-      test_query('pgpb.test.ExampleMessage:repeated_inner[*].repeated_inner[*].inner_repeated[*]', ['abc', 'def', 'aaa', 'bbb'])
-
-      test_sql("SELECT protobuf_query('pgpb.test.ExampleMessage:repeated_inner[*].repeated_inner[*].inner_repeated[0]', #{pg_proto}) AS result;", ['abc'])
-      test_sql("SELECT protobuf_query('pgpb.test.ExampleMessage:repeated_inner[*].repeated_inner[*].inner_repeated[1]', #{pg_proto}) AS result;", ['def'])
-      test_sql("SELECT COALESCE(protobuf_query('pgpb.test.ExampleMessage:repeated_inner[*].repeated_inner[*].inner_repeated[2]', #{pg_proto}), 'none') AS result;", ['none'])
-
-      test_sql("SELECT protobuf_query('pgpb.test.ExampleMessage:repeated_inner[0].repeated_inner[0].inner_repeated[0]', #{pg_proto}) AS result;", ['abc'])
-      test_sql("SELECT protobuf_query('pgpb.test.ExampleMessage:repeated_inner[0].repeated_inner[0].inner_repeated[1]', #{pg_proto}) AS result;", ['def'])
-      test_sql("SELECT protobuf_query('pgpb.test.ExampleMessage:repeated_inner[0].repeated_inner[1].inner_repeated[0]', #{pg_proto}) AS result;", ['aaa'])
-      test_sql("SELECT protobuf_query('pgpb.test.ExampleMessage:repeated_inner[0].repeated_inner[3].inner_repeated[0]', #{pg_proto}) AS result;", ['bbb'])
-    end
-
-    with_proto('repeated_inner: { repeated_inner: { inner_str: "abc" }, repeated_inner: { inner_str: "def" } }, repeated_inner: { repeated_inner: { inner_str: "aaa" }, repeated_inner: { inner_str: "bbb" } }') do
-      test_query('pgpb.test.ExampleMessage:repeated_inner[*].repeated_inner[*].inner_str', ['abc', 'def', 'aaa', 'bbb'])
-
-      test_sql("SELECT protobuf_query('pgpb.test.ExampleMessage:repeated_inner[0].repeated_inner[0].inner_str', #{pg_proto}) AS result;", ['abc'])
-      test_sql("SELECT protobuf_query('pgpb.test.ExampleMessage:repeated_inner[0].repeated_inner[1].inner_str', #{pg_proto}) AS result;", ['def'])
-      test_sql("SELECT protobuf_query('pgpb.test.ExampleMessage:repeated_inner[1].repeated_inner[0].inner_str', #{pg_proto}) AS result;", ['aaa'])
-      test_sql("SELECT protobuf_query('pgpb.test.ExampleMessage:repeated_inner[1].repeated_inner[1].inner_str', #{pg_proto}) AS result;", ['bbb'])
-    end
-
-    with_proto('repeated_inner: { inner_str: "lvl1", repeated_inner: { inner_str: "lvl2" } }') do
-      test_sql("SELECT protobuf_query('pgpb.test.ExampleMessage:repeated_inner[0].inner_str', #{pg_proto}) AS result;", ['lvl1'])
-      test_sql("SELECT protobuf_query('pgpb.test.ExampleMessage:repeated_inner[0].repeated_inner[0].inner_str', #{pg_proto}) AS result;", ['lvl2'])
+  section "Containment queries" do
+    with_proto('scalars { double_field: 0.25, int32_field: -123, sint32_field: -5, string_field: "xyz", bytes_field: "\\377" }, repeated_int32: 4, repeated_int32: 5, repeated_inner { inner_str: "A" }, repeated_inner { inner_str: "B" }') do
+      test_sql("SELECT #{pg_proto} @> 'int32:1.3=-123' AS result;", ['t'])
+      test_sql("SELECT #{pg_proto} @> 'int32:1.3=123' AS result;", ['f'])
+      test_sql("SELECT #{pg_proto} @> 'sint32:1.7=-5' AS result;", ['t'])
+      test_sql("SELECT #{pg_proto} @> 'double:1.1=0.25' AS result;", ['t'])
+      test_sql("SELECT #{pg_proto} @> 'string:1.14=xyz' AS result;", ['t'])
+      test_sql("SELECT #{pg_proto} @> 'bytes:1.15=\\xff' AS result;", ['t'])
+      # Packed
+      test_sql("SELECT #{pg_proto} @> 'int32:2=5' AS result;", ['t'])
+      test_sql("SELECT #{pg_proto} @> 'int32:2=6' AS result;", ['f'])
+      test_sql("SELECT #{pg_proto} @> 'string:5[*].1=B' AS result;", ['t'])
+      test_sql("SELECT #{pg_proto} @> 'string:5.1=C' AS result;", ['f'])
+
+      test_sql("CREATE TABLE gin_protobufs (proto BYTEA);", nil)
+      test_sql("INSERT INTO gin_protobufs VALUES (#{pg_proto}), (decode('2a030a0143', 'hex'));", nil)
+      test_sql("CREATE INDEX ON gin_protobufs USING gin (proto protobuf_path_ops);", nil)
+      test_sql("SET enable_seqscan = off;", nil)
+      test_sql("SELECT count(*) AS result FROM gin_protobufs WHERE proto @> 'string:5.1=B';", ['1'])
+      test_sql("SELECT count(*) AS result FROM gin_protobufs WHERE proto @> 'string:5.1=C';", ['1'])
+      test_sql("SELECT count(*) AS result FROM gin_protobufs WHERE proto @> 'int32:2=5';", ['1'])
+      test_sql("SELECT count(*) AS result FROM gin_protobufs WHERE proto @> 'int32:1.3=7';", ['0'])
+      test_sql("RESET enable_seqscan;", nil)
+      test_sql("DROP TABLE gin_protobufs;", nil)
     end
   end
 
-  section "Indexing into maps" do
-    with_proto('map_str2str: { key: "a", value: "AAA" }, map_str2str { key: "bb", value: "BBB" }') do
-      test_query('pgpb.test.ExampleMessage:map_str2str[a]', ['AAA'])
-      test_query('pgpb.test.ExampleMessage:map_str2str[bb]', ['BBB'])
-      test_query('pgpb.test.ExampleMessage:map_str2str[c]', [])
-      test_query('pgpb.test.ExampleMessage:map_str2str[*]', ['AAA', 'BBB'])
-    end
-
-    with_proto('map_int2str: { key: 123, value: "AAA" }, map_int2str { key: 456, value: "BBB" }') do
-      test_query('pgpb.test.ExampleMessage:map_int2str[123]', ['AAA'])
-      test_query('pgpb.test.ExampleMessage:map_int2str[456]', ['BBB'])
-      test_query('pgpb.test.ExampleMessage:map_int2str[789]', [])
-      test_query('pgpb.test.ExampleMessage:map_int2str[*]', ['AAA', 'BBB'])
-    end
-
-    with_proto('map_int2int: { key: 123, value: 100 }, map_int2int { key: 456, value: 200 }') do
-      test_query('pgpb.test.ExampleMessage:map_int2int[123]', ['100'])
-      test_query('pgpb.test.ExampleMessage:map_int2int[456]', ['200'])
-      test_query('pgpb.test.ExampleMessage:map_int2int[789]', [])
-      test_query('pgpb.test.ExampleMessage:map_int2int[*]', ['100', '200'])
-    end
-
-    with_proto('map_str2inner: { key: "x", value: { inner_str: "A" } }, map_str2inner { key: "y", value: { inner_str: "B" } }') do
-      test_query('pgpb.test.ExampleMessage:map_str2inner[x].inner_str', ['A'])
-      test_query('pgpb.test.ExampleMessage:map_str2inner[y].inner_str', ['B'])
-      test_query('pgpb.test.ExampleMessage:map_str2inner[z].inner_str', [])
-      test_query('pgpb.test.ExampleMessage:map_str2inner[*].inner_str', ['A', 'B'])
-    end
+  section "Parallel queries" do
+    test_sql("SELECT proname AS result FROM pg_proc WHERE proname LIKE 'protobuf\\_%' AND proparallel <> 's' ORDER BY proname;", ['protobuf_file_descriptor_sets_changed', 'protobuf_typmod_in'])
+    test_sql("CREATE TABLE parallel_protos AS SELECT i, protobuf_from_json_text('pgpb.test.ExampleMessage', '{\"scalars\":{\"int32Field\":' || i || '}}') AS proto FROM generate_series(1, 1000) AS i;", nil)
+    test_sql("SET parallel_setup_cost = 0;", nil)
+    test_sql("SET parallel_tuple_cost = 0;", nil)
+    test_sql("SET min_parallel_table_scan_size = 0;", nil)
+    test_sql("SELECT sum(protobuf_query_int8('pgpb.test.ExampleMessage:scalars.int32_field', proto)) AS result FROM parallel_protos;", ['500500'])
+    test_sql("SELECT length(protobuf_agg(proto, 1)) = sum(length(proto) + 2) AS result FROM parallel_protos;", ['t'])
+    test_sql("RESET parallel_setup_cost;", nil)
+    test_sql("RESET parallel_tuple_cost;", nil)
+    test_sql("RESET min_parallel_table_scan_size;", nil)
+    test_sql("DROP TABLE parallel_protos;", nil)
   end
 
-  section "Selecting all map keys" do
-    with_proto('map_int2str: { key: 123, value: "AAA" }, map_int2str { key: 456, value: "BBB" }') do
-      test_query('pgpb.test.ExampleMessage:map_int2str|keys', ['123', '456'])
-    end
+  section "Aggregating protobufs" do
+    with_proto('repeated_inner { inner_str: "a" } repeated_inner { } repeated_inner { inner_str: "c" }') do
+      items = ['inner_str: "a"', '', 'inner_str: "c"'].map do |text_format|
+        pg_binary(textformat_to_binary(text_format, 'main_descriptor_set.proto', 'pgpb.test.ExampleMessage.InnerMessage'))
+      end
+      values = "(1, #{items[0]}), (2, #{items[1]}), (3, NULL), (4, #{items[2]})"
+      test_sql("SELECT protobuf_agg(item, 5 ORDER BY i) AS result FROM (VALUES #{values}) AS t(i, item);", [pg_proto_raw])
+      test_sql("SELECT protobuf_query_array('pgpb.test.ExampleMessage:repeated_inner[*].inner_str', protobuf_agg(item, 5 ORDER BY i DESC)) AS result FROM (VALUES #{values}) AS t(i, item);", ['{c,a}'])
+    end
+    test_sql("SELECT protobuf_agg(item, 5) IS NULL AS result FROM (VALUES (NULL::BYTEA)) AS t(item);", ['t'])
+    test_sql("SELECT protobuf_agg(item, 5) IS NULL AS result FROM (VALUES ('\\x'::BYTEA)) AS t(item) WHERE false;", ['t'])
   end
 
-  section "Queries from explicitly specified file descriptor sets" do
+  section "Converting to JSON" do
     with_proto('scalars { int32_field: 123 }') do
-      test_query('default:pgpb.test.ExampleMessage:scalars.int32_field', ['123'])
+      test_sql("SELECT protobuf_to_json_text('pgpb.test.ExampleMessage', #{pg_proto}) AS result;", ['{"scalars":{"int32Field":123}}'])
     end
     with_proto('int32_field: 123', proto_file='other_descriptor_set.proto', proto_name='pgpb.test.other.MessageInOtherDescSet') do
-      test_query('other:pgpb.test.other.MessageInOtherDescSet:int32_field', ['123'])
-    end
-  end
-
-  section "Single result queries" do 
-    with_proto('repeated_int32: 123, repeated_int32: 456') do
-      # Should return just the first result
-      test_sql("SELECT protobuf_query('pgpb.test.ExampleMessage:repeated_int32[*]', #{pg_proto}) AS result;", ['123'])
-    end
-  end
-
-  section "Enums" do
-    with_proto('an_enum: EnumValue2') do
-      test_sql("SELECT protobuf_query('pgpb.test.ExampleMessage:an_enum', #{pg_proto}) AS result;", ['EnumValue2'])
-    end
-  end
-
-  section "Empty query" do
-    # protobuf_to_json() is equivalent to a query that specifies just the proto name
-    with_proto('scalars { int32_field: 123 }') do
-      test_sql("SELECT protobuf_query('pgpb.test.ExampleMessage:', #{pg_proto}) AS result;", ['{"scalars":{"int32Field":123}}'])
-    end
-  end
-
-  section "Array queries" do
-    with_proto('repeated_int32: 123, repeated_int32: 456') do
-      test_sql("SELECT protobuf_query_array('pgpb.test.ExampleMessage:repeated_int32[*]', #{pg_proto}) AS result;", ['{123,456}'])
+      test_sql("SELECT protobuf_to_json_text('other:pgpb.test.other.MessageInOtherDescSet', #{pg_proto}) AS result;", ['{"int32Field":123}'])
+      test_sql("SELECT protobuf_to_jsonb('other:pgpb.test.other.MessageInOtherDescSet', #{pg_proto}) AS result;", ['{"int32Field": 123}'])
     end
-    with_proto('map_int2str: { key: 123, value: "AAA" }, map_int2str { key: 456, value: "BBB" }') do
-      test_sql("SELECT protobuf_query_array('pgpb.test.ExampleMessage:map_int2str[*]', #{pg_proto}) AS result;", ['{AAA,BBB}'])
-      test_sql("SELECT protobuf_query_array('pgpb.test.ExampleMessage:map_int2str|keys', #{pg_proto}) AS result;", ['{123,456}'])
+    with_proto('scalars { int32_field: 123 int64_field: -5 float_field: 0.5 bytes_field: "\\x01\\x02" } repeated_int32: [1, 2] an_enum: EnumValue2 map_int2str { key: 3 value: "c" }') do
+      test_sql("SELECT protobuf_to_jsonb('pgpb.test.ExampleMessage', #{pg_proto}) AS result;", ['{"anEnum": "EnumValue2", "scalars": {"bytesField": "AQI=", "floatField": 0.5, "int32Field": 123, "int64Field": "-5"}, "mapInt2str": {"3": "c"}, "repeatedInt32": [1, 2]}'])
+      test_sql("SELECT protobuf_to_jsonb('pgpb.test.ExampleMessage', #{pg_proto}) = protobuf_to_json_text('pgpb.test.ExampleMessage', #{pg_proto})::jsonb AS result;", ['t'])
     end
-    with_proto('scalars { int32_field: 123 }') do
-      test_sql("SELECT protobuf_query_array('pgpb.test.ExampleMessage:', #{pg_proto}) AS result;", ['{"{\"scalars\":{\"int32Field\":123}}"}'])
-      test_sql("SELECT protobuf_query_array('pgpb.test.ExampleMessage:scalars', #{pg_proto}) AS result;", ['{"{\"int32Field\":123}"}'])
-      test_sql("SELECT protobuf_query_array('pgpb.test.ExampleMessage:scalars.int32_field', #{pg_proto}) AS result;", ['{123}'])
-      test_sql("SELECT protobuf_query_array('pgpb.test.ExampleMessage:scalars.string_field', #{pg_proto}) AS result;", ['{}'])
+    with_proto('repeated_inner { inner_str: "a" } repeated_inner { inner_str: "b" repeated_inner { inner_repeated: ["x", "y"] } } map_str2inner { key: "k" value { inner_str: "v" } }') do
+      test_sql("SELECT protobuf_to_jsonb('pgpb.test.ExampleMessage', #{pg_proto}) = protobuf_to_json_text('pgpb.test.ExampleMessage', #{pg_proto})::jsonb AS result;", ['t'])
     end
-  end
 
-  section "Converting to JSON" do
-    with_proto('scalars { int32_field: 123 }') do
-      test_sql("SELECT protobuf_to_json_text('pgpb.test.ExampleMessage', #{pg_proto}) AS result;", ['{"scalars":{"int32Field":123}}'])
-    end
-    with_proto('int32_field: 123', proto_file='other_descriptor_set.proto', proto_name='pgpb.test.other.MessageInOtherDescSet') do
-      test_sql("SELECT protobuf_to_json_text('other:pgpb.test.other.MessageInOtherDescSet', #{pg_proto}) AS result;", ['{"int32Field":123}'])
+    # Both JSON writers must give the same results
+    ['native', 'library'].each do |writer|
+      section "JSON writer #{writer}" do
+        test_sql("SET postgres_protobuf.json_writer = #{writer};", nil)
+        with_proto('scalars { int64_field: -5 double_field: 0.25 string_field: "a\\"b\\n" } repeated_int32: [1, 2] an_enum: EnumValue2') do
+          test_sql("SELECT protobuf_to_json_text('pgpb.test.ExampleMessage', #{pg_proto}) AS result;", ['{"scalars":{"doubleField":0.25,"int64Field":"-5","stringField":"a\\"b\\n"},"repeatedInt32":[1,2],"anEnum":"EnumValue2"}'])
+          test_query('pgpb.test.ExampleMessage:scalars', ['{"doubleField":0.25,"int64Field":"-5","stringField":"a\\"b\\n"}'])
+        end
+        test_sql("RESET postgres_protobuf.json_writer;", nil)
+      end
     end
   end
 
@@ -389,6 +804,32 @@ TestGen.new(mode).generate do
     with_proto('int32_field: 123', proto_file='other_descriptor_set.proto', proto_name='pgpb.test.other.MessageInOtherDescSet') do
       json = pg_quote('{"int32Field":123}')
       test_sql("SELECT protobuf_from_json_text('other:pgpb.test.other.MessageInOtherDescSet', #{json}) AS result;", [pg_proto_raw])
+      test_sql("SELECT protobuf_from_jsonb('other:pgpb.test.other.MessageInOtherDescSet', #{json}) AS result;", [pg_proto_raw])
+    end
+    with_proto('scalars { int32_field: 123 }') do
+      test_sql("SELECT protobuf_from_jsonb('pgpb.test.ExampleMessage', '{\"scalars\": {\"int32Field\": 123}}') AS result;", [pg_proto_raw])
+      # Original field names work too
+      test_sql("SELECT protobuf_from_jsonb('pgpb.test.ExampleMessage', '{\"scalars\": {\"int32_field\": \"123\"}}') AS result;", [pg_proto_raw])
+    end
+    with_proto('scalars { int64_field: -5 float_field: 0.5 bytes_field: "\\x01\\x02" } repeated_int32: [1, 2] an_enum: EnumValue2 map_int2str { key: 3 value: "c" } repeated_inner { inner_str: "a" }') do
+      test_sql("SELECT protobuf_to_jsonb('pgpb.test.ExampleMessage', protobuf_from_jsonb('pgpb.test.ExampleMessage', protobuf_to_jsonb('pgpb.test.ExampleMessage', #{pg_proto}))) = protobuf_to_jsonb('pgpb.test.ExampleMessage', #{pg_proto}) AS result;", ['t'])
+    end
+
+    # Both JSON readers must give the same results
+    ['native', 'library'].each do |reader|
+      section "JSON reader #{reader}" do
+        test_sql("SET postgres_protobuf.json_reader = #{reader};", nil)
+        json = '{"scalars":{"doubleField":0.25,"int64Field":"-5","boolField":true,"stringField":"a\\"b\\n"},"repeatedInt32":[1,2],"anEnum":"EnumValue2","mapInt2str":{"3":"c"}}'
+        test_sql("SELECT protobuf_to_json_text('pgpb.test.ExampleMessage', protobuf_from_json_text('pgpb.test.ExampleMessage', #{pg_quote(json)})) AS result;", [json])
+        # Original field names, quoted numbers and nulls
+        json = '{"scalars":{"int32_field":"123","uint32Field":1e3,"stringField":"\\u00e9\\ud83d\\ude00"},"inner":null,"repeated_inner":[{"innerStr":"a"}]}'
+        test_sql("SELECT protobuf_to_json_text('pgpb.test.ExampleMessage', protobuf_from_json_text('pgpb.test.ExampleMessage', #{pg_quote(json)})) AS result;", ["{\"scalars\":{\"int32Field\":123,\"uint32Field\":1000,\"stringField\":\"\u00e9\u{1F600}\"},\"repeatedInner\":[{\"innerStr\":\"a\"}]}"])
+        test_sql("RESET postgres_protobuf.json_reader;", nil)
+      end
+    end
+    with_proto('scalars { int64_field: -5 double_field: 0.25 string_field: "a\\"b\\n" bool_field: true } repeated_int32: [1, 2] an_enum: EnumValue2 map_int2str { key: 3 value: "c" }') do
+      json = pg_quote('{"scalars":{"doubleField":0.25,"int64Field":"-5","boolField":true,"stringField":"a\\"b\\n"},"repeatedInt32":[1,2],"anEnum":"EnumValue2","mapInt2str":{"3":"c"}}')
+      test_sql("SELECT protobuf_from_json_text('pgpb.test.ExampleMessage', #{json}) AS result;", [pg_proto_raw])
     end
   end
 end
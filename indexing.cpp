@@ -0,0 +1,402 @@
+#include "indexing.hpp"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <limits>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "postgres_protobuf_common.hpp"
+#include "querying.hpp"
+#include "wire_format.hpp"
+
+#include <google/protobuf/descriptor.h>
+#include <google/protobuf/wire_format_lite.h>
+
+namespace postgres_protobuf {
+namespace indexing {
+
+namespace pb = ::google::protobuf;
+
+using querying::BadQuery;
+using wire_format::ReadVarint;
+
+namespace {
+
+// What a key says about the value at its path. Wire types double as kinds.
+enum KeyKind : uint8_t {
+  kVarint = 0,
+  kFixed64 = 1,
+  kBytes = 2,
+  kFixed32 = 5,
+  // A length-delimited field, which may be a packed field, is at the path.
+  kLengthDelimitedPresent = 0x10,
+};
+
+// 32-bit FNV-1a. Keys are stored in indexes, so this must never change.
+class KeyHasher {
+ public:
+  explicit KeyHasher(const std::vector<uint32_t>& path) : hash_(2166136261u) {
+    AddNumber(path.size());
+    for (uint32_t number : path) {
+      AddNumber(number);
+    }
+  }
+
+  void AddNumber(uint64_t n) {
+    for (int i = 0; i < 8; ++i) {
+      AddByte(static_cast<uint8_t>(n >> (8 * i)));
+    }
+  }
+
+  void AddBytes(std::string_view bytes) {
+    for (char c : bytes) {
+      AddByte(static_cast<uint8_t>(c));
+    }
+  }
+
+  void AddByte(uint8_t byte) {
+    hash_ ^= byte;
+    hash_ *= 16777619u;
+  }
+
+  int32_t Finish() const { return static_cast<int32_t>(hash_); }
+
+ private:
+  uint32_t hash_;
+};
+
+int32_t NumberKey(const std::vector<uint32_t>& path, int wire_type,
+                  uint64_t n) {
+  KeyHasher hasher(path);
+  hasher.AddByte(wire_type);
+  hasher.AddNumber(n);
+  return hasher.Finish();
+}
+
+int32_t BytesKey(const std::vector<uint32_t>& path, std::string_view bytes) {
+  KeyHasher hasher(path);
+  hasher.AddByte(kBytes);
+  hasher.AddBytes(bytes);
+  return hasher.Finish();
+}
+
+int32_t PresenceKey(const std::vector<uint32_t>& path) {
+  KeyHasher hasher(path);
+  hasher.AddByte(kLengthDelimitedPresent);
+  return hasher.Finish();
+}
+
+struct Field {
+  uint32_t number;
+  int wire_type;
+  uint64_t n;              // Unless length-delimited
+  std::string_view bytes;  // If length-delimited
+};
+
+// Reads a value that isn't length-delimited. Returns null if it's invalid.
+const uint8_t* ReadValue(const uint8_t* p, const uint8_t* end, int wire_type,
+                         uint64_t* n) {
+  switch (wire_type) {
+    case 0:
+      return ReadVarint(p, end, n);
+    case 1:
+      if (end - p < 8) {
+        return nullptr;
+      }
+      std::memcpy(n, p, 8);
+      return p + 8;
+    case 5: {
+      if (end - p < 4) {
+        return nullptr;
+      }
+      uint32_t n32;
+      std::memcpy(&n32, p, 4);
+      *n = n32;
+      return p + 4;
+    }
+    default:
+      return nullptr;
+  }
+}
+
+// Returns null if the field is invalid. Groups are not supported.
+const uint8_t* ReadField(const uint8_t* p, const uint8_t* end, Field* field) {
+  uint64_t tag;
+  p = ReadVarint(p, end, &tag);
+  if (p == nullptr || tag > std::numeric_limits<uint32_t>::max() ||
+      (tag >> 3) == 0) {
+    return nullptr;
+  }
+  field->number = static_cast<uint32_t>(tag >> 3);
+  field->wire_type = tag & 0x7;
+  if (field->wire_type != 2) {
+    return ReadValue(p, end, field->wire_type, &field->n);
+  }
+
+  uint64_t size;
+  p = ReadVarint(p, end, &size);
+  if (p == nullptr || size > static_cast<uint64_t>(end - p)) {
+    return nullptr;
+  }
+  field->bytes = std::string_view(reinterpret_cast<const char*>(p), size);
+  return p + size;
+}
+
+const uint8_t* Begin(std::string_view bytes) {
+  return reinterpret_cast<const uint8_t*>(bytes.data());
+}
+
+const uint8_t* End(std::string_view bytes) {
+  return Begin(bytes) + bytes.size();
+}
+
+// Whether length-delimited contents are treated as a submessage.
+bool IsMessage(std::string_view bytes) {
+  const uint8_t* p = Begin(bytes);
+  const uint8_t* end = End(bytes);
+  Field field;
+  while (p < end) {
+    p = ReadField(p, end, &field);
+    if (p == nullptr) {
+      return false;
+    }
+  }
+  return true;
+}
+
+void AddKeys(const uint8_t* p, const uint8_t* end,
+             std::vector<uint32_t>* path, std::vector<int32_t>* keys) {
+  Field field;
+  while (p < end) {
+    p = ReadField(p, end, &field);
+    if (p == nullptr) {
+      // Only possible at the root, since submessages are checked first
+      throw BadProto("invalid protobuf field");
+    }
+
+    path->push_back(field.number);
+    if (field.wire_type != 2) {
+      keys->push_back(NumberKey(*path, field.wire_type, field.n));
+    } else {
+      keys->push_back(BytesKey(*path, field.bytes));
+      keys->push_back(PresenceKey(*path));
+      if (path->size() < kMaxPathLength && IsMessage(field.bytes)) {
+        AddKeys(Begin(field.bytes), End(field.bytes), path, keys);
+      }
+    }
+    path->pop_back();
+  }
+}
+
+// Parses the `<value>` of a query into its encoding on the wire.
+void ParseValue(const std::string& s, pb::FieldDescriptor::Type ty,
+                uint64_t* n, std::string* bytes) {
+  using T = pb::FieldDescriptor::Type;
+  using WFL = pb::internal::WireFormatLite;
+
+  if (ty == T::TYPE_STRING) {
+    *bytes = s;
+    return;
+  }
+  if (ty == T::TYPE_BYTES) {
+    *bytes = querying::ParseBytesValue(s);
+    return;
+  }
+  if (ty == T::TYPE_BOOL) {
+    *n = querying::ParseBoolValue(s) ? 1 : 0;
+    return;
+  }
+
+  querying::CheckNumberValue(s);
+  char* end;
+  errno = 0;
+  switch (ty) {
+    case T::TYPE_DOUBLE:
+      *n = WFL::EncodeDouble(std::strtod(s.c_str(), &end));
+      break;
+    case T::TYPE_FLOAT:
+      *n = WFL::EncodeFloat(std::strtof(s.c_str(), &end));
+      break;
+    case T::TYPE_INT64:
+    case T::TYPE_SFIXED64:
+      *n = static_cast<uint64_t>(std::strtoll(s.c_str(), &end, 10));
+      break;
+    case T::TYPE_SINT64:
+      *n = WFL::ZigZagEncode64(std::strtoll(s.c_str(), &end, 10));
+      break;
+    case T::TYPE_UINT64:
+    case T::TYPE_FIXED64:
+      if (s[0] == '-') {
+        throw BadQuery("invalid number: " + s);
+      }
+      *n = std::strtoull(s.c_str(), &end, 10);
+      break;
+    case T::TYPE_INT32:
+    case T::TYPE_SFIXED32:
+    case T::TYPE_SINT32: {
+      long long l = std::strtoll(s.c_str(), &end, 10);
+      if (l < std::numeric_limits<int32_t>::min() ||
+          l > std::numeric_limits<int32_t>::max()) {
+        errno = ERANGE;
+      }
+      int32_t i = static_cast<int32_t>(l);
+      if (ty == T::TYPE_SINT32) {
+        *n = WFL::ZigZagEncode32(i);
+      } else if (ty == T::TYPE_SFIXED32) {
+        *n = static_cast<uint32_t>(i);
+      } else {
+        // Negative int32s are sign-extended to 64 bits on the wire
+        *n = static_cast<uint64_t>(static_cast<int64_t>(i));
+      }
+      break;
+    }
+    case T::TYPE_UINT32:
+    case T::TYPE_FIXED32: {
+      unsigned long long u = std::strtoull(s.c_str(), &end, 10);
+      if (s[0] == '-' || u > std::numeric_limits<uint32_t>::max()) {
+        errno = ERANGE;
+      }
+      *n = static_cast<uint32_t>(u);
+      break;
+    }
+    default:
+      throw BadQuery(std::string("unsupported type: ") +
+                     pb::FieldDescriptor::TypeName(ty));
+  }
+  if (end != s.c_str() + s.size()) {
+    throw BadQuery("invalid number: " + s);
+  }
+  if (errno == ERANGE) {
+    throw BadQuery("number out of range: " + s);
+  }
+}
+
+}  // namespace
+
+ContainsQuery::ContainsQuery(const std::string& query) {
+  using WFL = pb::internal::WireFormatLite;
+
+  std::string::size_type colon = query.find(':');
+  std::string::size_type equals = query.find('=');
+  if (colon == std::string::npos || equals == std::string::npos ||
+      equals < colon) {
+    throw BadQuery(
+        "invalid protobuf query - expected: <type>:<path>=<value>");
+  }
+
+  pb::FieldDescriptor::Type ty =
+      querying::ParseScalarType(query.substr(0, colon));
+  wire_type_ = WFL::WireTypeForFieldType(static_cast<WFL::FieldType>(ty));
+  if (pb::FieldDescriptor::IsTypePackable(ty)) {
+    packed_wire_type_ = wire_type_;
+  }
+
+  std::string::size_type part_start = colon + 1;
+  while (part_start <= equals) {
+    std::string::size_type part_end = query.find('.', part_start);
+    if (part_end == std::string::npos || part_end > equals) {
+      part_end = equals;
+    }
+    std::string part = query.substr(part_start, part_end - part_start);
+    // `[*]` is allowed for clarity, since every element matches anyway
+    if (part.size() > 3 && part.compare(part.size() - 3, 3, "[*]") == 0) {
+      part.resize(part.size() - 3);
+    }
+    char* end;
+    long number = std::strtol(part.c_str(), &end, 10);
+    if (part.empty() || end != part.c_str() + part.size() || number <= 0 ||
+        number > pb::FieldDescriptor::kMaxNumber) {
+      throw BadQuery(std::string("invalid field number in query: ") + part);
+    }
+    path_.push_back(static_cast<uint32_t>(number));
+    part_start = part_end + 1;
+  }
+  if (path_.size() > kMaxPathLength) {
+    throw BadQuery("query path is longer than the " +
+                   std::to_string(kMaxPathLength) +
+                   " fields that can be indexed");
+  }
+
+  number_ = 0;
+  ParseValue(query.substr(equals + 1), ty, &number_, &bytes_);
+}
+
+std::vector<int32_t> ContainsQuery::Keys() const {
+  std::vector<int32_t> keys;
+  if (wire_type_ == 2) {
+    keys.push_back(BytesKey(path_, bytes_));
+  } else {
+    keys.push_back(NumberKey(path_, wire_type_, number_));
+  }
+  if (packed_wire_type_) {
+    keys.push_back(PresenceKey(path_));
+  }
+  return keys;
+}
+
+bool ContainsQuery::Matches(const std::uint8_t* proto_data,
+                            size_t proto_len) const {
+  return MatchesIn(proto_data, proto_data + proto_len, 0);
+}
+
+bool ContainsQuery::MatchesIn(const uint8_t* p, const uint8_t* end,
+                              size_t depth) const {
+  bool last = depth + 1 == path_.size();
+  Field field;
+  while (p < end) {
+    p = ReadField(p, end, &field);
+    if (p == nullptr) {
+      throw BadProto("invalid protobuf field");
+    }
+    if (field.number != path_[depth]) {
+      continue;
+    }
+
+    if (!last) {
+      if (field.wire_type == 2 && IsMessage(field.bytes) &&
+          MatchesIn(Begin(field.bytes), End(field.bytes), depth + 1)) {
+        return true;
+      }
+    } else if (field.wire_type == wire_type_) {
+      if (wire_type_ == 2 ? field.bytes == bytes_ : field.n == number_) {
+        return true;
+      }
+    } else if (field.wire_type == 2 && packed_wire_type_) {
+      if (MatchesPacked(Begin(field.bytes), End(field.bytes))) {
+        return true;
+      }
+    }
+  }
+  return false;
+}
+
+bool ContainsQuery::MatchesPacked(const uint8_t* p, const uint8_t* end) const {
+  // Only a valid packed field counts, like for the index
+  bool found = false;
+  uint64_t n;
+  while (p < end) {
+    p = ReadValue(p, end, *packed_wire_type_, &n);
+    if (p == nullptr) {
+      return false;
+    }
+    found = found || n == number_;
+  }
+  return found;
+}
+
+std::vector<int32_t> ExtractKeys(const std::uint8_t* proto_data,
+                                 size_t proto_len) {
+  std::vector<int32_t> keys;
+  std::vector<uint32_t> path;
+  AddKeys(proto_data, proto_data + proto_len, &path, &keys);
+  std::sort(keys.begin(), keys.end());
+  keys.erase(std::unique(keys.begin(), keys.end()), keys.end());
+  return keys;
+}
+
+}  // namespace indexing
+}  // namespace postgres_protobuf
@@ -0,0 +1,58 @@
+#ifndef POSTGRES_PROTOBUF_INDEXING_HPP_
+#define POSTGRES_PROTOBUF_INDEXING_HPP_
+
+#include <cstdint>
+#include <optional>
+#include <string>
+#include <vector>
+
+namespace postgres_protobuf {
+namespace indexing {
+
+// Support for GIN indexes of protobufs. Like queries by field number, these
+// don't use a schema, so an index doesn't depend on anything that may change.
+//
+// The index has a key for every field value in the protobuf, made from the
+// path of field numbers leading to it and the value as encoded on the wire.
+// Length-delimited fields are indexed as bytes, and also as submessages if
+// they parse as such. Packed fields can't be told apart from bytes without a
+// schema, so for them there's only a key saying that the path exists.
+
+// Submessages at paths longer than this aren't indexed.
+constexpr size_t kMaxPathLength = 32;
+
+// A query of the form `<type>:<path>=<value>` for the `@>` operator. It
+// matches protobufs that have the value at the path of field numbers.
+class ContainsQuery {
+ public:
+  // Throws BadQuery.
+  explicit ContainsQuery(const std::string& query);
+
+  // Keys of which at least one is indexed for every protobuf that matches.
+  std::vector<int32_t> Keys() const;
+
+  // Throws BadProto if the protobuf is invalid.
+  bool Matches(const std::uint8_t* proto_data, size_t proto_len) const;
+
+ private:
+  std::vector<uint32_t> path_;
+  int wire_type_;
+  uint64_t number_;    // Unless `wire_type_` is 2
+  std::string bytes_;  // If `wire_type_` is 2
+  // If the value's type may be packed, the wire type of packed elements.
+  std::optional<int> packed_wire_type_;
+
+  bool MatchesIn(const std::uint8_t* p, const std::uint8_t* end,
+                 size_t depth) const;
+  bool MatchesPacked(const std::uint8_t* p, const std::uint8_t* end) const;
+};
+
+// Returns the distinct keys to index for a protobuf.
+// Throws BadProto if the protobuf is invalid.
+std::vector<int32_t> ExtractKeys(const std::uint8_t* proto_data,
+                                 size_t proto_len);
+
+}  // namespace indexing
+}  // namespace postgres_protobuf
+
+#endif  // POSTGRES_PROTOBUF_INDEXING_HPP_
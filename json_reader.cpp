@@ -0,0 +1,757 @@
+#include "json_reader.hpp"
+
+#include "json_writer.hpp"
+#include "postgres_protobuf_common.hpp"
+#include "querying.hpp"
+
+#include <google/protobuf/util/json_util.h>
+#include <google/protobuf/wire_format_lite.h>
+
+#include <cerrno>
+#include <charconv>
+#include <cmath>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <limits>
+
+namespace postgres_protobuf {
+namespace json_reader {
+
+namespace {
+
+using descriptor_db::DescSet;
+using WireFormatLite = pb::internal::WireFormatLite;
+
+const char kTypeUrlPrefix[] = "type.googleapis.com/";
+
+Implementation implementation = Implementation::Native;
+
+[[noreturn]] void ThrowInvalidValue(const pb::FieldDescriptor* fd,
+                                    std::string_view value) {
+  throw BadProto("invalid value for field " + fd->full_name() + ": " +
+                 std::string(value));
+}
+
+int FieldWireType(const pb::FieldDescriptor* fd) {
+  return WireFormatLite::WireTypeForFieldType(
+      static_cast<WireFormatLite::FieldType>(fd->type()));
+}
+
+// The wire format is appended to a single string.
+
+void PutVarint(uint64_t value, std::string* out) {
+  char buf[10];
+  int n = 0;
+  while (value >= 0x80) {
+    buf[n++] = static_cast<char>(value | 0x80);
+    value >>= 7;
+  }
+  buf[n++] = static_cast<char>(value);
+  out->append(buf, n);
+}
+
+void PutFixed32(uint32_t value, std::string* out) {
+  char buf[4];
+  for (int i = 0; i < 4; ++i) {
+    buf[i] = static_cast<char>(value >> (8 * i));
+  }
+  out->append(buf, 4);
+}
+
+void PutFixed64(uint64_t value, std::string* out) {
+  char buf[8];
+  for (int i = 0; i < 8; ++i) {
+    buf[i] = static_cast<char>(value >> (8 * i));
+  }
+  out->append(buf, 8);
+}
+
+void PutTag(int number, int wire_type, std::string* out) {
+  PutVarint(WireFormatLite::MakeTag(
+                number, static_cast<WireFormatLite::WireType>(wire_type)),
+            out);
+}
+
+// Length-delimited values are written after a one-byte placeholder for their
+// length, which is widened afterwards if needed. This way submessages don't
+// need buffers of their own.
+size_t BeginLengthDelimited(std::string* out) {
+  out->push_back('\0');
+  return out->size();
+}
+
+void EndLengthDelimited(size_t start, std::string* out) {
+  uint64_t len = out->size() - start;
+  char buf[10];
+  int n = 0;
+  while (len >= 0x80) {
+    buf[n++] = static_cast<char>(len | 0x80);
+    len >>= 7;
+  }
+  buf[n++] = static_cast<char>(len);
+  if (n > 1) {
+    out->insert(start, n - 1, '\0');
+  }
+  memcpy(&(*out)[start - 1], buf, n);
+}
+
+class Parser {
+ public:
+  Parser(const DescSet& desc_set, std::string_view json)
+      : desc_set_(desc_set),
+        begin_(json.data()),
+        p_(json.data()),
+        end_(json.data() + json.size()) {}
+
+  void Parse(const pb::Descriptor* desc, std::string* out) {
+    ParseMessage(desc, out, 0);
+    SkipWhitespace();
+    if (p_ != end_) {
+      Fail("unexpected text after the JSON object");
+    }
+  }
+
+ private:
+  const DescSet& desc_set_;
+  const char* const begin_;
+  const char* p_;
+  const char* const end_;
+  std::string str_;  // For strings with escapes
+
+  [[noreturn]] void Fail(const std::string& what) {
+    throw BadProto("invalid JSON: " + what + " at offset " +
+                   std::to_string(p_ - begin_));
+  }
+
+  void SkipWhitespace() {
+    while (p_ < end_ &&
+           (*p_ == ' ' || *p_ == '\n' || *p_ == '\r' || *p_ == '\t')) {
+      ++p_;
+    }
+  }
+
+  bool Consume(char c) {
+    SkipWhitespace();
+    if (p_ < end_ && *p_ == c) {
+      ++p_;
+      return true;
+    }
+    return false;
+  }
+
+  void Expect(char c) {
+    if (!Consume(c)) {
+      Fail(std::string("expected '") + c + "'");
+    }
+  }
+
+  bool ConsumeLiteral(std::string_view literal) {
+    SkipWhitespace();
+    if (static_cast<size_t>(end_ - p_) >= literal.size() &&
+        memcmp(p_, literal.data(), literal.size()) == 0) {
+      p_ += literal.size();
+      return true;
+    }
+    return false;
+  }
+
+  bool AtString() {
+    SkipWhitespace();
+    return p_ < end_ && *p_ == '"';
+  }
+
+  // The result is valid until the next call.
+  std::string_view ParseString() {
+    if (!AtString()) {
+      Fail("expected a string");
+    }
+    const char* start = ++p_;
+    while (p_ < end_ && *p_ != '"' && *p_ != '\\' &&
+           static_cast<unsigned char>(*p_) >= 0x20) {
+      ++p_;
+    }
+    if (p_ < end_ && *p_ == '"') {
+      return std::string_view(start, p_++ - start);
+    }
+
+    str_.assign(start, p_ - start);
+    while (true) {
+      if (p_ == end_) {
+        Fail("unterminated string");
+      }
+      char c = *p_++;
+      if (c == '"') {
+        return str_;
+      } else if (static_cast<unsigned char>(c) < 0x20) {
+        --p_;
+        Fail("control character in string");
+      } else if (c != '\\') {
+        str_.push_back(c);
+        continue;
+      }
+      if (p_ == end_) {
+        Fail("unterminated string");
+      }
+      switch (*p_++) {
+        case '"':
+          str_.push_back('"');
+          break;
+        case '\\':
+          str_.push_back('\\');
+          break;
+        case '/':
+          str_.push_back('/');
+          break;
+        case 'b':
+          str_.push_back('\b');
+          break;
+        case 'f':
+          str_.push_back('\f');
+          break;
+        case 'n':
+          str_.push_back('\n');
+          break;
+        case 'r':
+          str_.push_back('\r');
+          break;
+        case 't':
+          str_.push_back('\t');
+          break;
+        case 'u':
+          AppendUtf8(ParseUnicodeEscape());
+          break;
+        default:
+          --p_;
+          Fail("invalid escape in string");
+      }
+    }
+  }
+
+  // Parses what follows `\u`, including the low half of a surrogate pair.
+  uint32_t ParseUnicodeEscape() {
+    uint32_t code_point = ParseHex4();
+    if (code_point >= 0xdc00 && code_point <= 0xdfff) {
+      Fail("unpaired surrogate in string");
+    } else if (code_point >= 0xd800 && code_point <= 0xdbff) {
+      if (!ConsumeRaw("\\u")) {
+        Fail("unpaired surrogate in string");
+      }
+      uint32_t low = ParseHex4();
+      if (low < 0xdc00 || low > 0xdfff) {
+        Fail("unpaired surrogate in string");
+      }
+      code_point = 0x10000 + ((code_point - 0xd800) << 10) + (low - 0xdc00);
+    }
+    return code_point;
+  }
+
+  bool ConsumeRaw(std::string_view s) {
+    if (static_cast<size_t>(end_ - p_) >= s.size() &&
+        memcmp(p_, s.data(), s.size()) == 0) {
+      p_ += s.size();
+      return true;
+    }
+    return false;
+  }
+
+  uint32_t ParseHex4() {
+    if (end_ - p_ < 4) {
+      Fail("invalid \\u escape in string");
+    }
+    uint32_t value = 0;
+    for (int i = 0; i < 4; ++i) {
+      char c = *p_++;
+      int digit;
+      if (c >= '0' && c <= '9') {
+        digit = c - '0';
+      } else if (c >= 'a' && c <= 'f') {
+        digit = c - 'a' + 10;
+      } else if (c >= 'A' && c <= 'F') {
+        digit = c - 'A' + 10;
+      } else {
+        --p_;
+        Fail("invalid \\u escape in string");
+      }
+      value = (value << 4) | digit;
+    }
+    return value;
+  }
+
+  void AppendUtf8(uint32_t code_point) {
+    if (code_point < 0x80) {
+      str_.push_back(static_cast<char>(code_point));
+    } else if (code_point < 0x800) {
+      str_.push_back(static_cast<char>(0xc0 | (code_point >> 6)));
+      str_.push_back(static_cast<char>(0x80 | (code_point & 0x3f)));
+    } else if (code_point < 0x10000) {
+      str_.push_back(static_cast<char>(0xe0 | (code_point >> 12)));
+      str_.push_back(static_cast<char>(0x80 | ((code_point >> 6) & 0x3f)));
+      str_.push_back(static_cast<char>(0x80 | (code_point & 0x3f)));
+    } else {
+      str_.push_back(static_cast<char>(0xf0 | (code_point >> 18)));
+      str_.push_back(static_cast<char>(0x80 | ((code_point >> 12) & 0x3f)));
+      str_.push_back(static_cast<char>(0x80 | ((code_point >> 6) & 0x3f)));
+      str_.push_back(static_cast<char>(0x80 | (code_point & 0x3f)));
+    }
+  }
+
+  // Numbers may also be given as strings in protobuf JSON.
+  // The text is checked when it's converted.
+  std::string_view ParseNumberText(const pb::FieldDescriptor* fd) {
+    if (AtString()) {
+      return ParseString();
+    }
+    const char* start = p_;
+    while (p_ < end_ && ((*p_ >= '0' && *p_ <= '9') || *p_ == '-' ||
+                         *p_ == '+' || *p_ == '.' || *p_ == 'e' ||
+                         *p_ == 'E')) {
+      ++p_;
+    }
+    if (p_ == start) {
+      ThrowTypeMismatch(fd, "a number");
+    }
+    return std::string_view(start, p_ - start);
+  }
+
+  // Skips a JSON value, checking only its nesting.
+  void SkipValue(int depth) {
+    querying::CheckRecursionDepth(depth);
+    if (AtString()) {
+      ParseString();
+    } else if (Consume('{')) {
+      if (Consume('}')) {
+        return;
+      }
+      do {
+        ParseString();
+        Expect(':');
+        SkipValue(depth + 1);
+      } while (Consume(','));
+      Expect('}');
+    } else if (Consume('[')) {
+      if (Consume(']')) {
+        return;
+      }
+      do {
+        SkipValue(depth + 1);
+      } while (Consume(','));
+      Expect(']');
+    } else if (!ConsumeLiteral("null") && !ConsumeLiteral("true") &&
+               !ConsumeLiteral("false")) {
+      const char* start = p_;
+      while (p_ < end_ && ((*p_ >= '0' && *p_ <= '9') || *p_ == '-' ||
+                           *p_ == '+' || *p_ == '.' || *p_ == 'e' ||
+                           *p_ == 'E')) {
+        ++p_;
+      }
+      if (p_ == start) {
+        Fail("expected a JSON value");
+      }
+    }
+  }
+
+  void ParseMessage(const pb::Descriptor* desc, std::string* out, int depth) {
+    querying::CheckRecursionDepth(depth);
+    if (!Consume('{')) {
+      throw BadProto("expected a JSON object for " + desc->full_name());
+    }
+    if (Consume('}')) {
+      return;
+    }
+    do {
+      std::string_view key = ParseString();
+      const pb::FieldDescriptor* fd = desc_set_.FindJsonField(desc, key);
+      if (fd == nullptr) {
+        throw BadProto("message " + desc->full_name() + " has no field " +
+                       std::string(key));
+      }
+      Expect(':');
+      ParseField(fd, out, depth);
+    } while (Consume(','));
+    Expect('}');
+  }
+
+  void ParseField(const pb::FieldDescriptor* fd, std::string* out,
+                  int depth) {
+    if (ConsumeLiteral("null")) {
+      // Null means the default, except where null is a value itself.
+      if (fd->type() == pb::FieldDescriptor::TYPE_ENUM &&
+          fd->enum_type()->full_name() == "google.protobuf.NullValue") {
+        PutTag(fd->number(), WireFormatLite::WIRETYPE_VARINT, out);
+        PutVarint(0, out);
+      } else if (fd->type() == pb::FieldDescriptor::TYPE_MESSAGE &&
+                 fd->message_type()->full_name() == "google.protobuf.Value") {
+        PutTag(fd->number(), WireFormatLite::WIRETYPE_LENGTH_DELIMITED, out);
+        std::string value = LibraryJsonToProtobuf(
+            desc_set_.type_resolver.get(), fd->message_type(), "null");
+        PutVarint(value.size(), out);
+        out->append(value);
+      }
+      return;
+    }
+    if (fd->is_map()) {
+      ParseMap(fd, out, depth);
+    } else if (fd->is_repeated()) {
+      ParseRepeated(fd, out, depth);
+    } else {
+      ParseValue(fd, out, depth);
+    }
+  }
+
+  void ParseRepeated(const pb::FieldDescriptor* fd, std::string* out,
+                     int depth) {
+    if (!Consume('[')) {
+      ThrowTypeMismatch(fd, "an array");
+    }
+    if (Consume(']')) {
+      return;
+    }
+    if (fd->is_packed()) {
+      PutTag(fd->number(), WireFormatLite::WIRETYPE_LENGTH_DELIMITED, out);
+      size_t start = BeginLengthDelimited(out);
+      do {
+        ParseScalar(fd, false, out);
+      } while (Consume(','));
+      EndLengthDelimited(start, out);
+    } else {
+      do {
+        ParseValue(fd, out, depth);
+      } while (Consume(','));
+    }
+    if (!Consume(']')) {
+      Fail("expected ',' or ']'");
+    }
+  }
+
+  void ParseMap(const pb::FieldDescriptor* fd, std::string* out, int depth) {
+    if (!Consume('{')) {
+      ThrowTypeMismatch(fd, "an object");
+    }
+    if (Consume('}')) {
+      return;
+    }
+    const pb::FieldDescriptor* key_fd =
+        fd->message_type()->FindFieldByNumber(1);
+    const pb::FieldDescriptor* value_fd =
+        fd->message_type()->FindFieldByNumber(2);
+    do {
+      PutTag(fd->number(), WireFormatLite::WIRETYPE_LENGTH_DELIMITED, out);
+      size_t start = BeginLengthDelimited(out);
+
+      std::string_view key = ParseString();
+      PutTag(1, FieldWireType(key_fd), out);
+      if (key_fd->type() == pb::FieldDescriptor::TYPE_BOOL) {
+        if (key != "true" && key != "false") {
+          ThrowTypeMismatch(key_fd, "true or false");
+        }
+        PutVarint(key == "true", out);
+      } else if (key_fd->type() == pb::FieldDescriptor::TYPE_STRING) {
+        PutVarint(key.size(), out);
+        out->append(key);
+      } else {
+        PutNumber(key_fd, key, out);
+      }
+
+      Expect(':');
+      if (!ConsumeLiteral("null")) {
+        ParseValue(value_fd, out, depth + 1);
+      }
+      EndLengthDelimited(start, out);
+    } while (Consume(','));
+    Expect('}');
+  }
+
+  void ParseValue(const pb::FieldDescriptor* fd, std::string* out,
+                  int depth) {
+    if (fd->type() != pb::FieldDescriptor::TYPE_MESSAGE) {
+      ParseScalar(fd, true, out);
+      return;
+    }
+    PutTag(fd->number(), WireFormatLite::WIRETYPE_LENGTH_DELIMITED, out);
+    if (json_writer::IsWellKnownType(fd->message_type())) {
+      SkipWhitespace();
+      const char* start = p_;
+      SkipValue(depth + 1);
+      std::string value =
+          LibraryJsonToProtobuf(desc_set_.type_resolver.get(),
+                                fd->message_type(), std::string(start, p_));
+      PutVarint(value.size(), out);
+      out->append(value);
+    } else {
+      size_t start = BeginLengthDelimited(out);
+      ParseMessage(fd->message_type(), out, depth + 1);
+      EndLengthDelimited(start, out);
+    }
+  }
+
+  void ParseScalar(const pb::FieldDescriptor* fd, bool tagged,
+                   std::string* out) {
+    if (tagged) {
+      PutTag(fd->number(), FieldWireType(fd), out);
+    }
+    switch (fd->type()) {
+      case pb::FieldDescriptor::TYPE_BOOL:
+        // Like the protobuf library, this also accepts quoted bools.
+        if (ConsumeLiteral("true") || ConsumeLiteral("\"true\"")) {
+          PutVarint(1, out);
+        } else if (ConsumeLiteral("false") || ConsumeLiteral("\"false\"")) {
+          PutVarint(0, out);
+        } else {
+          ThrowTypeMismatch(fd, "a bool");
+        }
+        break;
+      case pb::FieldDescriptor::TYPE_ENUM:
+        if (AtString()) {
+          PutVarint(static_cast<uint64_t>(static_cast<int64_t>(
+                        ParseEnumName(fd, ParseString()))),
+                    out);
+        } else {
+          PutNumber(fd, ParseNumberText(fd), out);
+        }
+        break;
+      case pb::FieldDescriptor::TYPE_STRING: {
+        if (!AtString()) {
+          ThrowTypeMismatch(fd, "a string");
+        }
+        std::string_view s = ParseString();
+        PutVarint(s.size(), out);
+        out->append(s);
+        break;
+      }
+      case pb::FieldDescriptor::TYPE_BYTES: {
+        if (!AtString()) {
+          ThrowTypeMismatch(fd, "a base64 string");
+        }
+        std::string bytes = DecodeBase64(fd, ParseString());
+        PutVarint(bytes.size(), out);
+        out->append(bytes);
+        break;
+      }
+      case pb::FieldDescriptor::TYPE_MESSAGE:
+      case pb::FieldDescriptor::TYPE_GROUP:
+        throw BadProto("unsupported type for field " + fd->full_name());
+      default:
+        PutNumber(fd, ParseNumberText(fd), out);
+    }
+  }
+
+  // Writes a numeric field's value without its tag.
+  static void PutNumber(const pb::FieldDescriptor* fd, std::string_view text,
+                        std::string* out) {
+    switch (fd->type()) {
+      case pb::FieldDescriptor::TYPE_DOUBLE:
+        PutFixed64(WireFormatLite::EncodeDouble(ParseFloat<double>(fd, text)),
+                   out);
+        break;
+      case pb::FieldDescriptor::TYPE_FLOAT:
+        PutFixed32(WireFormatLite::EncodeFloat(ParseFloat<float>(fd, text)),
+                   out);
+        break;
+      case pb::FieldDescriptor::TYPE_INT64:
+        PutVarint(static_cast<uint64_t>(ParseInteger<int64_t>(fd, text)), out);
+        break;
+      case pb::FieldDescriptor::TYPE_SINT64:
+        PutVarint(
+            WireFormatLite::ZigZagEncode64(ParseInteger<int64_t>(fd, text)),
+            out);
+        break;
+      case pb::FieldDescriptor::TYPE_SFIXED64:
+        PutFixed64(static_cast<uint64_t>(ParseInteger<int64_t>(fd, text)), out);
+        break;
+      case pb::FieldDescriptor::TYPE_UINT64:
+        PutVarint(ParseInteger<uint64_t>(fd, text), out);
+        break;
+      case pb::FieldDescriptor::TYPE_FIXED64:
+        PutFixed64(ParseInteger<uint64_t>(fd, text), out);
+        break;
+      case pb::FieldDescriptor::TYPE_INT32:
+      case pb::FieldDescriptor::TYPE_ENUM:
+        // Negative values take ten bytes, as with int64.
+        PutVarint(static_cast<uint64_t>(static_cast<int64_t>(
+                      ParseInteger<int32_t>(fd, text))),
+                  out);
+        break;
+      case pb::FieldDescriptor::TYPE_SINT32:
+        PutVarint(
+            WireFormatLite::ZigZagEncode32(ParseInteger<int32_t>(fd, text)),
+            out);
+        break;
+      case pb::FieldDescriptor::TYPE_SFIXED32:
+        PutFixed32(static_cast<uint32_t>(ParseInteger<int32_t>(fd, text)), out);
+        break;
+      case pb::FieldDescriptor::TYPE_UINT32:
+        PutVarint(ParseInteger<uint32_t>(fd, text), out);
+        break;
+      case pb::FieldDescriptor::TYPE_FIXED32:
+        PutFixed32(ParseInteger<uint32_t>(fd, text), out);
+        break;
+      default:
+        ThrowTypeMismatch(fd, "a non-numeric value");
+    }
+  }
+};
+
+// `strtod` and friends need a terminated string.
+class TerminatedCopy {
+ public:
+  explicit TerminatedCopy(std::string_view s) {
+    if (s.size() < sizeof(buf_)) {
+      memcpy(buf_, s.data(), s.size());
+      buf_[s.size()] = '\0';
+      str_ = buf_;
+    } else {
+      heap_.assign(s);
+      str_ = heap_.c_str();
+    }
+  }
+
+  const char* c_str() const { return str_; }
+
+ private:
+  char buf_[64];
+  std::string heap_;
+  const char* str_;
+};
+
+}  // namespace
+
+void SetImplementation(Implementation new_implementation) {
+  implementation = new_implementation;
+}
+
+std::string JsonToProtobuf(const descriptor_db::DescSet& desc_set,
+                           const pb::Descriptor* desc, std::string_view json) {
+  if (implementation == Implementation::Library ||
+      json_writer::IsWellKnownType(desc)) {
+    return LibraryJsonToProtobuf(desc_set.type_resolver.get(), desc,
+                                 std::string(json));
+  }
+  std::string proto;
+  proto.reserve(json.size() / 2);
+  Parser parser(desc_set, json);
+  parser.Parse(desc, &proto);
+  return proto;
+}
+
+std::string LibraryJsonToProtobuf(pb::util::TypeResolver* type_resolver,
+                                  const pb::Descriptor* desc,
+                                  const std::string& json) {
+  std::string data;
+  pb::util::Status status = pb::util::JsonToBinaryString(
+      type_resolver, kTypeUrlPrefix + desc->full_name(), json, &data);
+  if (!status.ok()) {
+    throw BadProto(status.error_message());
+  }
+  return data;
+}
+
+template <typename T>
+T ParseInteger(const pb::FieldDescriptor* fd, std::string_view text) {
+  T x;
+  const char* end = text.data() + text.size();
+  std::from_chars_result result = std::from_chars(text.data(), end, x);
+  if (result.ec == std::errc() && result.ptr == end) {
+    return x;
+  }
+  // Integral numbers in other notations like `1e3` are also fine,
+  // as long as they're exact.
+  TerminatedCopy s(text);
+  char* parse_end = nullptr;
+  errno = 0;
+  double d = strtod(s.c_str(), &parse_end);
+  if (errno == 0 && parse_end != s.c_str() && *parse_end == '\0' &&
+      std::trunc(d) == d && std::fabs(d) <= 9007199254740992.0 &&
+      d >= static_cast<double>(std::numeric_limits<T>::min()) &&
+      d <= static_cast<double>(std::numeric_limits<T>::max())) {
+    return static_cast<T>(d);
+  }
+  ThrowInvalidValue(fd, text);
+}
+
+template <typename T>
+T ParseFloat(const pb::FieldDescriptor* fd, std::string_view text) {
+  if (text == "NaN") {
+    return std::numeric_limits<T>::quiet_NaN();
+  } else if (text == "Infinity") {
+    return std::numeric_limits<T>::infinity();
+  } else if (text == "-Infinity") {
+    return -std::numeric_limits<T>::infinity();
+  }
+  TerminatedCopy s(text);
+  char* end = nullptr;
+  errno = 0;
+  double d = strtod(s.c_str(), &end);
+  if (errno != 0 || end == s.c_str() || *end != '\0' || std::isnan(d) ||
+      std::isinf(d) || std::fabs(d) > std::numeric_limits<T>::max()) {
+    ThrowInvalidValue(fd, text);
+  }
+  return static_cast<T>(d);
+}
+
+template int32_t ParseInteger<int32_t>(const pb::FieldDescriptor*,
+                                       std::string_view);
+template int64_t ParseInteger<int64_t>(const pb::FieldDescriptor*,
+                                       std::string_view);
+template uint32_t ParseInteger<uint32_t>(const pb::FieldDescriptor*,
+                                         std::string_view);
+template uint64_t ParseInteger<uint64_t>(const pb::FieldDescriptor*,
+                                         std::string_view);
+template float ParseFloat<float>(const pb::FieldDescriptor*, std::string_view);
+template double ParseFloat<double>(const pb::FieldDescriptor*,
+                                   std::string_view);
+
+int ParseEnumName(const pb::FieldDescriptor* fd, std::string_view name) {
+  const pb::EnumValueDescriptor* value_desc =
+      fd->enum_type()->FindValueByName(std::string(name));
+  if (value_desc == nullptr) {
+    ThrowInvalidValue(fd, name);
+  }
+  return value_desc->number();
+}
+
+std::string DecodeBase64(const pb::FieldDescriptor* fd,
+                         std::string_view text) {
+  std::string_view s = text;
+  while (!s.empty() && s.back() == '=') {
+    s.remove_suffix(1);
+  }
+  std::string out;
+  out.reserve(s.size() * 3 / 4);
+  uint32_t n = 0;
+  int bits = 0;
+  for (char c : s) {
+    int d;
+    if (c >= 'A' && c <= 'Z') {
+      d = c - 'A';
+    } else if (c >= 'a' && c <= 'z') {
+      d = c - 'a' + 26;
+    } else if (c >= '0' && c <= '9') {
+      d = c - '0' + 52;
+    } else if (c == '+' || c == '-') {
+      d = 62;
+    } else if (c == '/' || c == '_') {
+      d = 63;
+    } else {
+      ThrowInvalidValue(fd, text);
+    }
+    n = (n << 6) | d;
+    bits += 6;
+    if (bits >= 8) {
+      bits -= 8;
+      out.push_back(static_cast<char>((n >> bits) & 0xff));
+    }
+  }
+  if (bits >= 6) {
+    ThrowInvalidValue(fd, text);
+  }
+  return out;
+}
+
+void ThrowTypeMismatch(const pb::FieldDescriptor* fd, const char* expected) {
+  throw BadProto(std::string("expected ") + expected + " for field " +
+                 fd->full_name());
+}
+
+}  // namespace json_reader
+}  // namespace postgres_protobuf
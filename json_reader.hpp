@@ -0,0 +1,67 @@
+#ifndef POSTGRES_PROTOBUF_JSON_READER_HPP_
+#define POSTGRES_PROTOBUF_JSON_READER_HPP_
+
+#include <string>
+#include <string_view>
+
+#include <google/protobuf/descriptor.h>
+#include <google/protobuf/util/type_resolver.h>
+
+#include "descriptor_db.hpp"
+
+namespace postgres_protobuf {
+namespace json_reader {
+
+namespace pb = ::google::protobuf;
+
+// Converts JSON to protobufs by parsing the JSON text and writing the wire
+// format directly, guided by the message's descriptor. It accepts what the
+// protobuf JSON mapping accepts: fields may be keyed by their JSON name or
+// their original name, numbers may be quoted and null means the default.
+// Well-known types (`google.protobuf.*`) have special JSON representations,
+// so those are converted by the protobuf library.
+
+// Which implementation `JsonToProtobuf` uses.
+enum class Implementation {
+  // Parses into the wire format directly.
+  Native,
+  // The protobuf library's `JsonToBinaryString`, kept for comparison.
+  Library,
+};
+
+void SetImplementation(Implementation implementation);
+
+// Takes UTF-8. Throws BadProto if the JSON is invalid or doesn't fit the
+// message type, and RecursionDepthExceeded.
+std::string JsonToProtobuf(const descriptor_db::DescSet& desc_set,
+                           const pb::Descriptor* desc, std::string_view json);
+
+// Converts with the protobuf library. Throws BadProto.
+std::string LibraryJsonToProtobuf(pb::util::TypeResolver* type_resolver,
+                                  const pb::Descriptor* desc,
+                                  const std::string& json);
+
+// Parsing of scalar values as the JSON mapping allows them, also used for
+// jsonb. These throw BadProto naming the field if the value doesn't fit.
+
+// Also accepts exact integers in other notations, like `1e3`.
+template <typename T>
+T ParseInteger(const pb::FieldDescriptor* fd, std::string_view text);
+
+// Also accepts `NaN`, `Infinity` and `-Infinity`.
+template <typename T>
+T ParseFloat(const pb::FieldDescriptor* fd, std::string_view text);
+
+int ParseEnumName(const pb::FieldDescriptor* fd, std::string_view name);
+
+// Accepts both the standard and the URL-safe alphabet, with or without
+// padding, like the protobuf library does.
+std::string DecodeBase64(const pb::FieldDescriptor* fd, std::string_view text);
+
+[[noreturn]] void ThrowTypeMismatch(const pb::FieldDescriptor* fd,
+                                    const char* expected);
+
+}  // namespace json_reader
+}  // namespace postgres_protobuf
+
+#endif  // POSTGRES_PROTOBUF_JSON_READER_HPP_
@@ -0,0 +1,656 @@
+#include "json_writer.hpp"
+
+#include "postgres_protobuf_common.hpp"
+#include "querying.hpp"
+
+#include <google/protobuf/io/coded_stream.h>
+#include <google/protobuf/util/json_util.h>
+#include <google/protobuf/wire_format_lite.h>
+
+#include <algorithm>
+#include <cfloat>
+#include <charconv>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <type_traits>
+#include <unordered_map>
+#include <vector>
+
+extern "C" {
+// Must be included before other Postgres headers
+#include <postgres.h>
+
+#include <mb/pg_wchar.h>
+}  // extern "C"
+
+namespace postgres_protobuf {
+namespace json_writer {
+
+namespace {
+
+using WireFormatLite = pb::internal::WireFormatLite;
+
+const char kTypeUrlPrefix[] = "type.googleapis.com/";
+
+const char kBase64Chars[] =
+    "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+const char kHexDigits[] = "0123456789abcdef";
+
+Implementation implementation = Implementation::Native;
+
+std::string LibraryProtobufToJson(pb::util::TypeResolver* type_resolver,
+                                  const pb::Descriptor* desc,
+                                  std::string_view data) {
+  std::string json;
+  pb::util::Status status = pb::util::BinaryToJsonString(
+      type_resolver, kTypeUrlPrefix + desc->full_name(), std::string(data),
+      &json);
+  if (!status.ok()) {
+    throw BadProto(status.error_message());
+  }
+  return json;
+}
+
+int FieldWireType(const pb::FieldDescriptor* fd) {
+  return WireFormatLite::WireTypeForFieldType(
+      static_cast<WireFormatLite::FieldType>(fd->type()));
+}
+
+struct WireField {
+  uint32_t number;
+  int wire_type;
+  size_t position;         // Index in the order the fields were read
+  uint64_t value;          // Unless `wire_type` is 2
+  std::string_view bytes;  // If `wire_type` is 2
+
+  bool operator<(const WireField& other) const {
+    return number < other.number;
+  }
+};
+
+// Reads the fields of a message in the order they appear.
+std::vector<WireField> ReadFields(std::string_view data) {
+  pb::io::CodedInputStream stream(
+      reinterpret_cast<const uint8*>(data.data()), data.size());
+  std::vector<WireField> fields;
+  while (uint32 tag = stream.ReadTag()) {
+    WireField field;
+    field.number = WireFormatLite::GetTagFieldNumber(tag);
+    field.wire_type = WireFormatLite::GetTagWireType(tag);
+    field.position = fields.size();
+    field.value = 0;
+    bool ok = true;
+    switch (field.wire_type) {
+      case WireFormatLite::WIRETYPE_VARINT:
+        ok = stream.ReadVarint64(&field.value);
+        break;
+      case WireFormatLite::WIRETYPE_FIXED64:
+        ok = stream.ReadLittleEndian64(&field.value);
+        break;
+      case WireFormatLite::WIRETYPE_FIXED32: {
+        uint32 value;
+        ok = stream.ReadLittleEndian32(&value);
+        field.value = value;
+        break;
+      }
+      case WireFormatLite::WIRETYPE_LENGTH_DELIMITED: {
+        uint32 size;
+        ok = stream.ReadVarint32(&size);
+        size_t pos = stream.CurrentPosition();
+        if (ok && size <= data.size() - pos) {
+          field.bytes = data.substr(pos, size);
+          stream.Skip(size);
+        } else {
+          ok = false;
+        }
+        break;
+      }
+      default:
+        throw BadProto("unsupported wire type " +
+                       std::to_string(field.wire_type));
+    }
+    if (!ok) {
+      throw BadProto("failed to read field " + std::to_string(field.number));
+    }
+    fields.push_back(field);
+  }
+  if (!stream.ConsumedEntireMessage()) {
+    throw BadProto("invalid tag");
+  }
+  return fields;
+}
+
+template <typename T>
+std::string_view FormatInteger(T value, char (&buf)[32]) {
+  std::to_chars_result result = std::to_chars(buf, buf + sizeof(buf), value);
+  return std::string_view(buf, result.ptr - buf);
+}
+
+// Formats floats like the protobuf library's JSON printer does.
+template <typename T>
+void FormatFloat(T x, char (&buf)[32]) {
+  constexpr int digits = std::is_same<T, float>::value ? FLT_DIG : DBL_DIG;
+  constexpr int max_digits = digits == FLT_DIG ? 9 : 17;
+  snprintf(buf, sizeof(buf), "%.*g", digits, static_cast<double>(x));
+  if (static_cast<T>(strtod(buf, nullptr)) != x) {
+    snprintf(buf, sizeof(buf), "%.*g", max_digits, static_cast<double>(x));
+  }
+}
+
+class Walker {
+ public:
+  Walker(pb::util::TypeResolver* type_resolver, JsonSink* sink)
+      : type_resolver_(type_resolver), sink_(sink) {}
+
+  void WriteMessage(const pb::Descriptor* desc, std::string_view data,
+                    int depth) {
+    querying::CheckRecursionDepth(depth);
+
+    // Occurrences of the same field are written together, so group them
+    // while keeping them in order.
+    std::vector<WireField> fields = ReadFields(data);
+    if (!std::is_sorted(fields.begin(), fields.end())) {
+      std::stable_sort(fields.begin(), fields.end());
+    }
+
+    // Only the oneof field that was set last counts.
+    std::unordered_map<const pb::OneofDescriptor*, size_t> oneof_positions;
+    if (desc->oneof_decl_count() > 0) {
+      for (const WireField& field : fields) {
+        const pb::FieldDescriptor* fd = desc->FindFieldByNumber(field.number);
+        if (fd != nullptr && fd->containing_oneof() != nullptr) {
+          size_t& pos = oneof_positions[fd->containing_oneof()];
+          pos = std::max(pos, field.position);
+        }
+      }
+    }
+
+    sink_->BeginObject();
+    const WireField* end = fields.data() + fields.size();
+    for (const WireField* begin = fields.data(); begin != end;) {
+      const WireField* next = std::upper_bound(begin, end, *begin);
+      const pb::FieldDescriptor* fd = desc->FindFieldByNumber(begin->number);
+      // Unknown fields are left out, like the protobuf library does.
+      if (fd != nullptr &&
+          (fd->containing_oneof() == nullptr ||
+           oneof_positions[fd->containing_oneof()] == (next - 1)->position)) {
+        WriteField(fd, begin, next, depth);
+      }
+      begin = next;
+    }
+    sink_->EndObject();
+  }
+
+  void WriteWellKnownType(const pb::Descriptor* desc, std::string_view data) {
+    sink_->Json(LibraryProtobufToJson(type_resolver_, desc, data));
+  }
+
+ private:
+  pb::util::TypeResolver* const type_resolver_;
+  JsonSink* const sink_;
+  std::string buf_;  // For base64
+
+  void WriteField(const pb::FieldDescriptor* fd, const WireField* begin,
+                  const WireField* end, int depth) {
+    sink_->Key(fd->json_name());
+
+    if (fd->is_map()) {
+      sink_->BeginObject();
+      for (const WireField* f = begin; f != end; ++f) {
+        CheckWireType(fd, *f, WireFormatLite::WIRETYPE_LENGTH_DELIMITED);
+        WriteMapEntry(fd->message_type(), f->bytes, depth);
+      }
+      sink_->EndObject();
+    } else if (fd->is_repeated()) {
+      sink_->BeginArray();
+      for (const WireField* f = begin; f != end; ++f) {
+        if (f->wire_type == WireFormatLite::WIRETYPE_LENGTH_DELIMITED &&
+            fd->is_packable()) {
+          WritePacked(fd, f->bytes);
+        } else {
+          WriteValue(fd, *f, depth);
+        }
+      }
+      sink_->EndArray();
+    } else if (fd->type() == pb::FieldDescriptor::TYPE_MESSAGE &&
+               end - begin > 1) {
+      // Repeated occurrences of a submessage are merged.
+      std::string merged;
+      for (const WireField* f = begin; f != end; ++f) {
+        CheckWireType(fd, *f, WireFormatLite::WIRETYPE_LENGTH_DELIMITED);
+        merged.append(f->bytes.data(), f->bytes.size());
+      }
+      WireField field = *(end - 1);
+      field.bytes = merged;
+      WriteValue(fd, field, depth);
+    } else {
+      // Otherwise the last occurrence wins.
+      WriteValue(fd, *(end - 1), depth);
+    }
+  }
+
+  void WriteMapEntry(const pb::Descriptor* entry_desc, std::string_view data,
+                     int depth) {
+    const pb::FieldDescriptor* key_fd = entry_desc->FindFieldByNumber(1);
+    const pb::FieldDescriptor* value_fd = entry_desc->FindFieldByNumber(2);
+
+    // Missing keys and values are defaults, which are all zeros on the wire.
+    WireField key = {1, FieldWireType(key_fd), 0, 0, {}};
+    WireField value = {2, FieldWireType(value_fd), 0, 0, {}};
+    std::string merged_value;
+    for (const WireField& field : ReadFields(data)) {
+      if (field.number == 1) {
+        CheckWireType(key_fd, field, key.wire_type);
+        key = field;
+      } else if (field.number == 2) {
+        CheckWireType(value_fd, field, value.wire_type);
+        if (value_fd->type() == pb::FieldDescriptor::TYPE_MESSAGE) {
+          merged_value.append(field.bytes.data(), field.bytes.size());
+          value.bytes = merged_value;
+        } else {
+          value = field;
+        }
+      }
+    }
+
+    switch (key_fd->type()) {
+      case pb::FieldDescriptor::TYPE_STRING:
+        CheckUtf8(key.bytes);
+        sink_->Key(key.bytes);
+        break;
+      case pb::FieldDescriptor::TYPE_BOOL:
+        sink_->Key(key.value ? "true" : "false");
+        break;
+      case pb::FieldDescriptor::TYPE_INT32:
+      case pb::FieldDescriptor::TYPE_SINT32:
+      case pb::FieldDescriptor::TYPE_SFIXED32:
+      case pb::FieldDescriptor::TYPE_INT64:
+      case pb::FieldDescriptor::TYPE_SINT64:
+      case pb::FieldDescriptor::TYPE_SFIXED64: {
+        char buf[32];
+        sink_->Key(FormatInteger(SignedValue(key_fd, key.value), buf));
+        break;
+      }
+      default: {
+        char buf[32];
+        sink_->Key(FormatInteger(key.value, buf));
+        break;
+      }
+    }
+    WriteValue(value_fd, value, depth);
+  }
+
+  void WritePacked(const pb::FieldDescriptor* fd, std::string_view data) {
+    pb::io::CodedInputStream stream(
+        reinterpret_cast<const uint8*>(data.data()), data.size());
+    WireField field = {static_cast<uint32_t>(fd->number()), FieldWireType(fd),
+                       0, 0, {}};
+    while (stream.CurrentPosition() < static_cast<int>(data.size())) {
+      bool ok;
+      if (field.wire_type == WireFormatLite::WIRETYPE_FIXED32) {
+        uint32 value;
+        ok = stream.ReadLittleEndian32(&value);
+        field.value = value;
+      } else if (field.wire_type == WireFormatLite::WIRETYPE_FIXED64) {
+        ok = stream.ReadLittleEndian64(&field.value);
+      } else {
+        ok = stream.ReadVarint64(&field.value);
+      }
+      if (!ok) {
+        throw BadProto("failed to read packed field " +
+                       std::to_string(fd->number()));
+      }
+      WriteValue(fd, field, 0);
+    }
+  }
+
+  void WriteValue(const pb::FieldDescriptor* fd, const WireField& field,
+                  int depth) {
+    CheckWireType(fd, field, FieldWireType(fd));
+
+    switch (fd->type()) {
+      case pb::FieldDescriptor::TYPE_DOUBLE: {
+        double x;
+        uint64_t bits = field.value;
+        memcpy(&x, &bits, sizeof(x));
+        WriteFloat(x);
+        break;
+      }
+      case pb::FieldDescriptor::TYPE_FLOAT: {
+        float x;
+        uint32_t bits = static_cast<uint32_t>(field.value);
+        memcpy(&x, &bits, sizeof(x));
+        WriteFloat(x);
+        break;
+      }
+      case pb::FieldDescriptor::TYPE_INT64:
+      case pb::FieldDescriptor::TYPE_SINT64:
+      case pb::FieldDescriptor::TYPE_SFIXED64: {
+        // 64-bit integers are strings in protobuf JSON.
+        char buf[32];
+        sink_->String(FormatInteger(SignedValue(fd, field.value), buf));
+        break;
+      }
+      case pb::FieldDescriptor::TYPE_UINT64:
+      case pb::FieldDescriptor::TYPE_FIXED64: {
+        char buf[32];
+        sink_->String(FormatInteger(field.value, buf));
+        break;
+      }
+      case pb::FieldDescriptor::TYPE_INT32:
+      case pb::FieldDescriptor::TYPE_SINT32:
+      case pb::FieldDescriptor::TYPE_SFIXED32:
+        sink_->Int(SignedValue(fd, field.value));
+        break;
+      case pb::FieldDescriptor::TYPE_UINT32:
+      case pb::FieldDescriptor::TYPE_FIXED32:
+        sink_->Int(static_cast<uint32_t>(field.value));
+        break;
+      case pb::FieldDescriptor::TYPE_BOOL:
+        sink_->Bool(field.value != 0);
+        break;
+      case pb::FieldDescriptor::TYPE_ENUM: {
+        const pb::EnumDescriptor* enum_desc = fd->enum_type();
+        int32_t number = static_cast<int32_t>(field.value);
+        const pb::EnumValueDescriptor* value_desc =
+            enum_desc->FindValueByNumber(number);
+        if (enum_desc->full_name() == "google.protobuf.NullValue") {
+          sink_->Null();
+        } else if (value_desc != nullptr) {
+          sink_->String(value_desc->name());
+        } else {
+          sink_->Int(number);
+        }
+        break;
+      }
+      case pb::FieldDescriptor::TYPE_STRING:
+        CheckUtf8(field.bytes);
+        sink_->String(field.bytes);
+        break;
+      case pb::FieldDescriptor::TYPE_BYTES:
+        Base64Encode(field.bytes, &buf_);
+        sink_->String(buf_);
+        break;
+      case pb::FieldDescriptor::TYPE_MESSAGE:
+        if (IsWellKnownType(fd->message_type())) {
+          WriteWellKnownType(fd->message_type(), field.bytes);
+        } else {
+          WriteMessage(fd->message_type(), field.bytes, depth + 1);
+        }
+        break;
+      case pb::FieldDescriptor::TYPE_GROUP:
+        throw BadProto("groups are not supported");
+    }
+  }
+
+  template <typename T>
+  void WriteFloat(T x) {
+    // JSON has no such numbers, so protobuf JSON has them as strings.
+    if (std::isnan(x)) {
+      sink_->String("NaN");
+    } else if (std::isinf(x)) {
+      sink_->String(x > 0 ? "Infinity" : "-Infinity");
+    } else {
+      char buf[32];
+      FormatFloat(x, buf);
+      sink_->Number(buf);
+    }
+  }
+
+  static void CheckWireType(const pb::FieldDescriptor* fd,
+                            const WireField& field, int wire_type) {
+    if (field.wire_type != wire_type) {
+      throw BadProto("unexpected wire type " +
+                     std::to_string(field.wire_type) + " for field " +
+                     fd->full_name());
+    }
+  }
+
+  static void CheckUtf8(std::string_view s) {
+    // This also rejects NUL characters, which Postgres text can't have.
+    if (!pg_verify_mbstr(PG_UTF8, s.data(), s.size(), true)) {
+      throw BadProto("string field is not valid UTF-8");
+    }
+  }
+
+  static int64_t SignedValue(const pb::FieldDescriptor* fd, uint64_t value) {
+    switch (fd->type()) {
+      case pb::FieldDescriptor::TYPE_SINT32:
+        return WireFormatLite::ZigZagDecode32(static_cast<uint32_t>(value));
+      case pb::FieldDescriptor::TYPE_SINT64:
+        return WireFormatLite::ZigZagDecode64(value);
+      case pb::FieldDescriptor::TYPE_INT32:
+      case pb::FieldDescriptor::TYPE_SFIXED32:
+        return static_cast<int32_t>(value);
+      default:
+        return static_cast<int64_t>(value);
+    }
+  }
+
+  static void Base64Encode(std::string_view s, std::string* out) {
+    out->resize((s.size() + 2) / 3 * 4);
+    char* p = &(*out)[0];
+    size_t i = 0;
+    for (; i + 2 < s.size(); i += 3) {
+      uint32_t n = (uint8_t(s[i]) << 16) | (uint8_t(s[i + 1]) << 8) |
+                   uint8_t(s[i + 2]);
+      *p++ = kBase64Chars[(n >> 18) & 63];
+      *p++ = kBase64Chars[(n >> 12) & 63];
+      *p++ = kBase64Chars[(n >> 6) & 63];
+      *p++ = kBase64Chars[n & 63];
+    }
+    if (i < s.size()) {
+      uint32_t n = uint8_t(s[i]) << 16;
+      if (i + 1 < s.size()) {
+        n |= uint8_t(s[i + 1]) << 8;
+      }
+      *p++ = kBase64Chars[(n >> 18) & 63];
+      *p++ = kBase64Chars[(n >> 12) & 63];
+      *p++ = i + 1 < s.size() ? kBase64Chars[(n >> 6) & 63] : '=';
+      *p++ = '=';
+    }
+  }
+};
+
+// Whether the protobuf library escapes a non-ASCII code point: C1 controls
+// and invisible formatting characters.
+bool NeedsEscape(uint32_t cp) {
+  return (cp >= 0x80 && cp <= 0x9f) || cp == 0xad ||
+         (cp >= 0x600 && cp <= 0x603) || cp == 0x6dd || cp == 0x70f ||
+         cp == 0x17b4 || cp == 0x17b5 || (cp >= 0x200b && cp <= 0x200f) ||
+         (cp >= 0x2028 && cp <= 0x202e) || (cp >= 0x2060 && cp <= 0x2064) ||
+         (cp >= 0x206a && cp <= 0x206f) || cp == 0xfeff ||
+         (cp >= 0xfff9 && cp <= 0xfffb) || cp == 0xe0001 ||
+         (cp >= 0xe0020 && cp <= 0xe007f);
+}
+
+void AppendUnicodeEscape(uint32_t unit, std::string* out) {
+  char buf[6] = {'\\', 'u', kHexDigits[(unit >> 12) & 15],
+                 kHexDigits[(unit >> 8) & 15], kHexDigits[(unit >> 4) & 15],
+                 kHexDigits[unit & 15]};
+  out->append(buf, sizeof(buf));
+}
+
+// Appends a JSON string of valid UTF-8, escaped like the protobuf library
+// does: besides what JSON requires, `<` and `>` (for embedding in HTML) and
+// some invisible characters are escaped.
+void AppendJsonString(std::string_view s, std::string* out) {
+  out->push_back('"');
+  const char* p = s.data();
+  const char* end = p + s.size();
+  const char* pending = p;  // Start of the run not yet appended
+  while (p < end) {
+    unsigned char c = *p;
+    if (c >= 0x80) {
+      int len = pg_utf_mblen(reinterpret_cast<const unsigned char*>(p));
+      uint32_t cp = utf8_to_unicode(reinterpret_cast<const unsigned char*>(p));
+      if (NeedsEscape(cp)) {
+        out->append(pending, p - pending);
+        if (cp >= 0x10000) {
+          AppendUnicodeEscape(0xd800 + ((cp - 0x10000) >> 10), out);
+          AppendUnicodeEscape(0xdc00 + ((cp - 0x10000) & 0x3ff), out);
+        } else {
+          AppendUnicodeEscape(cp, out);
+        }
+        pending = p + len;
+      }
+      p += len;
+      continue;
+    }
+    if (c >= 0x20 && c != '"' && c != '\\' && c != '<' && c != '>' &&
+        c != 0x7f) {
+      ++p;
+      continue;
+    }
+    out->append(pending, p - pending);
+    switch (c) {
+      case '"':
+        out->append("\\\"");
+        break;
+      case '\\':
+        out->append("\\\\");
+        break;
+      case '\b':
+        out->append("\\b");
+        break;
+      case '\f':
+        out->append("\\f");
+        break;
+      case '\n':
+        out->append("\\n");
+        break;
+      case '\r':
+        out->append("\\r");
+        break;
+      case '\t':
+        out->append("\\t");
+        break;
+      default:
+        AppendUnicodeEscape(c, out);
+        break;
+    }
+    pending = ++p;
+  }
+  out->append(pending, p - pending);
+  out->push_back('"');
+}
+
+// Writes JSON text, without whitespace like the protobuf library.
+class TextSink : public JsonSink {
+ public:
+  explicit TextSink(std::string* out)
+      : out_(out), first_(true), after_key_(false) {}
+
+  void BeginObject() override {
+    Separate();
+    out_->push_back('{');
+    first_ = true;
+  }
+  void EndObject() override {
+    out_->push_back('}');
+    first_ = false;
+  }
+  void BeginArray() override {
+    Separate();
+    out_->push_back('[');
+    first_ = true;
+  }
+  void EndArray() override {
+    out_->push_back(']');
+    first_ = false;
+  }
+  void Key(std::string_view key) override {
+    Separate();
+    AppendJsonString(key, out_);
+    out_->push_back(':');
+    after_key_ = true;
+  }
+
+  void Null() override {
+    Separate();
+    out_->append("null");
+  }
+  void Bool(bool value) override {
+    Separate();
+    out_->append(value ? "true" : "false");
+  }
+  void Int(int64_t value) override {
+    Separate();
+    char buf[32];
+    out_->append(FormatInteger(value, buf));
+  }
+  void Number(std::string_view text) override {
+    Separate();
+    out_->append(text.data(), text.size());
+  }
+  void String(std::string_view value) override {
+    Separate();
+    AppendJsonString(value, out_);
+  }
+  void Json(const std::string& json) override {
+    Separate();
+    out_->append(json);
+  }
+
+ private:
+  std::string* const out_;
+  bool first_;      // Nothing written yet in the current object or array
+  bool after_key_;  // The next value belongs to a key
+
+  void Separate() {
+    if (after_key_) {
+      after_key_ = false;
+    } else if (!first_) {
+      out_->push_back(',');
+    }
+    first_ = false;
+  }
+};
+
+}  // namespace
+
+bool IsWellKnownType(const pb::Descriptor* desc) {
+  return desc->file()->package() == "google.protobuf";
+}
+
+void WriteJson(pb::util::TypeResolver* type_resolver,
+               const pb::Descriptor* desc, std::string_view proto_data,
+               JsonSink* sink) {
+  Walker walker(type_resolver, sink);
+  if (IsWellKnownType(desc)) {
+    walker.WriteWellKnownType(desc, proto_data);
+  } else {
+    walker.WriteMessage(desc, proto_data, 0);
+  }
+}
+
+void SetImplementation(Implementation new_implementation) {
+  implementation = new_implementation;
+}
+
+std::string ProtobufToJson(pb::util::TypeResolver* type_resolver,
+                           const pb::Descriptor* desc,
+                           std::string_view proto_data) {
+  std::string json;
+  ProtobufToJson(type_resolver, desc, proto_data, &json);
+  return json;
+}
+
+void ProtobufToJson(pb::util::TypeResolver* type_resolver,
+                    const pb::Descriptor* desc, std::string_view proto_data,
+                    std::string* json) {
+  if (implementation == Implementation::Library) {
+    *json = LibraryProtobufToJson(type_resolver, desc, proto_data);
+    return;
+  }
+  json->clear();
+  json->reserve(proto_data.size() * 2);
+  TextSink sink(json);
+  WriteJson(type_resolver, desc, proto_data, &sink);
+}
+
+}  // namespace json_writer
+}  // namespace postgres_protobuf
@@ -0,0 +1,77 @@
+#ifndef POSTGRES_PROTOBUF_JSON_WRITER_HPP_
+#define POSTGRES_PROTOBUF_JSON_WRITER_HPP_
+
+#include <cstdint>
+#include <string>
+#include <string_view>
+
+#include <google/protobuf/descriptor.h>
+#include <google/protobuf/util/type_resolver.h>
+
+namespace postgres_protobuf {
+namespace json_writer {
+
+namespace pb = ::google::protobuf;
+
+// Converts protobufs to JSON by walking the wire format with the message's
+// descriptor, following the protobuf JSON mapping: fields are keyed by their
+// JSON name, 64-bit integers are strings, enums are names and bytes are base64.
+//
+// Repeated occurrences of a field are grouped into one array and submessages
+// are merged, as if the protobuf was parsed first. Unknown fields are left out.
+// Well-known types (`google.protobuf.*`) have special JSON representations,
+// so those are converted by the protobuf library.
+
+// Receives the JSON of a protobuf as a sequence of calls.
+class JsonSink {
+ public:
+  virtual ~JsonSink() = default;
+
+  virtual void BeginObject() = 0;
+  virtual void EndObject() = 0;
+  virtual void BeginArray() = 0;
+  virtual void EndArray() = 0;
+  virtual void Key(std::string_view key) = 0;
+
+  virtual void Null() = 0;
+  virtual void Bool(bool value) = 0;
+  virtual void Int(int64_t value) = 0;
+  // A finite floating-point number already formatted as JSON.
+  virtual void Number(std::string_view text) = 0;
+  // Valid UTF-8 without NUL characters.
+  virtual void String(std::string_view value) = 0;
+  // A complete JSON value from the protobuf library.
+  virtual void Json(const std::string& json) = 0;
+};
+
+bool IsWellKnownType(const pb::Descriptor* desc);
+
+// Throws BadProto if the protobuf is invalid, and RecursionDepthExceeded.
+void WriteJson(pb::util::TypeResolver* type_resolver,
+               const pb::Descriptor* desc, std::string_view proto_data,
+               JsonSink* sink);
+
+// Which implementation `ProtobufToJson` uses.
+enum class Implementation {
+  // `WriteJson` into a string.
+  Native,
+  // The protobuf library's `BinaryToJsonString`, kept for comparison.
+  Library,
+};
+
+void SetImplementation(Implementation implementation);
+
+// Throws BadProto if the protobuf is invalid, and RecursionDepthExceeded.
+std::string ProtobufToJson(pb::util::TypeResolver* type_resolver,
+                           const pb::Descriptor* desc,
+                           std::string_view proto_data);
+
+// The same, replacing the contents of `json` so that its buffer is reused.
+void ProtobufToJson(pb::util::TypeResolver* type_resolver,
+                    const pb::Descriptor* desc, std::string_view proto_data,
+                    std::string* json);
+
+}  // namespace json_writer
+}  // namespace postgres_protobuf
+
+#endif  // POSTGRES_PROTOBUF_JSON_WRITER_HPP_
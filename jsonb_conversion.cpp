@@ -0,0 +1,512 @@
+#include "jsonb_conversion.hpp"
+
+#include "json_reader.hpp"
+#include "json_writer.hpp"
+#include "postgres_protobuf_common.hpp"
+#include "postgres_utils.hpp"
+#include "querying.hpp"
+
+#include <google/protobuf/io/coded_stream.h>
+#include <google/protobuf/io/zero_copy_stream_impl_lite.h>
+#include <google/protobuf/wire_format_lite.h>
+
+#include <cstring>
+#include <string_view>
+
+extern "C" {
+// Must be included before other Postgres headers
+#include <postgres.h>
+
+#include <fmgr.h>
+#include <lib/stringinfo.h>
+#include <mb/pg_wchar.h>
+#include <utils/builtins.h>
+#include <utils/jsonb.h>
+}  // extern "C"
+
+namespace postgres_protobuf {
+namespace jsonb_conversion {
+
+namespace {
+
+using descriptor_db::DescSet;
+using json_reader::ParseFloat;
+using json_reader::ParseInteger;
+using json_reader::ThrowTypeMismatch;
+using postgres_utils::CatchPostgresErrors;
+using WireFormatLite = pb::internal::WireFormatLite;
+
+int FieldWireType(const pb::FieldDescriptor* fd) {
+  return WireFormatLite::WireTypeForFieldType(
+      static_cast<WireFormatLite::FieldType>(fd->type()));
+}
+
+// ===========================================================================
+// ============================ protobuf -> jsonb ============================
+// ===========================================================================
+
+// Builds a jsonb from what `json_writer::WriteJson` produces.
+class JsonbSink : public json_writer::JsonSink {
+ public:
+  JsonbSink() : state_(nullptr), result_(nullptr), after_key_(false) {}
+
+  Jsonb* Result() const {
+    Jsonb* jsonb = root_jsonb_;
+    if (jsonb == nullptr) {
+      CatchPostgresErrors([&]() { jsonb = JsonbValueToJsonb(result_); });
+    }
+    return jsonb;
+  }
+
+  void BeginObject() override { Push(WJB_BEGIN_OBJECT); }
+  void EndObject() override { Push(WJB_END_OBJECT); }
+  void BeginArray() override { Push(WJB_BEGIN_ARRAY); }
+  void EndArray() override { Push(WJB_END_ARRAY); }
+  void Key(std::string_view key) override {
+    CatchPostgresErrors([&]() {
+      JsonbValue v;
+      SetString(&v, key);
+      PushToken(WJB_KEY, &v);
+    });
+    after_key_ = true;
+  }
+
+  void Null() override {
+    JsonbValue v;
+    v.type = jbvNull;
+    PushScalar(&v);
+  }
+  void Bool(bool value) override {
+    JsonbValue v;
+    v.type = jbvBool;
+    v.val.boolean = value;
+    PushScalar(&v);
+  }
+  void Int(int64_t value) override {
+    CatchPostgresErrors([&]() {
+      JsonbValue v;
+      v.type = jbvNumeric;
+      v.val.numeric = DatumGetNumeric(
+          DirectFunctionCall1(int8_numeric, Int64GetDatum(value)));
+      PushScalarToken(&v);
+    });
+  }
+  void Number(std::string_view text) override {
+    CatchPostgresErrors([&]() {
+      char* s = pnstrdup(text.data(), text.size());
+      JsonbValue v;
+      v.type = jbvNumeric;
+      v.val.numeric = DatumGetNumeric(
+          DirectFunctionCall3(numeric_in, CStringGetDatum(s),
+                              ObjectIdGetDatum(InvalidOid), Int32GetDatum(-1)));
+      pfree(s);
+      PushScalarToken(&v);
+    });
+  }
+  void String(std::string_view value) override {
+    CatchPostgresErrors([&]() {
+      JsonbValue v;
+      SetString(&v, value);
+      PushScalarToken(&v);
+    });
+  }
+
+  // Splices in the jsonb that the JSON converts to.
+  void Json(const std::string& json) override {
+    CatchPostgresErrors([&]() { SpliceJson(json.c_str()); });
+  }
+
+ private:
+  JsonbParseState* state_;
+  JsonbValue* result_;
+  Jsonb* root_jsonb_ = nullptr;  // If the whole value came from `Json`
+  bool after_key_;
+
+  void Push(JsonbIteratorToken token) {
+    CatchPostgresErrors([&]() { PushToken(token); });
+  }
+
+  void PushScalar(JsonbValue* value) {
+    CatchPostgresErrors([&]() { PushScalarToken(value); });
+  }
+
+  // The functions below raise Postgres errors, so they're only called
+  // through `CatchPostgresErrors`.
+
+  void PushToken(JsonbIteratorToken token, JsonbValue* value = nullptr) {
+    after_key_ = false;
+    result_ = pushJsonbValue(&state_, token, value);
+  }
+
+  void PushScalarToken(JsonbValue* value) {
+    PushToken(after_key_ ? WJB_VALUE : WJB_ELEM, value);
+  }
+
+  void SpliceJson(const char* json) {
+    Jsonb* jsonb =
+        DatumGetJsonbP(DirectFunctionCall1(jsonb_in, CStringGetDatum(json)));
+    if (state_ == nullptr) {
+      root_jsonb_ = jsonb;
+      return;
+    }
+
+    JsonbIterator* it = JsonbIteratorInit(&jsonb->root);
+    JsonbValue v;
+    if (JB_ROOT_IS_SCALAR(jsonb)) {
+      // A scalar is an array of one element.
+      JsonbIteratorNext(&it, &v, false);
+      JsonbIteratorNext(&it, &v, false);
+      PushScalarToken(&v);
+      return;
+    }
+    JsonbIteratorToken t;
+    while ((t = JsonbIteratorNext(&it, &v, false)) != WJB_DONE) {
+      bool has_value = t == WJB_KEY || t == WJB_VALUE || t == WJB_ELEM;
+      PushToken(t, has_value ? &v : nullptr);
+    }
+  }
+
+  // Copies the string, since it may not outlive the JsonbParseState.
+  static void SetString(JsonbValue* v, std::string_view s) {
+    char* converted = pg_any_to_server(s.data(), s.size(), PG_UTF8);
+    v->type = jbvString;
+    if (converted == s.data()) {
+      v->val.string.val = pnstrdup(s.data(), s.size());
+      v->val.string.len = s.size();
+    } else {
+      v->val.string.val = converted;
+      v->val.string.len = strlen(converted);
+    }
+  }
+};
+
+// ===========================================================================
+// ============================ jsonb -> protobuf ============================
+// ===========================================================================
+
+class ProtobufEncoder {
+ public:
+  explicit ProtobufEncoder(const DescSet& desc_set) : desc_set_(desc_set) {}
+
+  void EncodeMessage(const pb::Descriptor* desc, JsonbContainer* container,
+                     std::string* out, int depth) {
+    querying::CheckRecursionDepth(depth);
+    pb::io::StringOutputStream raw_stream(out);
+    pb::io::CodedOutputStream stream(&raw_stream);
+
+    JsonbIterator* it = IteratorInit(container);
+    JsonbValue v;
+    if (Next(&it, &v) != WJB_BEGIN_OBJECT) {
+      throw BadProto("expected a JSON object for " + desc->full_name());
+    }
+    while (Next(&it, &v) == WJB_KEY) {
+      std::string_view key(v.val.string.val, v.val.string.len);
+      const pb::FieldDescriptor* fd = desc_set_.FindJsonField(desc, key);
+      if (fd == nullptr) {
+        throw BadProto("message " + desc->full_name() + " has no field " +
+                       std::string(key));
+      }
+      Next(&it, &v);
+      EncodeField(fd, v, &stream, depth);
+    }
+  }
+
+  void EncodeWellKnownType(const pb::Descriptor* desc, const JsonbValue& v,
+                           std::string* out) {
+    StringInfoData buf;
+    CatchPostgresErrors([&]() {
+      initStringInfo(&buf);
+      if (v.type == jbvBinary) {
+        JsonbToCString(&buf, v.val.binary.data, v.val.binary.len);
+      } else {
+        Jsonb* jsonb = JsonbValueToJsonb(const_cast<JsonbValue*>(&v));
+        JsonbToCString(&buf, &jsonb->root, VARSIZE(jsonb));
+      }
+    });
+    std::string json(buf.data, buf.len);
+    pfree(buf.data);
+    *out = json_reader::LibraryJsonToProtobuf(desc_set_.type_resolver.get(),
+                                             desc, json);
+  }
+
+ private:
+  const DescSet& desc_set_;
+
+  // Iterating allocates, which may raise Postgres errors too.
+  static JsonbIterator* IteratorInit(JsonbContainer* container) {
+    JsonbIterator* it;
+    CatchPostgresErrors([&]() { it = JsonbIteratorInit(container); });
+    return it;
+  }
+
+  // Skips over nested containers, which are returned as jbvBinary.
+  static JsonbIteratorToken Next(JsonbIterator** it, JsonbValue* v) {
+    JsonbIteratorToken token;
+    CatchPostgresErrors([&]() { token = JsonbIteratorNext(it, v, true); });
+    return token;
+  }
+
+  void EncodeField(const pb::FieldDescriptor* fd, const JsonbValue& v,
+                   pb::io::CodedOutputStream* out, int depth) {
+    if (v.type == jbvNull) {
+      // Null means the default, except where null is a value itself.
+      if (fd->type() == pb::FieldDescriptor::TYPE_ENUM &&
+          fd->enum_type()->full_name() == "google.protobuf.NullValue") {
+        WireFormatLite::WriteEnum(fd->number(), 0, out);
+      } else if (fd->type() == pb::FieldDescriptor::TYPE_MESSAGE &&
+                 fd->message_type()->full_name() == "google.protobuf.Value") {
+        EncodeValue(fd, v, out, depth);
+      }
+      return;
+    }
+    if (fd->is_map()) {
+      EncodeMap(fd, v, out, depth);
+    } else if (fd->is_repeated()) {
+      EncodeRepeated(fd, v, out, depth);
+    } else {
+      EncodeValue(fd, v, out, depth);
+    }
+  }
+
+  void EncodeRepeated(const pb::FieldDescriptor* fd, const JsonbValue& v,
+                      pb::io::CodedOutputStream* out, int depth) {
+    if (v.type != jbvBinary) {
+      ThrowTypeMismatch(fd, "an array");
+    }
+    JsonbIterator* it = IteratorInit(v.val.binary.data);
+    JsonbValue elem;
+    if (Next(&it, &elem) != WJB_BEGIN_ARRAY) {
+      ThrowTypeMismatch(fd, "an array");
+    }
+    if (fd->is_packed()) {
+      std::string packed;
+      {
+        pb::io::StringOutputStream raw_stream(&packed);
+        pb::io::CodedOutputStream stream(&raw_stream);
+        while (Next(&it, &elem) == WJB_ELEM) {
+          EncodeScalar(fd, elem, false, &stream);
+        }
+      }
+      if (!packed.empty()) {
+        WireFormatLite::WriteBytes(fd->number(), packed, out);
+      }
+    } else {
+      while (Next(&it, &elem) == WJB_ELEM) {
+        EncodeValue(fd, elem, out, depth);
+      }
+    }
+  }
+
+  void EncodeMap(const pb::FieldDescriptor* fd, const JsonbValue& v,
+                 pb::io::CodedOutputStream* out, int depth) {
+    if (v.type != jbvBinary) {
+      ThrowTypeMismatch(fd, "an object");
+    }
+    const pb::FieldDescriptor* key_fd = fd->message_type()->FindFieldByNumber(1);
+    const pb::FieldDescriptor* value_fd =
+        fd->message_type()->FindFieldByNumber(2);
+
+    JsonbIterator* it = IteratorInit(v.val.binary.data);
+    JsonbValue key;
+    if (Next(&it, &key) != WJB_BEGIN_OBJECT) {
+      ThrowTypeMismatch(fd, "an object");
+    }
+    while (Next(&it, &key) == WJB_KEY) {
+      std::string entry;
+      {
+        pb::io::StringOutputStream raw_stream(&entry);
+        pb::io::CodedOutputStream stream(&raw_stream);
+        if (key_fd->type() == pb::FieldDescriptor::TYPE_BOOL) {
+          std::string_view s(key.val.string.val, key.val.string.len);
+          if (s != "true" && s != "false") {
+            ThrowTypeMismatch(key_fd, "true or false");
+          }
+          WireFormatLite::WriteBool(1, s == "true", &stream);
+        } else {
+          EncodeScalar(key_fd, key, true, &stream);
+        }
+        JsonbValue value;
+        Next(&it, &value);
+        if (value.type != jbvNull) {
+          EncodeValue(value_fd, value, &stream, depth + 1);
+        }
+      }
+      WireFormatLite::WriteBytes(fd->number(), entry, out);
+    }
+  }
+
+  void EncodeValue(const pb::FieldDescriptor* fd, const JsonbValue& v,
+                   pb::io::CodedOutputStream* out, int depth) {
+    if (fd->type() != pb::FieldDescriptor::TYPE_MESSAGE) {
+      EncodeScalar(fd, v, true, out);
+      return;
+    }
+    std::string submessage;
+    if (json_writer::IsWellKnownType(fd->message_type())) {
+      EncodeWellKnownType(fd->message_type(), v, &submessage);
+    } else if (v.type == jbvBinary) {
+      EncodeMessage(fd->message_type(), v.val.binary.data, &submessage,
+                    depth + 1);
+    } else {
+      ThrowTypeMismatch(fd, "an object");
+    }
+    WireFormatLite::WriteBytes(fd->number(), submessage, out);
+  }
+
+  void EncodeScalar(const pb::FieldDescriptor* fd, const JsonbValue& v,
+                    bool tagged, pb::io::CodedOutputStream* out) {
+    if (tagged) {
+      WireFormatLite::WriteTag(
+          fd->number(),
+          static_cast<WireFormatLite::WireType>(FieldWireType(fd)), out);
+    }
+    switch (fd->type()) {
+      case pb::FieldDescriptor::TYPE_DOUBLE:
+        WireFormatLite::WriteDoubleNoTag(
+            ParseFloat<double>(fd, NumberText(fd, v)), out);
+        break;
+      case pb::FieldDescriptor::TYPE_FLOAT:
+        WireFormatLite::WriteFloatNoTag(
+            ParseFloat<float>(fd, NumberText(fd, v)), out);
+        break;
+      case pb::FieldDescriptor::TYPE_INT64:
+        WireFormatLite::WriteInt64NoTag(
+            ParseInteger<int64_t>(fd, NumberText(fd, v)), out);
+        break;
+      case pb::FieldDescriptor::TYPE_SINT64:
+        WireFormatLite::WriteSInt64NoTag(
+            ParseInteger<int64_t>(fd, NumberText(fd, v)), out);
+        break;
+      case pb::FieldDescriptor::TYPE_SFIXED64:
+        WireFormatLite::WriteSFixed64NoTag(
+            ParseInteger<int64_t>(fd, NumberText(fd, v)), out);
+        break;
+      case pb::FieldDescriptor::TYPE_UINT64:
+        WireFormatLite::WriteUInt64NoTag(
+            ParseInteger<uint64_t>(fd, NumberText(fd, v)), out);
+        break;
+      case pb::FieldDescriptor::TYPE_FIXED64:
+        WireFormatLite::WriteFixed64NoTag(
+            ParseInteger<uint64_t>(fd, NumberText(fd, v)), out);
+        break;
+      case pb::FieldDescriptor::TYPE_INT32:
+        WireFormatLite::WriteInt32NoTag(
+            ParseInteger<int32_t>(fd, NumberText(fd, v)), out);
+        break;
+      case pb::FieldDescriptor::TYPE_SINT32:
+        WireFormatLite::WriteSInt32NoTag(
+            ParseInteger<int32_t>(fd, NumberText(fd, v)), out);
+        break;
+      case pb::FieldDescriptor::TYPE_SFIXED32:
+        WireFormatLite::WriteSFixed32NoTag(
+            ParseInteger<int32_t>(fd, NumberText(fd, v)), out);
+        break;
+      case pb::FieldDescriptor::TYPE_UINT32:
+        WireFormatLite::WriteUInt32NoTag(
+            ParseInteger<uint32_t>(fd, NumberText(fd, v)), out);
+        break;
+      case pb::FieldDescriptor::TYPE_FIXED32:
+        WireFormatLite::WriteFixed32NoTag(
+            ParseInteger<uint32_t>(fd, NumberText(fd, v)), out);
+        break;
+      case pb::FieldDescriptor::TYPE_BOOL:
+        if (v.type != jbvBool) {
+          ThrowTypeMismatch(fd, "a bool");
+        }
+        WireFormatLite::WriteBoolNoTag(v.val.boolean, out);
+        break;
+      case pb::FieldDescriptor::TYPE_ENUM:
+        WireFormatLite::WriteEnumNoTag(ParseEnum(fd, v), out);
+        break;
+      case pb::FieldDescriptor::TYPE_STRING: {
+        if (v.type != jbvString) {
+          ThrowTypeMismatch(fd, "a string");
+        }
+        const char* s;
+        CatchPostgresErrors([&]() {
+          s = pg_server_to_any(v.val.string.val, v.val.string.len, PG_UTF8);
+        });
+        size_t len = s == v.val.string.val ? v.val.string.len : strlen(s);
+        out->WriteVarint32(len);
+        out->WriteRaw(s, len);
+        break;
+      }
+      case pb::FieldDescriptor::TYPE_BYTES: {
+        if (v.type != jbvString) {
+          ThrowTypeMismatch(fd, "a base64 string");
+        }
+        std::string bytes = json_reader::DecodeBase64(
+            fd, std::string_view(v.val.string.val, v.val.string.len));
+        out->WriteVarint32(bytes.size());
+        out->WriteString(bytes);
+        break;
+      }
+      case pb::FieldDescriptor::TYPE_MESSAGE:
+      case pb::FieldDescriptor::TYPE_GROUP:
+        throw BadProto("unsupported type for field " + fd->full_name());
+    }
+  }
+
+  // Numbers may also be given as strings in protobuf JSON.
+  static std::string NumberText(const pb::FieldDescriptor* fd,
+                                const JsonbValue& v) {
+    if (v.type == jbvNumeric) {
+      char* s;
+      CatchPostgresErrors([&]() {
+        s = DatumGetCString(
+            DirectFunctionCall1(numeric_out, NumericGetDatum(v.val.numeric)));
+      });
+      std::string text(s);
+      pfree(s);
+      return text;
+    } else if (v.type == jbvString) {
+      return std::string(v.val.string.val, v.val.string.len);
+    }
+    ThrowTypeMismatch(fd, "a number");
+  }
+
+  static int ParseEnum(const pb::FieldDescriptor* fd, const JsonbValue& v) {
+    if (v.type == jbvString) {
+      return json_reader::ParseEnumName(
+          fd, std::string_view(v.val.string.val, v.val.string.len));
+    } else if (v.type == jbvNumeric) {
+      return ParseInteger<int32_t>(fd, NumberText(fd, v));
+    }
+    ThrowTypeMismatch(fd, "an enum value name or number");
+  }
+};
+
+}  // namespace
+
+struct varlena* ProtobufToJsonb(const descriptor_db::DescSet& desc_set,
+                                const pb::Descriptor* desc,
+                                const std::uint8_t* proto_data,
+                                size_t proto_len) {
+  JsonbSink sink;
+  json_writer::WriteJson(
+      desc_set.type_resolver.get(), desc,
+      std::string_view(reinterpret_cast<const char*>(proto_data), proto_len),
+      &sink);
+  return reinterpret_cast<struct varlena*>(sink.Result());
+}
+
+std::string JsonbToProtobuf(const descriptor_db::DescSet& desc_set,
+                            const pb::Descriptor* desc,
+                            const struct varlena* jsonb) {
+  Jsonb* jb = reinterpret_cast<Jsonb*>(const_cast<struct varlena*>(jsonb));
+  ProtobufEncoder encoder(desc_set);
+  std::string result;
+  if (json_writer::IsWellKnownType(desc)) {
+    JsonbValue v;
+    v.type = jbvBinary;
+    v.val.binary.data = &jb->root;
+    v.val.binary.len = VARSIZE(jb);
+    encoder.EncodeWellKnownType(desc, v, &result);
+  } else {
+    encoder.EncodeMessage(desc, &jb->root, &result, 0);
+  }
+  return result;
+}
+
+}  // namespace jsonb_conversion
+}  // namespace postgres_protobuf
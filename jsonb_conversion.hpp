@@ -0,0 +1,39 @@
+#ifndef POSTGRES_PROTOBUF_JSONB_CONVERSION_HPP_
+#define POSTGRES_PROTOBUF_JSONB_CONVERSION_HPP_
+
+#include <cstdint>
+#include <string>
+
+#include "descriptor_db.hpp"
+
+// Declared by Postgres. We don't include `postgres.h` here for the same reason
+// as in `postgres_utils.hpp`.
+struct varlena;
+
+namespace postgres_protobuf {
+namespace jsonb_conversion {
+
+namespace pb = ::google::protobuf;
+
+// Conversion between protobufs and jsonb that doesn't go through JSON text.
+// The JSON is what `json_writer` produces. Well-known types
+// (`google.protobuf.*`) have special JSON representations, so those are
+// still converted through text by the protobuf library.
+
+// Returns a palloc'd jsonb.
+// Throws BadProto if the protobuf is invalid, and RecursionDepthExceeded.
+struct varlena* ProtobufToJsonb(const descriptor_db::DescSet& desc_set,
+                                const pb::Descriptor* desc,
+                                const std::uint8_t* proto_data,
+                                size_t proto_len);
+
+// Throws BadProto if the jsonb doesn't fit the message type, and
+// RecursionDepthExceeded.
+std::string JsonbToProtobuf(const descriptor_db::DescSet& desc_set,
+                            const pb::Descriptor* desc,
+                            const struct varlena* jsonb);
+
+}  // namespace jsonb_conversion
+}  // namespace postgres_protobuf
+
+#endif  // POSTGRES_PROTOBUF_JSONB_CONVERSION_HPP_
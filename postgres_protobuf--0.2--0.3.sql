@@ -0,0 +1,411 @@
+-- complain if script is sourced in psql, rather than via CREATE EXTENSION
+\echo Use "CREATE EXTENSION postgres_protobuf" to load this file. \quit
+
+-- Lets backends keep descriptor sets cached across transactions
+-- by notifying them of changes.
+CREATE FUNCTION protobuf_file_descriptor_sets_changed()
+    RETURNS TRIGGER
+    AS 'MODULE_PATHNAME'
+    LANGUAGE C;
+
+CREATE TRIGGER protobuf_file_descriptor_sets_changed
+    AFTER INSERT OR UPDATE OR DELETE OR TRUNCATE
+    ON protobuf_file_descriptor_sets
+    FOR EACH STATEMENT
+    EXECUTE PROCEDURE protobuf_file_descriptor_sets_changed();
+
+-- Fire also when changes come from logical replication
+ALTER TABLE protobuf_file_descriptor_sets
+    ENABLE ALWAYS TRIGGER protobuf_file_descriptor_sets_changed;
+
+-- Functions only read `protobuf_file_descriptor_sets` and
+-- `protobuf_message_types`, which parallel workers can do too. Each worker
+-- loads the descriptor sets it needs once per query. Only `protobuf_typmod_in`,
+-- which adds message types, and the trigger aren't parallel safe.
+ALTER FUNCTION protobuf_extension_version() PARALLEL SAFE;
+ALTER FUNCTION protobuf_query(TEXT, BYTEA) PARALLEL SAFE;
+ALTER FUNCTION protobuf_query_multi(TEXT, BYTEA) PARALLEL SAFE;
+ALTER FUNCTION protobuf_query_array(TEXT, BYTEA) PARALLEL SAFE;
+ALTER FUNCTION protobuf_to_json_text(TEXT, BYTEA) PARALLEL SAFE;
+ALTER FUNCTION protobuf_from_json_text(TEXT, TEXT) PARALLEL SAFE;
+
+CREATE FUNCTION protobuf_query_paths(
+    IN TEXT[],  -- Queries
+    IN BYTEA    -- Binary protobuf
+)
+    RETURNS TEXT[]
+    AS 'MODULE_PATHNAME'
+    LANGUAGE C STRICT STABLE PARALLEL SAFE;
+
+-- Like `protobuf_query` on each element of the array, with the query
+-- compiled only once for all of them.
+CREATE FUNCTION protobuf_query_batch(
+    IN TEXT,     -- Query
+    IN BYTEA[]   -- Binary protobufs
+)
+    RETURNS TEXT[]
+    AS 'MODULE_PATHNAME'
+    LANGUAGE C STRICT STABLE PARALLEL SAFE;
+
+CREATE FUNCTION protobuf_query_int8(
+    IN TEXT,   -- Query
+    IN BYTEA   -- Binary protobuf
+)
+    RETURNS BIGINT
+    AS 'MODULE_PATHNAME'
+    LANGUAGE C STRICT STABLE PARALLEL SAFE;
+
+CREATE FUNCTION protobuf_query_int8_array(
+    IN TEXT,   -- Query
+    IN BYTEA   -- Binary protobuf
+)
+    RETURNS BIGINT[]
+    AS 'MODULE_PATHNAME'
+    LANGUAGE C STRICT STABLE PARALLEL SAFE;
+
+CREATE FUNCTION protobuf_query_float8(
+    IN TEXT,   -- Query
+    IN BYTEA   -- Binary protobuf
+)
+    RETURNS DOUBLE PRECISION
+    AS 'MODULE_PATHNAME'
+    LANGUAGE C STRICT STABLE PARALLEL SAFE;
+
+CREATE FUNCTION protobuf_query_float8_array(
+    IN TEXT,   -- Query
+    IN BYTEA   -- Binary protobuf
+)
+    RETURNS DOUBLE PRECISION[]
+    AS 'MODULE_PATHNAME'
+    LANGUAGE C STRICT STABLE PARALLEL SAFE;
+
+CREATE FUNCTION protobuf_query_numeric(
+    IN TEXT,   -- Query
+    IN BYTEA   -- Binary protobuf
+)
+    RETURNS NUMERIC
+    AS 'MODULE_PATHNAME'
+    LANGUAGE C STRICT STABLE PARALLEL SAFE;
+
+CREATE FUNCTION protobuf_query_numeric_array(
+    IN TEXT,   -- Query
+    IN BYTEA   -- Binary protobuf
+)
+    RETURNS NUMERIC[]
+    AS 'MODULE_PATHNAME'
+    LANGUAGE C STRICT STABLE PARALLEL SAFE;
+
+CREATE FUNCTION protobuf_query_bool(
+    IN TEXT,   -- Query
+    IN BYTEA   -- Binary protobuf
+)
+    RETURNS BOOLEAN
+    AS 'MODULE_PATHNAME'
+    LANGUAGE C STRICT STABLE PARALLEL SAFE;
+
+CREATE FUNCTION protobuf_query_bool_array(
+    IN TEXT,   -- Query
+    IN BYTEA   -- Binary protobuf
+)
+    RETURNS BOOLEAN[]
+    AS 'MODULE_PATHNAME'
+    LANGUAGE C STRICT STABLE PARALLEL SAFE;
+
+CREATE FUNCTION protobuf_query_bytea(
+    IN TEXT,   -- Query
+    IN BYTEA   -- Binary protobuf
+)
+    RETURNS BYTEA
+    AS 'MODULE_PATHNAME'
+    LANGUAGE C STRICT STABLE PARALLEL SAFE;
+
+CREATE FUNCTION protobuf_query_bytea_array(
+    IN TEXT,   -- Query
+    IN BYTEA   -- Binary protobuf
+)
+    RETURNS BYTEA[]
+    AS 'MODULE_PATHNAME'
+    LANGUAGE C STRICT STABLE PARALLEL SAFE;
+
+-- Queries that only use field numbers don't depend on the descriptor sets,
+-- so these can be used in index expressions and generated columns.
+CREATE FUNCTION protobuf_query_by_number(
+    IN TEXT,   -- Query
+    IN BYTEA   -- Binary protobuf
+)
+    RETURNS TEXT
+    AS 'MODULE_PATHNAME'
+    LANGUAGE C STRICT IMMUTABLE PARALLEL SAFE;
+
+CREATE FUNCTION protobuf_query_by_number_array(
+    IN TEXT,   -- Query
+    IN BYTEA   -- Binary protobuf
+)
+    RETURNS TEXT[]
+    AS 'MODULE_PATHNAME'
+    LANGUAGE C STRICT IMMUTABLE PARALLEL SAFE;
+
+CREATE FUNCTION protobuf_query_by_number_int8(
+    IN TEXT,   -- Query
+    IN BYTEA   -- Binary protobuf
+)
+    RETURNS BIGINT
+    AS 'MODULE_PATHNAME'
+    LANGUAGE C STRICT IMMUTABLE PARALLEL SAFE;
+
+CREATE FUNCTION protobuf_query_by_number_float8(
+    IN TEXT,   -- Query
+    IN BYTEA   -- Binary protobuf
+)
+    RETURNS DOUBLE PRECISION
+    AS 'MODULE_PATHNAME'
+    LANGUAGE C STRICT IMMUTABLE PARALLEL SAFE;
+
+CREATE FUNCTION protobuf_query_by_number_bool(
+    IN TEXT,   -- Query
+    IN BYTEA   -- Binary protobuf
+)
+    RETURNS BOOLEAN
+    AS 'MODULE_PATHNAME'
+    LANGUAGE C STRICT IMMUTABLE PARALLEL SAFE;
+
+CREATE FUNCTION protobuf_query_by_number_bytea(
+    IN TEXT,   -- Query
+    IN BYTEA   -- Binary protobuf
+)
+    RETURNS BYTEA
+    AS 'MODULE_PATHNAME'
+    LANGUAGE C STRICT IMMUTABLE PARALLEL SAFE;
+
+-- Whether any result of the query compares with the value as the operator
+-- (`=`, `!=`, `<`, `<=`, `>` or `>=`) says, without formatting the results.
+CREATE FUNCTION protobuf_match(
+    IN TEXT,   -- Query
+    IN TEXT,   -- Comparison operator
+    IN TEXT,   -- Value
+    IN BYTEA   -- Binary protobuf
+)
+    RETURNS BOOLEAN
+    AS 'MODULE_PATHNAME'
+    LANGUAGE C STRICT STABLE PARALLEL SAFE;
+
+CREATE FUNCTION protobuf_match_by_number(
+    IN TEXT,   -- Query
+    IN TEXT,   -- Comparison operator
+    IN TEXT,   -- Value
+    IN BYTEA   -- Binary protobuf
+)
+    RETURNS BOOLEAN
+    AS 'MODULE_PATHNAME'
+    LANGUAGE C STRICT IMMUTABLE PARALLEL SAFE;
+
+-- Whether the protobuf has the value at the path of field numbers,
+-- given as `<type>:<path>=<value>`, e.g. `int32:5.2=3`.
+CREATE FUNCTION protobuf_contains(
+    IN BYTEA,  -- Binary protobuf
+    IN TEXT    -- Query
+)
+    RETURNS BOOLEAN
+    AS 'MODULE_PATHNAME'
+    LANGUAGE C STRICT IMMUTABLE PARALLEL SAFE;
+
+CREATE OPERATOR @> (
+    LEFTARG = BYTEA,
+    RIGHTARG = TEXT,
+    FUNCTION = protobuf_contains,
+    RESTRICT = contsel,
+    JOIN = contjoinsel
+);
+
+CREATE FUNCTION protobuf_gin_extract_value(BYTEA, INTERNAL, INTERNAL)
+    RETURNS INTERNAL
+    AS 'MODULE_PATHNAME'
+    LANGUAGE C STRICT IMMUTABLE PARALLEL SAFE;
+
+CREATE FUNCTION protobuf_gin_extract_query(TEXT, INTERNAL, INT2, INTERNAL, INTERNAL, INTERNAL, INTERNAL)
+    RETURNS INTERNAL
+    AS 'MODULE_PATHNAME'
+    LANGUAGE C STRICT IMMUTABLE PARALLEL SAFE;
+
+CREATE FUNCTION protobuf_gin_consistent(INTERNAL, INT2, TEXT, INT4, INTERNAL, INTERNAL, INTERNAL, INTERNAL)
+    RETURNS BOOLEAN
+    AS 'MODULE_PATHNAME'
+    LANGUAGE C STRICT IMMUTABLE PARALLEL SAFE;
+
+-- Indexes every value in protobufs by its path of field numbers, for `@>`.
+CREATE OPERATOR CLASS protobuf_path_ops
+    FOR TYPE BYTEA USING gin AS
+        OPERATOR 1 @> (BYTEA, TEXT),
+        FUNCTION 1 btint4cmp(INT4, INT4),
+        FUNCTION 2 protobuf_gin_extract_value(BYTEA, INTERNAL, INTERNAL),
+        FUNCTION 3 protobuf_gin_extract_query(TEXT, INTERNAL, INT2, INTERNAL, INTERNAL, INTERNAL, INTERNAL),
+        FUNCTION 4 protobuf_gin_consistent(INTERNAL, INT2, TEXT, INT4, INTERNAL, INTERNAL, INTERNAL, INTERNAL),
+        STORAGE INT4;
+
+-- Numbers the message types given as type modifiers of `protobuf`.
+-- Rows are added when a type modifier is first used, and must not be changed
+-- after that. Dumps refer to message types by name, so this isn't dumped.
+-- Anyone may add message types, but only the identity column numbers them,
+-- since a typmod taken out of turn would make adding a type fail later.
+CREATE TABLE protobuf_message_types (
+    typmod INT4 GENERATED ALWAYS AS IDENTITY PRIMARY KEY,
+    descriptor_set TEXT NOT NULL,
+    message_type TEXT NOT NULL,
+    UNIQUE (descriptor_set, message_type)
+);
+GRANT SELECT, INSERT (descriptor_set, message_type) ON protobuf_message_types TO PUBLIC;
+
+-- A binary protobuf, stored like BYTEA. Its message type may be given as
+-- `protobuf('pkg.Msg')` or `protobuf('descriptor_set:pkg.Msg')`.
+CREATE TYPE protobuf;
+
+CREATE FUNCTION protobuf_in(CSTRING)
+    RETURNS protobuf
+    AS 'byteain'
+    LANGUAGE internal STRICT IMMUTABLE PARALLEL SAFE;
+
+CREATE FUNCTION protobuf_out(protobuf)
+    RETURNS CSTRING
+    AS 'byteaout'
+    LANGUAGE internal STRICT IMMUTABLE PARALLEL SAFE;
+
+CREATE FUNCTION protobuf_recv(INTERNAL)
+    RETURNS protobuf
+    AS 'bytearecv'
+    LANGUAGE internal STRICT IMMUTABLE PARALLEL SAFE;
+
+CREATE FUNCTION protobuf_send(protobuf)
+    RETURNS BYTEA
+    AS 'byteasend'
+    LANGUAGE internal STRICT IMMUTABLE PARALLEL SAFE;
+
+-- Not STABLE, because it adds new message types to `protobuf_message_types`.
+-- New types can't be added on a standby or in a read-only transaction.
+CREATE FUNCTION protobuf_typmod_in(CSTRING[])
+    RETURNS INT4
+    AS 'MODULE_PATHNAME'
+    LANGUAGE C STRICT;
+
+CREATE FUNCTION protobuf_typmod_out(INT4)
+    RETURNS CSTRING
+    AS 'MODULE_PATHNAME'
+    LANGUAGE C STRICT STABLE PARALLEL SAFE;
+
+CREATE TYPE protobuf (
+    INPUT = protobuf_in,
+    OUTPUT = protobuf_out,
+    RECEIVE = protobuf_recv,
+    SEND = protobuf_send,
+    TYPMOD_IN = protobuf_typmod_in,
+    TYPMOD_OUT = protobuf_typmod_out,
+    INTERNALLENGTH = VARIABLE,
+    ALIGNMENT = int4,
+    STORAGE = extended
+);
+
+-- All functions taking BYTEA protobufs also take `protobuf`s
+CREATE CAST (protobuf AS BYTEA) WITHOUT FUNCTION AS IMPLICIT;
+CREATE CAST (BYTEA AS protobuf) WITHOUT FUNCTION AS ASSIGNMENT;
+
+-- Like `protobuf_query` and `protobuf_query_array`, but the query is only
+-- a path, and the message type comes from the type modifier.
+CREATE FUNCTION protobuf_get(
+    IN protobuf,  -- Binary protobuf with a message type
+    IN TEXT       -- Path
+)
+    RETURNS TEXT
+    AS 'MODULE_PATHNAME'
+    LANGUAGE C STRICT STABLE PARALLEL SAFE;
+
+CREATE FUNCTION protobuf_get_array(
+    IN protobuf,  -- Binary protobuf with a message type
+    IN TEXT       -- Path
+)
+    RETURNS TEXT[]
+    AS 'MODULE_PATHNAME'
+    LANGUAGE C STRICT STABLE PARALLEL SAFE;
+
+CREATE OPERATOR -> (
+    LEFTARG = protobuf,
+    RIGHTARG = TEXT,
+    FUNCTION = protobuf_get
+);
+
+CREATE OPERATOR #> (
+    LEFTARG = protobuf,
+    RIGHTARG = TEXT,
+    FUNCTION = protobuf_get_array
+);
+
+-- Like `protobuf_match`, with the path, operator and value in one string,
+-- e.g. `'items[*].price > 100'`.
+CREATE FUNCTION protobuf_get_match(
+    IN protobuf,  -- Binary protobuf with a message type
+    IN TEXT       -- Predicate
+)
+    RETURNS BOOLEAN
+    AS 'MODULE_PATHNAME'
+    LANGUAGE C STRICT STABLE PARALLEL SAFE;
+
+CREATE OPERATOR @@ (
+    LEFTARG = protobuf,
+    RIGHTARG = TEXT,
+    FUNCTION = protobuf_get_match
+);
+
+CREATE FUNCTION protobuf_to_jsonb(
+    IN TEXT,  -- protobuf type
+    IN BYTEA  -- Binary protobuf
+)
+    RETURNS JSONB
+    AS 'MODULE_PATHNAME'
+    LANGUAGE C STRICT STABLE PARALLEL SAFE;
+
+CREATE FUNCTION protobuf_from_jsonb(
+    IN TEXT,  -- protobuf type
+    IN JSONB  -- JSON
+)
+    RETURNS BYTEA
+    AS 'MODULE_PATHNAME'
+    LANGUAGE C STRICT STABLE PARALLEL SAFE;
+
+-- Packs protobufs into a repeated message field, e.g. the `items` of
+-- `message Batch { repeated Item items = 1; }`, without decoding them.
+CREATE FUNCTION protobuf_agg_transfn(
+    IN INTERNAL,  -- State
+    IN BYTEA,     -- Binary protobuf
+    IN INT4       -- Field number
+)
+    RETURNS INTERNAL
+    AS 'MODULE_PATHNAME'
+    LANGUAGE C IMMUTABLE PARALLEL SAFE;
+
+CREATE FUNCTION protobuf_agg_finalfn(INTERNAL)
+    RETURNS BYTEA
+    AS 'MODULE_PATHNAME'
+    LANGUAGE C IMMUTABLE PARALLEL SAFE;
+
+CREATE FUNCTION protobuf_agg_combinefn(INTERNAL, INTERNAL)
+    RETURNS INTERNAL
+    AS 'MODULE_PATHNAME'
+    LANGUAGE C IMMUTABLE PARALLEL SAFE;
+
+CREATE FUNCTION protobuf_agg_serialfn(INTERNAL)
+    RETURNS BYTEA
+    AS 'MODULE_PATHNAME'
+    LANGUAGE C STRICT IMMUTABLE PARALLEL SAFE;
+
+CREATE FUNCTION protobuf_agg_deserialfn(BYTEA, INTERNAL)
+    RETURNS INTERNAL
+    AS 'MODULE_PATHNAME'
+    LANGUAGE C STRICT IMMUTABLE PARALLEL SAFE;
+
+CREATE AGGREGATE protobuf_agg(BYTEA, INT4) (
+    SFUNC = protobuf_agg_transfn,
+    STYPE = INTERNAL,
+    FINALFUNC = protobuf_agg_finalfn,
+    COMBINEFUNC = protobuf_agg_combinefn,
+    SERIALFUNC = protobuf_agg_serialfn,
+    DESERIALFUNC = protobuf_agg_deserialfn,
+    PARALLEL = SAFE
+);
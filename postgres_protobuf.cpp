@@ -1,23 +1,52 @@
 #include "descriptor_db.hpp"
+#include "indexing.hpp"
+#include "json_reader.hpp"
+#include "json_writer.hpp"
+#include "jsonb_conversion.hpp"
 #include "postgres_protobuf_common.hpp"
 #include "postgres_utils.hpp"
 #include "querying.hpp"
+#include "shared_cache.hpp"
+#include "wire_format.hpp"
 
 #include <google/protobuf/descriptor.h>
-#include <google/protobuf/util/json_util.h>
 
+#include <algorithm>
 #include <cassert>
+#include <cinttypes>
+#include <climits>
+#include <cstdio>
+#include <memory>
+#include <string_view>
 
 extern "C" {
 // Must be included before other Postgres headers
 #include <postgres.h>
 
 #include <access/htup_details.h>
+#include <access/xact.h>
+#include <access/xlog.h>
+#if PG_VERSION_NUM >= 130000
+#include <access/detoast.h>
+#else
+#include <access/tuptoaster.h>
+#endif
 #include <catalog/pg_type.h>
+#include <commands/trigger.h>
+#include <executor/spi.h>
 #include <fmgr.h>
 #include <funcapi.h>
+#include <lib/stringinfo.h>
+#include <mb/pg_wchar.h>
+#include <nodes/nodeFuncs.h>
 #include <utils/array.h>
+#include <utils/builtins.h>
+#include <utils/guc.h>
+#include <utils/inval.h>
 #include <utils/lsyscache.h>
+#include <utils/rel.h>
+
+#include "postgres_protobuf.h"
 }  // extern "C"
 
 namespace postgres_protobuf {
@@ -42,21 +71,835 @@ PG_MODULE_MAGIC;
 }  // extern "C"
 
 namespace {
+// Lives in `multi_call_memory_ctx` for the duration of one call of
+// `protobuf_query_multi`.
 class MultiQueryState {
  public:
-  MultiQueryState() : index(0) {}
+  explicit MultiQueryState(const std::string& query_str)
+      : stream(query_str), index(0), cleanup{} {}
 
-  pvector<text*> rows;
+  querying::QueryStream stream;
+  // The last batch of results from `stream` and how many have been returned
+  std::vector<std::string_view> rows;
   size_t index;
+  MemoryContextCallback cleanup;
+};
+
+class ProtobufNotFound {
+ public:
+  explicit ProtobufNotFound(std::string&& name) : name(name) {}
+  const std::string name;
+};
+
+// What `BadProto` means in `ReportExceptions`.
+enum class Input {
+  Protobuf,
+  Json,  // The JSON being converted to a protobuf is invalid
+};
+
+// Calls `f`, turning the C++ exceptions that the extension throws into
+// Postgres errors. Postgres errors must not be raised from `f` while it has
+// anything on the C++ heap.
+template <typename F>
+auto ReportExceptions(F f, Input input = Input::Protobuf) -> decltype(f()) {
+  try {
+    return f();
+  } catch (const std::bad_alloc& e) {
+    ereport(ERROR, (errcode(ERRCODE_OUT_OF_MEMORY), errmsg("out of memory")));
+  } catch (const PostgresError& e) {
+    ReThrowError(e.data);
+  } catch (const ProtobufNotFound& e) {
+    ereport(ERROR, (errcode(ERRCODE_INTERNAL_ERROR),
+                    errmsg("invalid query: protobuf type %s not found",
+                           e.name.c_str())));
+  } catch (const BadProto& e) {
+    if (input == Input::Json) {
+      ereport(ERROR, (errcode(ERRCODE_INVALID_TEXT_REPRESENTATION),
+                      errmsg("invalid protobuf JSON: %s", e.msg.c_str())));
+    }
+    // TODO: is this a good error code?
+    ereport(ERROR, (errcode(ERRCODE_INVALID_BINARY_REPRESENTATION),
+                    errmsg("invalid protobuf: %s", e.msg.c_str())));
+  } catch (const querying::BadQuery& e) {
+    // TODO: is this a good error code?
+    ereport(ERROR, (errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+                    errmsg("invalid query: %s", e.msg.c_str())));
+  } catch (const querying::ResultOutOfRange& e) {
+    ereport(ERROR, (errcode(ERRCODE_NUMERIC_VALUE_OUT_OF_RANGE),
+                    errmsg("%s", e.msg.c_str())));
+  } catch (const querying::RecursionDepthExceeded& e) {
+    // TODO: is this a good error code?
+    ereport(ERROR, (errcode(ERRCODE_PROGRAM_LIMIT_EXCEEDED),
+                    errmsg("protobuf recursion depth exceeded"),
+                    errhint("Messages may be nested up to "
+                            "postgres_protobuf.max_depth levels.")));
+  } catch (...) {
+    ereport(ERROR,
+            (errcode(ERRCODE_INTERNAL_ERROR),
+             errmsg("unknown C++ exception in postgres_protobuf extension")));
+  }
+}
+
+const config_enum_entry query_engine_options[] = {
+    {"flat", static_cast<int>(querying::Engine::Flat), false},
+    {"visitor", static_cast<int>(querying::Engine::Visitor), false},
+    {nullptr, 0, false},
+};
+
+int query_engine_setting = static_cast<int>(querying::Engine::Flat);
+
+void AssignQueryEngine(int new_value, void*) {
+  querying::SetEngine(static_cast<querying::Engine>(new_value));
+}
+
+const config_enum_entry json_writer_options[] = {
+    {"native", static_cast<int>(json_writer::Implementation::Native), false},
+    {"library", static_cast<int>(json_writer::Implementation::Library), false},
+    {nullptr, 0, false},
+};
+
+int json_writer_setting = static_cast<int>(json_writer::Implementation::Native);
+
+void AssignJsonWriter(int new_value, void*) {
+  json_writer::SetImplementation(
+      static_cast<json_writer::Implementation>(new_value));
+}
+
+const config_enum_entry json_reader_options[] = {
+    {"native", static_cast<int>(json_reader::Implementation::Native), false},
+    {"library", static_cast<int>(json_reader::Implementation::Library), false},
+    {nullptr, 0, false},
+};
+
+int json_reader_setting = static_cast<int>(json_reader::Implementation::Native);
+
+void AssignJsonReader(int new_value, void*) {
+  json_reader::SetImplementation(
+      static_cast<json_reader::Implementation>(new_value));
+}
+
+int max_depth_setting = 100;
+
+void AssignMaxDepth(int new_value, void*) {
+  querying::SetMaxDepth(new_value);
+}
+
+// Where a query function takes its query and protobuf from.
+enum class QueryArgs {
+  // A full query, then the protobuf.
+  QueryFirst,
+  // A protobuf of type `protobuf('<message_type>')`, then a path.
+  ProtobufFirst,
+};
+
+// The query last compiled at a call site. Kept in `fn_extra` so that calls
+// with a constant query don't even need to look in the query cache.
+class CallSiteQuery {
+ public:
+  CallSiteQuery() : cleanup{} {}
+
+  pstring query_str;
+  std::unique_ptr<querying::Query> query;
+  // For `QueryArgs::ProtobufFirst`, `<descriptor_set>:<message_type>` from
+  // the protobuf argument's typmod, once looked up.
+  pstring message_type;
+  MemoryContextCallback cleanup;
+};
+
+// Like `CallSiteQuery`, for `protobuf_match` and `@@`.
+class CallSiteMatch {
+ public:
+  CallSiteMatch() : cleanup{} {}
+
+  // The arguments that `match` was compiled from. For `@@`, `query_str`
+  // is the whole predicate.
+  pstring query_str;
+  pstring op_str;
+  pstring value_str;
+  std::unique_ptr<querying::Match> match;
+  pstring message_type;  // As in `CallSiteQuery`
+  MemoryContextCallback cleanup;
+};
+
+// Like `CallSiteQuery`, for functions taking an array of queries.
+class CallSiteQuerySet {
+ public:
+  CallSiteQuerySet() : cleanup{} {}
+
+  std::vector<std::string> query_strs;
+  std::unique_ptr<querying::QuerySet> query_set;
+  MemoryContextCallback cleanup;
 };
 
-class ProtobufNotFound {};
+// A `MemoryContextCallback` for objects allocated with `pnew`.
+template <typename T>
+void DestroyOnReset(void* arg) {
+  // The memory itself is freed along with the memory context.
+  static_cast<T*>(arg)->~T();
+}
+
+// Returns the `T` stored in `fn_extra`, creating it on first use.
+template <typename T>
+T* GetCallSiteCache(FunctionCallInfo fcinfo) {
+  FmgrInfo* flinfo = fcinfo->flinfo;
+  T* cached = static_cast<T*>(flinfo->fn_extra);
+  if (cached == nullptr) {
+    MemoryContext old_context = MemoryContextSwitchTo(flinfo->fn_mcxt);
+    cached = pnew<T>();
+    MemoryContextSwitchTo(old_context);
+    cached->cleanup.func = &DestroyOnReset<T>;
+    cached->cleanup.arg = cached;
+    MemoryContextRegisterResetCallback(flinfo->fn_mcxt, &cached->cleanup);
+    flinfo->fn_extra = cached;
+  }
+  return cached;
+}
+
+// Queries that stop at their first result are first run on a prefix of this
+// size of a toasted protobuf, and then on prefixes 4 times longer each time.
+constexpr int64 kFirstProtobufSliceSize = 8192;
+
+// Calls `run(proto_data, proto_len)` with the protobuf in argument `argno`
+// for a query with a result limit. If the protobuf is toasted, it's fetched
+// and decompressed in growing prefixes until the query reaches its limit, so
+// that results near the start of a large protobuf are found without reading
+// all of it. The data given to the last call is left allocated.
+template <typename Q, typename F>
+void RunOnProtobufPrefixes(FunctionCallInfo fcinfo, int argno, const Q& query,
+                           F run) {
+  Datum datum = PG_GETARG_DATUM(argno);
+  struct varlena* attr =
+      reinterpret_cast<struct varlena*>(DatumGetPointer(datum));
+  if (VARATT_IS_EXTERNAL(attr) || VARATT_IS_COMPRESSED(attr)) {
+    int64 size = toast_raw_datum_size(datum) - VARHDRSZ;
+    for (int64 slice_size = kFirstProtobufSliceSize; slice_size < size;
+         slice_size *= 4) {
+      bytea* slice =
+          DatumGetByteaPSlice(datum, 0, static_cast<int32>(slice_size));
+      try {
+        run(reinterpret_cast<const uint8*>(VARDATA_ANY(slice)),
+            VARSIZE_ANY_EXHDR(slice));
+        if (query.ReachedLimit()) {
+          PGPROTO_DEBUG("Query done after %ld bytes",
+                        static_cast<long>(slice_size));
+          return;
+        }
+      } catch (const BadProto&) {
+        // Most likely a field was cut off at the end of the slice
+      }
+      pfree(slice);
+    }
+  }
+
+  bytea* proto_bytea = PG_GETARG_BYTEA_P(argno);
+  run(reinterpret_cast<const uint8*>(VARDATA_ANY(proto_bytea)),
+      VARSIZE_ANY_EXHDR(proto_bytea));
+}
+
+// Returns the typmod of the expression given as argument `argno`,
+// or -1 if it's not known.
+int32 GetArgTypmod(FunctionCallInfo fcinfo, int argno) {
+  Node* expr = fcinfo->flinfo->fn_expr;
+  List* args;
+  if (expr == nullptr) {
+    return -1;
+  } else if (IsA(expr, FuncExpr)) {
+    args = reinterpret_cast<FuncExpr*>(expr)->args;
+  } else if (IsA(expr, OpExpr)) {
+    args = reinterpret_cast<OpExpr*>(expr)->args;
+  } else {
+    return -1;
+  }
+  if (argno >= list_length(args)) {
+    return -1;
+  }
+  return exprTypmod(static_cast<Node*>(list_nth(args, argno)));
+}
+
+// The typmods of `protobuf` number the message types in
+// `protobuf_message_types`. These functions raise Postgres errors,
+// so they keep nothing on the C++ heap.
+
+// Returns the typmod of a message type, adding it to the table if it's new.
+// Adding is impossible on a standby or in a read-only transaction.
+int32 MessageTypeTypmod(const char* desc_set_name, const char* message_name) {
+  if (SPI_connect() != SPI_OK_CONNECT) {
+    ereport(ERROR,
+            (errcode(ERRCODE_INTERNAL_ERROR), errmsg("SPI_connect failed")));
+  }
+
+  Oid arg_types[2] = {TEXTOID, TEXTOID};
+  Datum args[2] = {CStringGetTextDatum(desc_set_name),
+                   CStringGetTextDatum(message_name)};
+  // The insert finds nothing to return if another transaction has just
+  // added the same type, in which case the second select sees it.
+  const char* sqls[3] = {
+      "SELECT typmod FROM protobuf_message_types "
+      "WHERE descriptor_set = $1 AND message_type = $2",
+      "INSERT INTO protobuf_message_types (descriptor_set, message_type) "
+      "VALUES ($1, $2) ON CONFLICT DO NOTHING RETURNING typmod",
+      "SELECT typmod FROM protobuf_message_types "
+      "WHERE descriptor_set = $1 AND message_type = $2",
+  };
+  int32 typmod = -1;
+  for (const char* sql : sqls) {
+    if (sql == sqls[1] &&
+        (RecoveryInProgress() || XactReadOnly || IsInParallelMode())) {
+      ereport(ERROR,
+              (errcode(ERRCODE_READ_ONLY_SQL_TRANSACTION),
+               errmsg("protobuf message type %s:%s is not registered yet",
+                      desc_set_name, message_name),
+               errdetail("Registering it writes to protobuf_message_types, "
+                         "which this transaction can't do."),
+               errhint("Use the type once in a read-write transaction on "
+                       "the primary server.")));
+    }
+    int status =
+        SPI_execute_with_args(sql, 2, arg_types, args, nullptr, false, 1);
+    if (status != SPI_OK_SELECT && status != SPI_OK_INSERT_RETURNING) {
+      ereport(ERROR, (errcode(ERRCODE_INTERNAL_ERROR),
+                      errmsg("SPI_execute failed: %s",
+                             SPI_result_code_string(status))));
+    }
+    if (SPI_processed > 0) {
+      bool isnull;
+      typmod = DatumGetInt32(SPI_getbinval(SPI_tuptable->vals[0],
+                                           SPI_tuptable->tupdesc, 1, &isnull));
+      break;
+    }
+  }
+
+  if (SPI_finish() != SPI_OK_FINISH) {
+    ereport(ERROR,
+            (errcode(ERRCODE_INTERNAL_ERROR), errmsg("SPI_finish failed")));
+  }
+  if (typmod < 0) {
+    ereport(ERROR,
+            (errcode(ERRCODE_T_R_SERIALIZATION_FAILURE),
+             errmsg("could not add protobuf message type %s:%s",
+                    desc_set_name, message_name)));
+  }
+  return typmod;
+}
 
-void GetProtobufInfoOrThrow(const pstring& desc_spec,
-                            std::string* desc_name_append_out,
-                            pb::util::TypeResolver** type_resolver_out) {
-  const descriptor_db::DescDb& desc_db =
-      *descriptor_db::DescDb::GetOrCreateCached();
+// Looks up the message type of a typmod. The names are palloc'd.
+void LookUpMessageType(int32 typmod, char** desc_set_name_out,
+                       char** message_name_out) {
+  MemoryContext outer_mctx = CurrentMemoryContext;
+
+  if (SPI_connect() != SPI_OK_CONNECT) {
+    ereport(ERROR,
+            (errcode(ERRCODE_INTERNAL_ERROR), errmsg("SPI_connect failed")));
+  }
+
+  const char* sql =
+      "SELECT descriptor_set, message_type FROM protobuf_message_types "
+      "WHERE typmod = $1";
+  Oid arg_types[1] = {INT4OID};
+  Datum args[1] = {Int32GetDatum(typmod)};
+  int status =
+      SPI_execute_with_args(sql, 1, arg_types, args, nullptr, true, 1);
+  if (status != SPI_OK_SELECT) {
+    ereport(ERROR,
+            (errcode(ERRCODE_INTERNAL_ERROR),
+             errmsg("SPI_execute failed: %s", SPI_result_code_string(status))));
+  }
+  if (SPI_processed == 0) {
+    ereport(ERROR, (errcode(ERRCODE_UNDEFINED_OBJECT),
+                    errmsg("unknown protobuf type modifier %d", typmod)));
+  }
+
+  // Copy the names out to the caller's context, which outlasts `SPI_finish`.
+  MemoryContextSwitchTo(outer_mctx);
+  *desc_set_name_out =
+      SPI_getvalue(SPI_tuptable->vals[0], SPI_tuptable->tupdesc, 1);
+  *message_name_out =
+      SPI_getvalue(SPI_tuptable->vals[0], SPI_tuptable->tupdesc, 2);
+
+  if (SPI_finish() != SPI_OK_FINISH) {
+    ereport(ERROR,
+            (errcode(ERRCODE_INTERNAL_ERROR), errmsg("SPI_finish failed")));
+  }
+}
+
+// For `QueryArgs::ProtobufFirst`, sets `*message_type` to
+// `<descriptor_set>:<message_type>` from the typmod of the protobuf argument
+// unless it's already set. The expression at a call site doesn't change,
+// so this is looked up only once.
+void LookUpCallSiteMessageType(FunctionCallInfo fcinfo,
+                               pstring* message_type) {
+  if (!message_type->empty()) {
+    return;
+  }
+  int32 typmod = GetArgTypmod(fcinfo, 0);
+  if (typmod < 0) {
+    throw querying::BadQuery(
+        "the protobuf's message type is not known (use a value of type "
+        "protobuf('<message_type>'))");
+  }
+  char* desc_set_name;
+  char* message_name;
+  LookUpMessageType(typmod, &desc_set_name, &message_name);
+  MemoryContext old_context = MemoryContextSwitchTo(fcinfo->flinfo->fn_mcxt);
+  message_type->assign(desc_set_name);
+  message_type->append(":");
+  message_type->append(message_name);
+  MemoryContextSwitchTo(old_context);
+}
+
+querying::Query& GetCallSiteQuery(
+    FunctionCallInfo fcinfo, std::optional<uint64_t> limit,
+    querying::ResultType result_type = querying::ResultType::Text,
+    querying::Schema schema = querying::Schema::DescriptorSet,
+    QueryArgs query_args = QueryArgs::QueryFirst) {
+  text* query_text =
+      PG_GETARG_TEXT_P(query_args == QueryArgs::QueryFirst ? 0 : 1);
+  std::string_view query_sv(VARDATA_ANY(query_text),
+                            VARSIZE_ANY_EXHDR(query_text));
+
+  FmgrInfo* flinfo = fcinfo->flinfo;
+  CallSiteQuery* cached = GetCallSiteCache<CallSiteQuery>(fcinfo);
+
+  if (cached->query == nullptr ||
+      std::string_view(cached->query_str) != query_sv ||
+      !cached->query->IsUpToDate()) {
+    cached->query.reset();
+
+    std::string query_str;
+    if (query_args == QueryArgs::ProtobufFirst) {
+      LookUpCallSiteMessageType(fcinfo, &cached->message_type);
+      query_str.append(cached->message_type).append(":");
+    }
+    query_str.append(query_sv);
+    cached->query = std::make_unique<querying::Query>(query_str, limit,
+                                                      result_type, schema);
+    MemoryContext old_context = MemoryContextSwitchTo(flinfo->fn_mcxt);
+    cached->query_str.assign(query_sv);
+    MemoryContextSwitchTo(old_context);
+  }
+  return *cached->query;
+}
+
+// Takes (query, operator, value, protobuf), or for `QueryArgs::ProtobufFirst`
+// (protobuf, `<path> <operator> <value>`).
+querying::Match& GetCallSiteMatch(FunctionCallInfo fcinfo,
+                                  querying::Schema schema,
+                                  QueryArgs query_args) {
+  FmgrInfo* flinfo = fcinfo->flinfo;
+  CallSiteMatch* cached = GetCallSiteCache<CallSiteMatch>(fcinfo);
+
+  if (query_args == QueryArgs::QueryFirst) {
+    text* query_text = PG_GETARG_TEXT_P(0);
+    text* op_text = PG_GETARG_TEXT_P(1);
+    text* value_text = PG_GETARG_TEXT_P(2);
+    std::string_view query_sv(VARDATA_ANY(query_text),
+                              VARSIZE_ANY_EXHDR(query_text));
+    std::string_view op_sv(VARDATA_ANY(op_text), VARSIZE_ANY_EXHDR(op_text));
+    std::string_view value_sv(VARDATA_ANY(value_text),
+                              VARSIZE_ANY_EXHDR(value_text));
+    if (cached->match == nullptr ||
+        std::string_view(cached->query_str) != query_sv ||
+        std::string_view(cached->op_str) != op_sv ||
+        std::string_view(cached->value_str) != value_sv ||
+        !cached->match->IsUpToDate()) {
+      cached->match.reset();
+      querying::Predicate predicate{querying::ParseCompareOp(op_sv),
+                                    std::string(value_sv)};
+      cached->match = std::make_unique<querying::Match>(
+          std::string(query_sv), predicate, schema);
+      MemoryContext old_context = MemoryContextSwitchTo(flinfo->fn_mcxt);
+      cached->query_str.assign(query_sv);
+      cached->op_str.assign(op_sv);
+      cached->value_str.assign(value_sv);
+      MemoryContextSwitchTo(old_context);
+    }
+  } else {
+    text* predicate_text = PG_GETARG_TEXT_P(1);
+    std::string_view predicate_sv(VARDATA_ANY(predicate_text),
+                                  VARSIZE_ANY_EXHDR(predicate_text));
+    if (cached->match == nullptr ||
+        std::string_view(cached->query_str) != predicate_sv ||
+        !cached->match->IsUpToDate()) {
+      cached->match.reset();
+      LookUpCallSiteMessageType(fcinfo, &cached->message_type);
+      std::string path;
+      querying::Predicate predicate;
+      querying::SplitPredicate(std::string(predicate_sv), &path,
+                               &predicate.op, &predicate.value);
+      std::string query_str(cached->message_type.data(),
+                            cached->message_type.size());
+      query_str.append(":").append(path);
+      cached->match =
+          std::make_unique<querying::Match>(query_str, predicate, schema);
+      MemoryContext old_context = MemoryContextSwitchTo(flinfo->fn_mcxt);
+      cached->query_str.assign(predicate_sv);
+      MemoryContextSwitchTo(old_context);
+    }
+  }
+  return *cached->match;
+}
+
+// Takes the queries from the first argument, which must be a text array.
+querying::QuerySet& GetCallSiteQuerySet(FunctionCallInfo fcinfo,
+                                        std::optional<uint64_t> limit) {
+  ArrayType* query_array = PG_GETARG_ARRAYTYPE_P(0);
+  Datum* query_datums;
+  bool* query_nulls;
+  int num_queries;
+  deconstruct_array(query_array, TEXTOID, -1, false, 'i', &query_datums,
+                    &query_nulls, &num_queries);
+
+  CallSiteQuerySet* cached = GetCallSiteCache<CallSiteQuerySet>(fcinfo);
+
+  bool same_queries =
+      cached->query_set != nullptr &&
+      cached->query_strs.size() == static_cast<size_t>(num_queries);
+  for (int i = 0; i < num_queries; ++i) {
+    if (query_nulls[i]) {
+      throw querying::BadQuery("query must not be null");
+    }
+    if (same_queries) {
+      text* query_text = DatumGetTextPP(query_datums[i]);
+      same_queries = cached->query_strs[i] ==
+                     std::string_view(VARDATA_ANY(query_text),
+                                      VARSIZE_ANY_EXHDR(query_text));
+    }
+  }
+
+  if (!same_queries || !cached->query_set->IsUpToDate()) {
+    cached->query_set.reset();
+    cached->query_strs.clear();
+    for (int i = 0; i < num_queries; ++i) {
+      text* query_text = DatumGetTextPP(query_datums[i]);
+      cached->query_strs.emplace_back(VARDATA_ANY(query_text),
+                                      VARSIZE_ANY_EXHDR(query_text));
+    }
+    cached->query_set =
+        std::make_unique<querying::QuerySet>(cached->query_strs, limit);
+  }
+  return *cached->query_set;
+}
+
+// Copies `data` into a palloc'd text or bytea.
+struct varlena* VarlenaFromView(std::string_view data) {
+  size_t size = VARHDRSZ + data.size();
+  struct varlena* p =
+      static_cast<struct varlena*>(palloc_or_throw_bad_alloc(size));
+  SET_VARSIZE(p, size);
+  memcpy(VARDATA(p), data.data(), data.size());
+  return p;
+}
+
+// For `protobuf_agg`, which doesn't need to catch C++ exceptions, since
+// unlike `VarlenaFromView` this can't throw.
+bytea* AggStateToBytea(StringInfo state) {
+  bytea* result = static_cast<bytea*>(palloc(VARHDRSZ + state->len));
+  SET_VARSIZE(result, VARHDRSZ + state->len);
+  memcpy(VARDATA(result), state->data, state->len);
+  return result;
+}
+
+// Builds a text array with each row copied straight into place, instead of
+// making a text datum for each row and having `construct_md_array` copy
+// those. The rows that `nulls` marks, if given, are nulls.
+ArrayType* TextArrayFromRows(const std::vector<std::string_view>& rows,
+                             const std::vector<bool>* nulls, int ndim,
+                             const int* dims, const int* lbs) {
+  if (rows.empty()) {
+    return construct_empty_array(TEXTOID);
+  }
+  // Laid out as `construct_md_array` would, with text's 'i' alignment.
+  bool has_nulls = false;
+  size_t data_size = 0;
+  for (size_t i = 0; i < rows.size(); ++i) {
+    if (nulls != nullptr && (*nulls)[i]) {
+      has_nulls = true;
+    } else {
+      data_size += INTALIGN(VARHDRSZ + rows[i].size());
+    }
+  }
+  int nitems = static_cast<int>(rows.size());
+  size_t overhead = has_nulls ? ARR_OVERHEAD_WITHNULLS(ndim, nitems)
+                              : ARR_OVERHEAD_NONULLS(ndim);
+  size_t size = overhead + data_size;
+  ArrayType* result =
+      static_cast<ArrayType*>(palloc0_or_throw_bad_alloc(size));
+  SET_VARSIZE(result, size);
+  result->ndim = ndim;
+  result->dataoffset = has_nulls ? static_cast<int32>(overhead) : 0;
+  result->elemtype = TEXTOID;
+  memcpy(ARR_DIMS(result), dims, ndim * sizeof(int));
+  memcpy(ARR_LBOUND(result), lbs, ndim * sizeof(int));
+  bits8* null_bitmap = ARR_NULLBITMAP(result);  // Zeroed, i.e. all null
+  char* p = ARR_DATA_PTR(result);
+  for (size_t i = 0; i < rows.size(); ++i) {
+    if (has_nulls) {
+      if ((*nulls)[i]) {
+        continue;
+      }
+      null_bitmap[i / 8] |= 1 << (i % 8);
+    }
+    SET_VARSIZE(p, VARHDRSZ + rows[i].size());
+    memcpy(VARDATA(p), rows[i].data(), rows[i].size());
+    p += INTALIGN(VARHDRSZ + rows[i].size());
+  }
+  return result;
+}
+
+ArrayType* TextArrayFromRows(const std::vector<std::string_view>& rows) {
+  int dims[1] = {static_cast<int>(rows.size())};
+  int lbs[1] = {1};
+  return TextArrayFromRows(rows, nullptr, 1, dims, lbs);
+}
+
+// Builds an int8[] or float8[] array from values of the same layout as its
+// elements, with a single copy.
+template <typename T>
+ArrayType* NumberArray(const std::vector<T>& values, Oid element_type) {
+  static_assert(sizeof(T) == 8);
+  if (values.empty()) {
+    return construct_empty_array(element_type);
+  }
+  size_t data_size = values.size() * sizeof(T);
+  size_t size = ARR_OVERHEAD_NONULLS(1) + data_size;
+  ArrayType* result =
+      static_cast<ArrayType*>(palloc0_or_throw_bad_alloc(size));
+  SET_VARSIZE(result, size);
+  result->ndim = 1;
+  result->dataoffset = 0;
+  result->elemtype = element_type;
+  *ARR_DIMS(result) = static_cast<int>(values.size());
+  *ARR_LBOUND(result) = 1;
+  memcpy(ARR_DATA_PTR(result), values.data(), data_size);
+  return result;
+}
+
+// Runs a query on each of `num_protos` bytea datums, calling
+// `emit(i, row)` with the first result on the i'th protobuf, or with
+// nullptr if it's null or has no results. `emit` must copy the result out.
+// The compiled query and its buffers are reused for every protobuf.
+template <typename F>
+void RunQueryBatch(querying::Query& query, int num_protos, const Datum* protos,
+                   const bool* proto_nulls, F emit) {
+  for (int i = 0; i < num_protos; ++i) {
+    if (proto_nulls != nullptr && proto_nulls[i]) {
+      emit(i, nullptr);
+      continue;
+    }
+    struct varlena* attr =
+        reinterpret_cast<struct varlena*>(DatumGetPointer(protos[i]));
+    // Fetching a toasted protobuf may raise Postgres errors.
+    struct varlena* proto_bytea;
+    CatchPostgresErrors([&]() { proto_bytea = pg_detoast_datum_packed(attr); });
+    const auto& rows = query.Run(
+        reinterpret_cast<const uint8*>(VARDATA_ANY(proto_bytea)),
+        VARSIZE_ANY_EXHDR(proto_bytea));
+    emit(i, rows.empty() ? nullptr : &rows[0]);
+    // Keeps memory use flat over a large batch of toasted protobufs.
+    if (proto_bytea != attr) {
+      pfree(proto_bytea);
+    }
+  }
+}
+
+Oid ResultTypeOid(querying::ResultType result_type) {
+  switch (result_type) {
+    case querying::ResultType::Text:
+      return TEXTOID;
+    case querying::ResultType::Int8:
+      return INT8OID;
+    case querying::ResultType::Float8:
+      return FLOAT8OID;
+    case querying::ResultType::Bool:
+      return BOOLOID;
+    case querying::ResultType::Bytea:
+      return BYTEAOID;
+    case querying::ResultType::Numeric:
+      return NUMERICOID;
+  }
+  return InvalidOid;
+}
+
+Datum TypedValueToDatum(const querying::TypedValue& value,
+                        querying::ResultType result_type) {
+  using Kind = querying::TypedValue::Kind;
+  switch (result_type) {
+    case querying::ResultType::Int8:
+      return Int64GetDatum(value.as_int64);
+    case querying::ResultType::Float8:
+      return Float8GetDatum(value.as_double);
+    case querying::ResultType::Bool:
+      return BoolGetDatum(value.as_bool);
+    case querying::ResultType::Bytea:
+      return PointerGetDatum(VarlenaFromView(value.as_bytes));
+    case querying::ResultType::Numeric:
+      if (value.kind == Kind::Int64) {
+        return DirectFunctionCall1(int8_numeric, Int64GetDatum(value.as_int64));
+      } else if (value.kind == Kind::UInt64) {
+        // Numeric has no constructor for this, so go through text.
+        char buf[32];
+        snprintf(buf, sizeof(buf), "%" PRIu64, value.as_uint64);
+        return DirectFunctionCall3(numeric_in, CStringGetDatum(buf),
+                                   ObjectIdGetDatum(InvalidOid),
+                                   Int32GetDatum(-1));
+      } else {
+        return DirectFunctionCall1(float8_numeric,
+                                   Float8GetDatum(value.as_double));
+      }
+    case querying::ResultType::Text:
+      break;
+  }
+  assert(false);  // Text results aren't TypedValues
+  return (Datum)0;
+}
+
+// Implements `protobuf_query`, `protobuf_query_by_number` and `protobuf_get`.
+Datum TextQuery(FunctionCallInfo fcinfo, querying::Schema schema,
+                QueryArgs query_args = QueryArgs::QueryFirst) {
+  using namespace querying;
+
+  assert(PG_NARGS() == 2);
+
+  return ReportExceptions([&]() -> Datum {
+    querying::Query& query =
+        GetCallSiteQuery(fcinfo, 1, ResultType::Text, schema, query_args);
+    PGPROTO_DEBUG("Query parsed");
+
+    const std::vector<std::string_view>* result = nullptr;
+    RunOnProtobufPrefixes(fcinfo, query_args == QueryArgs::QueryFirst ? 1 : 0,
+                          query,
+                          [&](const uint8* proto_data, size_t proto_len) {
+                            result = &query.Run(proto_data, proto_len);
+                          });
+    const auto& rows = *result;
+    PGPROTO_DEBUG("Query ran. Results: %lu", rows.size());
+    if (!rows.empty()) {
+      PG_RETURN_TEXT_P(VarlenaFromView(rows[0]));
+    } else {
+      PG_RETURN_NULL();
+    }
+  });
+}
+
+// Implements `protobuf_query_array`, `protobuf_query_by_number_array` and
+// `protobuf_get_array`.
+Datum TextQueryArray(FunctionCallInfo fcinfo, querying::Schema schema,
+                     QueryArgs query_args = QueryArgs::QueryFirst) {
+  using namespace querying;
+
+  assert(PG_NARGS() == 2);
+
+  return ReportExceptions([&]() -> Datum {
+    querying::Query& query = GetCallSiteQuery(
+        fcinfo, std::nullopt, ResultType::Text, schema, query_args);
+    PGPROTO_DEBUG("Query parsed");
+
+    bytea* proto_bytea =
+        PG_GETARG_BYTEA_P(query_args == QueryArgs::QueryFirst ? 1 : 0);
+    const uint8* proto_data =
+        reinterpret_cast<const uint8*>(VARDATA_ANY(proto_bytea));
+    size_t proto_len = VARSIZE_ANY_EXHDR(proto_bytea);
+    const auto& rows = query.Run(proto_data, proto_len);
+    PGPROTO_DEBUG("Query ran. Results: %lu", rows.size());
+    PG_RETURN_ARRAYTYPE_P(TextArrayFromRows(rows));
+  });
+}
+
+// Implements `protobuf_query_<type>`.
+Datum TypedQuery(FunctionCallInfo fcinfo, querying::ResultType result_type,
+                 querying::Schema schema = querying::Schema::DescriptorSet) {
+  using namespace querying;
+
+  assert(PG_NARGS() == 2);
+
+  return ReportExceptions([&]() -> Datum {
+    querying::Query& query =
+        GetCallSiteQuery(fcinfo, 1, result_type, schema);
+    PGPROTO_DEBUG("Query parsed");
+
+    const std::vector<TypedValue>* result = nullptr;
+    RunOnProtobufPrefixes(
+        fcinfo, 1, query, [&](const uint8* proto_data, size_t proto_len) {
+          result = &query.RunTyped(proto_data, proto_len);
+        });
+    const auto& values = *result;
+    PGPROTO_DEBUG("Query ran. Results: %lu", values.size());
+    if (!values.empty()) {
+      return TypedValueToDatum(values[0], result_type);
+    } else {
+      PG_RETURN_NULL();
+    }
+  });
+}
+
+// Implements `protobuf_query_<type>_array`.
+Datum TypedQueryArray(
+    FunctionCallInfo fcinfo, querying::ResultType result_type,
+    querying::Schema schema = querying::Schema::DescriptorSet) {
+  using namespace querying;
+
+  assert(PG_NARGS() == 2);
+
+  return ReportExceptions([&]() -> Datum {
+    querying::Query& query =
+        GetCallSiteQuery(fcinfo, std::nullopt, result_type, schema);
+    PGPROTO_DEBUG("Query parsed");
+
+    bytea* proto_bytea = PG_GETARG_BYTEA_P(1);
+    const uint8* proto_data =
+        reinterpret_cast<const uint8*>(VARDATA_ANY(proto_bytea));
+    size_t proto_len = VARSIZE_ANY_EXHDR(proto_bytea);
+    if (result_type == ResultType::Int8) {
+      PG_RETURN_ARRAYTYPE_P(
+          NumberArray(query.RunInt8(proto_data, proto_len), INT8OID));
+    } else if (result_type == ResultType::Float8) {
+      PG_RETURN_ARRAYTYPE_P(
+          NumberArray(query.RunFloat8(proto_data, proto_len), FLOAT8OID));
+    }
+    const auto& values = query.RunTyped(proto_data, proto_len);
+    PGPROTO_DEBUG("Query ran. Results: %lu", values.size());
+    Datum* elements = static_cast<Datum*>(
+        palloc0_or_throw_bad_alloc(sizeof(Datum) * values.size()));
+    for (size_t i = 0; i < values.size(); ++i) {
+      elements[i] = TypedValueToDatum(values[i], result_type);
+    }
+    Oid element_type = ResultTypeOid(result_type);
+    int16 typlen;
+    bool typbyval;
+    char typalign;
+    get_typlenbyvalalign(element_type, &typlen, &typbyval, &typalign);
+    ArrayType* result = construct_array(elements, values.size(), element_type,
+                                        typlen, typbyval, typalign);
+    PG_RETURN_ARRAYTYPE_P(result);
+  });
+}
+
+// Implements `protobuf_match`, `protobuf_match_by_number` and `@@`.
+Datum MatchQuery(FunctionCallInfo fcinfo, querying::Schema schema,
+                 QueryArgs query_args = QueryArgs::QueryFirst) {
+  using namespace querying;
+
+  return ReportExceptions([&]() -> Datum {
+    querying::Match& match = GetCallSiteMatch(fcinfo, schema, query_args);
+    PGPROTO_DEBUG("Query parsed");
+
+    bool matched = false;
+    RunOnProtobufPrefixes(
+        fcinfo, query_args == QueryArgs::QueryFirst ? 3 : 0, match,
+        [&](const uint8* proto_data, size_t proto_len) {
+          matched = match.Run(proto_data, proto_len);
+        });
+    PG_RETURN_BOOL(matched);
+  });
+}
+
+// Looks up a message type given as `[<descriptor_set>:]<message_name>`.
+// The caller must hold on to `desc_db_out` while using the results.
+const pb::Descriptor* GetDescriptorOrThrow(
+    const pstring& desc_spec,
+    std::shared_ptr<descriptor_db::DescDb>* desc_db_out,
+    const descriptor_db::DescSet** desc_set_out) {
+  *desc_db_out = descriptor_db::DescDb::GetOrCreateCached();
 
   std::string::size_type i = desc_spec.find(':');
 
@@ -70,20 +913,58 @@ void GetProtobufInfoOrThrow(const pstring& desc_spec,
     desc_name_start = 0;
   }
 
-  auto di = desc_db.desc_sets.find(desc_set_name);
-  if (di == desc_db.desc_sets.end()) {
-    throw ProtobufNotFound();
+  const descriptor_db::DescSet* desc_set =
+      (*desc_db_out)->GetDescSet(desc_set_name);
+  if (desc_set == nullptr) {
+    throw ProtobufNotFound(std::string(desc_spec.data(), desc_spec.size()));
   }
 
   std::string desc_name(desc_spec.substr(desc_name_start));
 
-  if (!di->second->pool->FindMessageTypeByName(desc_name)) {
-    throw ProtobufNotFound();
+  const pb::Descriptor* desc = desc_set->pool->FindMessageTypeByName(desc_name);
+  if (desc == nullptr) {
+    throw ProtobufNotFound(std::string(desc_spec.data(), desc_spec.size()));
   }
 
-  *desc_name_append_out += desc_name;
-  *type_resolver_out = di->second->type_resolver.get();
+  *desc_set_out = desc_set;
+  return desc;
 }
+
+// Converts index keys to the array GIN expects.
+Datum* GinKeys(const std::vector<int32_t>& keys, int32* nkeys) {
+  Datum* result = static_cast<Datum*>(palloc0_or_throw_bad_alloc(
+      sizeof(Datum) * std::max<size_t>(keys.size(), 1)));
+  for (size_t i = 0; i < keys.size(); ++i) {
+    result[i] = Int32GetDatum(keys[i]);
+  }
+  *nkeys = static_cast<int32>(keys.size());
+  return result;
+}
+
+// Implements `PostgresProtobufApi::query_batch`.
+void ApiQueryBatch(const char* query_str, int num_protos, const Datum* protos,
+                   const bool* proto_nulls, Datum* results,
+                   bool* result_nulls) {
+  using namespace querying;
+
+  ReportExceptions([&] {
+    querying::Query query(query_str, 1);
+    RunQueryBatch(query, num_protos, protos, proto_nulls,
+                  [&](int i, const std::string_view* row) {
+                    result_nulls[i] = row == nullptr;
+                    results[i] = row == nullptr
+                                     ? static_cast<Datum>(0)
+                                     : PointerGetDatum(VarlenaFromView(*row));
+                  });
+  });
+}
+
+// Published to other extensions by `_PG_init`. See `postgres_protobuf.h`.
+const PostgresProtobufApi api = {
+    POSTGRES_PROTOBUF_API_VERSION,
+    &ApiQueryBatch,
+};
+
 }  // namespace
 
 extern "C" {
@@ -92,116 +973,345 @@ PG_FUNCTION_INFO_V1(protobuf_extension_version);
 PG_FUNCTION_INFO_V1(protobuf_query);
 PG_FUNCTION_INFO_V1(protobuf_query_multi);
 PG_FUNCTION_INFO_V1(protobuf_query_array);
+PG_FUNCTION_INFO_V1(protobuf_query_paths);
+PG_FUNCTION_INFO_V1(protobuf_query_batch);
+PG_FUNCTION_INFO_V1(protobuf_query_int8);
+PG_FUNCTION_INFO_V1(protobuf_query_int8_array);
+PG_FUNCTION_INFO_V1(protobuf_query_float8);
+PG_FUNCTION_INFO_V1(protobuf_query_float8_array);
+PG_FUNCTION_INFO_V1(protobuf_query_bool);
+PG_FUNCTION_INFO_V1(protobuf_query_bool_array);
+PG_FUNCTION_INFO_V1(protobuf_query_bytea);
+PG_FUNCTION_INFO_V1(protobuf_query_bytea_array);
+PG_FUNCTION_INFO_V1(protobuf_query_numeric);
+PG_FUNCTION_INFO_V1(protobuf_query_numeric_array);
+PG_FUNCTION_INFO_V1(protobuf_query_by_number);
+PG_FUNCTION_INFO_V1(protobuf_query_by_number_array);
+PG_FUNCTION_INFO_V1(protobuf_query_by_number_int8);
+PG_FUNCTION_INFO_V1(protobuf_query_by_number_float8);
+PG_FUNCTION_INFO_V1(protobuf_query_by_number_bool);
+PG_FUNCTION_INFO_V1(protobuf_query_by_number_bytea);
+PG_FUNCTION_INFO_V1(protobuf_match);
+PG_FUNCTION_INFO_V1(protobuf_match_by_number);
+PG_FUNCTION_INFO_V1(protobuf_typmod_in);
+PG_FUNCTION_INFO_V1(protobuf_typmod_out);
+PG_FUNCTION_INFO_V1(protobuf_get);
+PG_FUNCTION_INFO_V1(protobuf_get_array);
+PG_FUNCTION_INFO_V1(protobuf_get_match);
+PG_FUNCTION_INFO_V1(protobuf_contains);
+PG_FUNCTION_INFO_V1(protobuf_gin_extract_value);
+PG_FUNCTION_INFO_V1(protobuf_gin_extract_query);
+PG_FUNCTION_INFO_V1(protobuf_gin_consistent);
 PG_FUNCTION_INFO_V1(protobuf_to_json_text);
 PG_FUNCTION_INFO_V1(protobuf_from_json_text);
+PG_FUNCTION_INFO_V1(protobuf_to_jsonb);
+PG_FUNCTION_INFO_V1(protobuf_from_jsonb);
+PG_FUNCTION_INFO_V1(protobuf_file_descriptor_sets_changed);
+PG_FUNCTION_INFO_V1(protobuf_agg_transfn);
+PG_FUNCTION_INFO_V1(protobuf_agg_finalfn);
+PG_FUNCTION_INFO_V1(protobuf_agg_combinefn);
+PG_FUNCTION_INFO_V1(protobuf_agg_serialfn);
+PG_FUNCTION_INFO_V1(protobuf_agg_deserialfn);
 
 Datum protobuf_extension_version(PG_FUNCTION_ARGS) {
   PG_RETURN_INT64(version::numericVersion);
 }
 
 Datum protobuf_query(PG_FUNCTION_ARGS) {
+  return TextQuery(fcinfo, querying::Schema::DescriptorSet);
+}
+
+Datum protobuf_query_array(PG_FUNCTION_ARGS) {
+  return TextQueryArray(fcinfo, querying::Schema::DescriptorSet);
+}
+
+Datum protobuf_query_paths(PG_FUNCTION_ARGS) {
   using namespace querying;
 
   assert(PG_NARGS() == 2);
 
-  try {
-    text* query_text = PG_GETARG_TEXT_P(0);
-    std::string query_str(VARDATA_ANY(query_text),
-                          VARSIZE_ANY_EXHDR(query_text));
-    querying::Query query(query_str, 1);
-    PGPROTO_DEBUG("Query parsed");
+  return ReportExceptions([&]() -> Datum {
+    querying::QuerySet& query_set = GetCallSiteQuerySet(fcinfo, 1);
+    PGPROTO_DEBUG("Queries parsed");
 
     bytea* proto_bytea = PG_GETARG_BYTEA_P(1);
     const uint8* proto_data =
         reinterpret_cast<const uint8*>(VARDATA_ANY(proto_bytea));
     size_t proto_len = VARSIZE_ANY_EXHDR(proto_bytea);
-    const auto rows = query.Run(proto_data, proto_len);
-    PGPROTO_DEBUG("Query ran. Results: %lu", rows.size());
-    if (!rows.empty()) {
-      const std::string& row = rows[0];
-      size_t size = VARHDRSZ + row.size();
-      bytea* p = static_cast<bytea*>(palloc0_or_throw_bad_alloc(size));
-      SET_VARSIZE(p, size);
-      memcpy(VARDATA(p), row.data(), row.size());
-      PG_RETURN_TEXT_P(p);
-    } else {
-      PG_RETURN_NULL();
+    query_set.Run(proto_data, proto_len);
+    PGPROTO_DEBUG("Queries ran");
+    int num_queries = static_cast<int>(query_set.size());
+
+    Datum* elements = static_cast<Datum*>(
+        palloc0_or_throw_bad_alloc(sizeof(Datum) * num_queries));
+    bool* nulls = static_cast<bool*>(
+        palloc0_or_throw_bad_alloc(sizeof(bool) * num_queries));
+    for (int i = 0; i < num_queries; ++i) {
+      const auto& rows = query_set.Results(i);
+      if (rows.empty()) {
+        nulls[i] = true;
+        continue;
+      }
+      elements[i] = PointerGetDatum(VarlenaFromView(rows[0]));
     }
-  } catch (const std::bad_alloc& e) {
-    ereport(ERROR, (errcode(ERRCODE_OUT_OF_MEMORY), errmsg("out of memory")));
-  } catch (const BadProto& e) {
-    // TODO: is this a good error code?
-    ereport(ERROR, (errcode(ERRCODE_INVALID_BINARY_REPRESENTATION),
-                    errmsg("invalid protobuf: %s", e.msg.c_str())));
-  } catch (const BadQuery& e) {
-    // TODO: is this a good error code?
+    int16 typlen;
+    bool typbyval;
+    char typalign;
+    get_typlenbyvalalign(TEXTOID, &typlen, &typbyval, &typalign);
+    int dims[1] = {num_queries};
+    int lbs[1] = {1};
+    ArrayType* result =
+        num_queries == 0
+            ? construct_empty_array(TEXTOID)
+            : construct_md_array(elements, nulls, 1, dims, lbs, TEXTOID,
+                                 typlen, typbyval, typalign);
+    PG_RETURN_ARRAYTYPE_P(result);
+  });
+}
+
+Datum protobuf_query_batch(PG_FUNCTION_ARGS) {
+  using namespace querying;
+
+  assert(PG_NARGS() == 2);
+
+  return ReportExceptions([&]() -> Datum {
+    querying::Query& query = GetCallSiteQuery(fcinfo, 1);
+    PGPROTO_DEBUG("Query parsed");
+
+    ArrayType* proto_array = PG_GETARG_ARRAYTYPE_P(1);
+    Datum* protos;
+    bool* proto_nulls;
+    int num_protos;
+    deconstruct_array(proto_array, BYTEAOID, -1, false, 'i', &protos,
+                      &proto_nulls, &num_protos);
+
+    // The results are gathered into one buffer, and then copied from there
+    // straight into the array.
+    std::string data;
+    std::vector<size_t> ends(num_protos);
+    std::vector<bool> nulls(num_protos);
+    RunQueryBatch(query, num_protos, protos, proto_nulls,
+                  [&](int i, const std::string_view* row) {
+                    if (row == nullptr) {
+                      nulls[i] = true;
+                    } else {
+                      data.append(*row);
+                    }
+                    ends[i] = data.size();
+                  });
+    PGPROTO_DEBUG("Query ran on %d protobufs", num_protos);
+
+    std::vector<std::string_view> rows(num_protos);
+    size_t start = 0;
+    for (int i = 0; i < num_protos; ++i) {
+      rows[i] = std::string_view(data).substr(start, ends[i] - start);
+      start = ends[i];
+    }
+    PG_RETURN_ARRAYTYPE_P(TextArrayFromRows(rows, &nulls, ARR_NDIM(proto_array),
+                                            ARR_DIMS(proto_array),
+                                            ARR_LBOUND(proto_array)));
+  });
+}
+
+Datum protobuf_query_int8(PG_FUNCTION_ARGS) {
+  return TypedQuery(fcinfo, querying::ResultType::Int8);
+}
+
+Datum protobuf_query_int8_array(PG_FUNCTION_ARGS) {
+  return TypedQueryArray(fcinfo, querying::ResultType::Int8);
+}
+
+Datum protobuf_query_float8(PG_FUNCTION_ARGS) {
+  return TypedQuery(fcinfo, querying::ResultType::Float8);
+}
+
+Datum protobuf_query_float8_array(PG_FUNCTION_ARGS) {
+  return TypedQueryArray(fcinfo, querying::ResultType::Float8);
+}
+
+Datum protobuf_query_bool(PG_FUNCTION_ARGS) {
+  return TypedQuery(fcinfo, querying::ResultType::Bool);
+}
+
+Datum protobuf_query_bool_array(PG_FUNCTION_ARGS) {
+  return TypedQueryArray(fcinfo, querying::ResultType::Bool);
+}
+
+Datum protobuf_query_bytea(PG_FUNCTION_ARGS) {
+  return TypedQuery(fcinfo, querying::ResultType::Bytea);
+}
+
+Datum protobuf_query_bytea_array(PG_FUNCTION_ARGS) {
+  return TypedQueryArray(fcinfo, querying::ResultType::Bytea);
+}
+
+Datum protobuf_query_numeric(PG_FUNCTION_ARGS) {
+  return TypedQuery(fcinfo, querying::ResultType::Numeric);
+}
+
+Datum protobuf_query_numeric_array(PG_FUNCTION_ARGS) {
+  return TypedQueryArray(fcinfo, querying::ResultType::Numeric);
+}
+
+Datum protobuf_query_by_number(PG_FUNCTION_ARGS) {
+  return TextQuery(fcinfo, querying::Schema::None);
+}
+
+Datum protobuf_query_by_number_array(PG_FUNCTION_ARGS) {
+  return TextQueryArray(fcinfo, querying::Schema::None);
+}
+
+Datum protobuf_query_by_number_int8(PG_FUNCTION_ARGS) {
+  return TypedQuery(fcinfo, querying::ResultType::Int8,
+                    querying::Schema::None);
+}
+
+Datum protobuf_query_by_number_float8(PG_FUNCTION_ARGS) {
+  return TypedQuery(fcinfo, querying::ResultType::Float8,
+                    querying::Schema::None);
+}
+
+Datum protobuf_query_by_number_bool(PG_FUNCTION_ARGS) {
+  return TypedQuery(fcinfo, querying::ResultType::Bool,
+                    querying::Schema::None);
+}
+
+Datum protobuf_query_by_number_bytea(PG_FUNCTION_ARGS) {
+  return TypedQuery(fcinfo, querying::ResultType::Bytea,
+                    querying::Schema::None);
+}
+
+Datum protobuf_match(PG_FUNCTION_ARGS) {
+  return MatchQuery(fcinfo, querying::Schema::DescriptorSet);
+}
+
+Datum protobuf_match_by_number(PG_FUNCTION_ARGS) {
+  return MatchQuery(fcinfo, querying::Schema::None);
+}
+
+// Takes `'<message_type>'` or `'<descriptor_set>:<message_type>'`.
+// The message type isn't checked against the descriptor set, which may not
+// have been inserted yet, e.g. while a dump is restored.
+Datum protobuf_typmod_in(PG_FUNCTION_ARGS) {
+  ArrayType* modifiers = PG_GETARG_ARRAYTYPE_P(0);
+  Datum* elements;
+  int num_elements;
+  deconstruct_array(modifiers, CSTRINGOID, -2, false, 'c', &elements, nullptr,
+                    &num_elements);
+  if (num_elements != 1) {
     ereport(ERROR, (errcode(ERRCODE_INVALID_PARAMETER_VALUE),
-                    errmsg("invalid query: %s", e.msg.c_str())));
-  } catch (const RecursionDepthExceeded& e) {
-    // TODO: is this a good error code?
-    // TODO: make the limit configurable
-    ereport(ERROR, (errcode(ERRCODE_PROGRAM_LIMIT_EXCEEDED),
-                    errmsg("protobuf recursion depth exceeded")));
-  } catch (...) {
-    ereport(ERROR,
-            (errcode(ERRCODE_INTERNAL_ERROR),
-             errmsg("unknown C++ exception in postgres_protobuf extension")));
+                    errmsg("type protobuf takes one type modifier, the "
+                           "message type")));
+  }
+
+  char* desc_set_name = pstrdup(DatumGetCString(elements[0]));
+  char* message_name = strchr(desc_set_name, ':');
+  if (message_name != nullptr) {
+    *message_name++ = '\0';
+  } else {
+    message_name = desc_set_name;
+    desc_set_name = pstrdup("default");
+  }
+  // The names are output between single quotes by `protobuf_typmod_out`.
+  if (*desc_set_name == '\0' || *message_name == '\0' ||
+      strpbrk(desc_set_name, "'\\") != nullptr ||
+      strpbrk(message_name, ":'\\") != nullptr) {
+    ereport(ERROR, (errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+                    errmsg("invalid protobuf message type: %s",
+                           DatumGetCString(elements[0]))));
   }
+
+  PG_RETURN_INT32(MessageTypeTypmod(desc_set_name, message_name));
 }
 
-Datum protobuf_query_array(PG_FUNCTION_ARGS) {
+Datum protobuf_typmod_out(PG_FUNCTION_ARGS) {
+  int32 typmod = PG_GETARG_INT32(0);
+  if (typmod < 0) {
+    PG_RETURN_CSTRING(pstrdup(""));
+  }
+  char* desc_set_name;
+  char* message_name;
+  LookUpMessageType(typmod, &desc_set_name, &message_name);
+  if (strcmp(desc_set_name, "default") == 0) {
+    PG_RETURN_CSTRING(psprintf("('%s')", message_name));
+  } else {
+    PG_RETURN_CSTRING(psprintf("('%s:%s')", desc_set_name, message_name));
+  }
+}
+
+Datum protobuf_get(PG_FUNCTION_ARGS) {
+  return TextQuery(fcinfo, querying::Schema::DescriptorSet,
+                   QueryArgs::ProtobufFirst);
+}
+
+Datum protobuf_get_array(PG_FUNCTION_ARGS) {
+  return TextQueryArray(fcinfo, querying::Schema::DescriptorSet,
+                        QueryArgs::ProtobufFirst);
+}
+
+Datum protobuf_get_match(PG_FUNCTION_ARGS) {
+  return MatchQuery(fcinfo, querying::Schema::DescriptorSet,
+                    QueryArgs::ProtobufFirst);
+}
+
+Datum protobuf_contains(PG_FUNCTION_ARGS) {
   using namespace querying;
 
   assert(PG_NARGS() == 2);
 
-  try {
-    text* query_text = PG_GETARG_TEXT_P(0);
-    std::string query_str(VARDATA_ANY(query_text),
-                          VARSIZE_ANY_EXHDR(query_text));
-    querying::Query query(query_str, std::nullopt);
-    PGPROTO_DEBUG("Query parsed");
+  return ReportExceptions([&]() -> Datum {
+    text* query_text = PG_GETARG_TEXT_PP(1);
+    indexing::ContainsQuery query(std::string(
+        VARDATA_ANY(query_text), VARSIZE_ANY_EXHDR(query_text)));
 
-    bytea* proto_bytea = PG_GETARG_BYTEA_P(1);
+    bytea* proto_bytea = PG_GETARG_BYTEA_P(0);
     const uint8* proto_data =
         reinterpret_cast<const uint8*>(VARDATA_ANY(proto_bytea));
     size_t proto_len = VARSIZE_ANY_EXHDR(proto_bytea);
-    const auto rows = query.Run(proto_data, proto_len);
-    PGPROTO_DEBUG("Query ran. Results: %lu", rows.size());
-    Datum* elements = static_cast<Datum*>(palloc0_or_throw_bad_alloc(sizeof(Datum) * rows.size()));
-    for (size_t i = 0; i < rows.size(); ++i) {
-      const std::string& row = rows[i];
-      size_t size = VARHDRSZ + row.size();
-      bytea* p = static_cast<bytea*>(palloc0_or_throw_bad_alloc(size));
-      SET_VARSIZE(p, size);
-      memcpy(VARDATA(p), row.data(), row.size());
-      elements[i] = reinterpret_cast<Datum>(p);
+    PG_RETURN_BOOL(query.Matches(proto_data, proto_len));
+  });
+}
+
+Datum protobuf_gin_extract_value(PG_FUNCTION_ARGS) {
+  using namespace querying;
+
+  return ReportExceptions([&]() -> Datum {
+    bytea* proto_bytea = PG_GETARG_BYTEA_P(0);
+    int32* nkeys = reinterpret_cast<int32*>(PG_GETARG_POINTER(1));
+    const uint8* proto_data =
+        reinterpret_cast<const uint8*>(VARDATA_ANY(proto_bytea));
+    size_t proto_len = VARSIZE_ANY_EXHDR(proto_bytea);
+    PG_RETURN_POINTER(
+        GinKeys(indexing::ExtractKeys(proto_data, proto_len), nkeys));
+  });
+}
+
+Datum protobuf_gin_extract_query(PG_FUNCTION_ARGS) {
+  using namespace querying;
+
+  return ReportExceptions([&]() -> Datum {
+    text* query_text = PG_GETARG_TEXT_PP(0);
+    int32* nkeys = reinterpret_cast<int32*>(PG_GETARG_POINTER(1));
+    indexing::ContainsQuery query(std::string(
+        VARDATA_ANY(query_text), VARSIZE_ANY_EXHDR(query_text)));
+    PG_RETURN_POINTER(GinKeys(query.Keys(), nkeys));
+  });
+}
+
+Datum protobuf_gin_consistent(PG_FUNCTION_ARGS) {
+  bool* check = reinterpret_cast<bool*>(PG_GETARG_POINTER(0));
+  int32 nkeys = PG_GETARG_INT32(3);
+  bool* recheck = reinterpret_cast<bool*>(PG_GETARG_POINTER(5));
+
+  // The keys are alternatives: the value itself, or possibly a packed field
+  // containing it. Keys are hashes, so a match must always be rechecked.
+  *recheck = true;
+  for (int32 i = 0; i < nkeys; ++i) {
+    if (check[i]) {
+      PG_RETURN_BOOL(true);
     }
-    int16 typlen;
-    bool typbyval;
-    char typalign;
-    get_typlenbyvalalign(TEXTOID, &typlen, &typbyval, &typalign);
-    ArrayType* result = construct_array(elements, rows.size(), TEXTOID, typlen, typbyval, typalign);
-    PG_RETURN_ARRAYTYPE_P(result);
-  } catch (const std::bad_alloc& e) {
-    ereport(ERROR, (errcode(ERRCODE_OUT_OF_MEMORY), errmsg("out of memory")));
-  } catch (const BadProto& e) {
-    // TODO: is this a good error code?
-    ereport(ERROR, (errcode(ERRCODE_INVALID_BINARY_REPRESENTATION),
-                    errmsg("invalid protobuf: %s", e.msg.c_str())));
-  } catch (const BadQuery& e) {
-    // TODO: is this a good error code?
-    ereport(ERROR, (errcode(ERRCODE_INVALID_PARAMETER_VALUE),
-                    errmsg("invalid query: %s", e.msg.c_str())));
-  } catch (const RecursionDepthExceeded& e) {
-    // TODO: is this a good error code?
-    // TODO: make the limit configurable
-    ereport(ERROR, (errcode(ERRCODE_PROGRAM_LIMIT_EXCEEDED),
-                    errmsg("protobuf recursion depth exceeded")));
-  } catch (...) {
-    ereport(ERROR,
-            (errcode(ERRCODE_INTERNAL_ERROR),
-             errmsg("unknown C++ exception in postgres_protobuf extension")));
   }
+  PG_RETURN_BOOL(false);
 }
 
 Datum protobuf_query_multi(PG_FUNCTION_ARGS) {
@@ -209,7 +1319,7 @@ Datum protobuf_query_multi(PG_FUNCTION_ARGS) {
 
   assert(PG_NARGS() == 2);
 
-  try {
+  return ReportExceptions([&]() -> Datum {
     FuncCallContext* funcctx;
     MultiQueryState* state;
 
@@ -220,23 +1330,21 @@ Datum protobuf_query_multi(PG_FUNCTION_ARGS) {
       text* query_text = PG_GETARG_TEXT_P(0);
       std::string query_str(VARDATA_ANY(query_text),
                             VARSIZE_ANY_EXHDR(query_text));
-      querying::Query query(query_str, std::nullopt);
+      state = pnew<MultiQueryState>(query_str);
       PGPROTO_DEBUG("Query parsed");
-
-      state = pnew<MultiQueryState>();
+      state->cleanup.func = &DestroyOnReset<MultiQueryState>;
+      state->cleanup.arg = state;
+      MemoryContextRegisterResetCallback(funcctx->multi_call_memory_ctx,
+                                         &state->cleanup);
       funcctx->user_fctx = state;
+
+      // Any detoasted copy goes in `multi_call_memory_ctx`, so that the
+      // results, which point into it, stay valid across calls.
       bytea* proto_bytea = PG_GETARG_BYTEA_P(1);
       const uint8* proto_data =
           reinterpret_cast<const uint8*>(VARDATA_ANY(proto_bytea));
       size_t proto_len = VARSIZE_ANY_EXHDR(proto_bytea);
-      for (const std::string& row : query.Run(proto_data, proto_len)) {
-        size_t size = VARHDRSZ + row.size();
-        bytea* p = static_cast<bytea*>(palloc0_or_throw_bad_alloc(size));
-        SET_VARSIZE(p, size);
-        memcpy(VARDATA(p), row.data(), row.size());
-        state->rows.push_back(p);
-      }
-      PGPROTO_DEBUG("Query ran. Results: %lu", state->rows.size());
+      state->stream.Start(proto_data, proto_len);
 
       MemoryContextSwitchTo(old_context);
     }
@@ -244,32 +1352,21 @@ Datum protobuf_query_multi(PG_FUNCTION_ARGS) {
     funcctx = SRF_PERCALL_SETUP();
     state = static_cast<MultiQueryState*>(funcctx->user_fctx);
 
+    // The protobuf is only scanned as far as needed for the next result,
+    // so e.g. a LIMIT stops the scan early.
+    if (state->index == state->rows.size()) {
+      state->rows = state->stream.Next();
+      state->index = 0;
+      PGPROTO_DEBUG("Query resumed. Results: %lu", state->rows.size());
+    }
+
     if (state->index < state->rows.size()) {
-      int i = state->index++;
-      SRF_RETURN_NEXT(funcctx, (Datum)state->rows[i]);
+      std::string_view row = state->rows[state->index++];
+      SRF_RETURN_NEXT(funcctx, PointerGetDatum(VarlenaFromView(row)));
     } else {
       SRF_RETURN_DONE(funcctx);
     }
-  } catch (const std::bad_alloc& e) {
-    ereport(ERROR, (errcode(ERRCODE_OUT_OF_MEMORY), errmsg("out of memory")));
-  } catch (const BadProto& e) {
-    // TODO: is this a good error code?
-    ereport(ERROR, (errcode(ERRCODE_INVALID_BINARY_REPRESENTATION),
-                    errmsg("invalid protobuf: %s", e.msg.c_str())));
-  } catch (const BadQuery& e) {
-    // TODO: is this a good error code?
-    ereport(ERROR, (errcode(ERRCODE_INVALID_PARAMETER_VALUE),
-                    errmsg("invalid query: %s", e.msg.c_str())));
-  } catch (const RecursionDepthExceeded& e) {
-    // TODO: is this a good error code?
-    // TODO: make the limit configurable
-    ereport(ERROR, (errcode(ERRCODE_PROGRAM_LIMIT_EXCEEDED),
-                    errmsg("protobuf recursion depth exceeded")));
-  } catch (...) {
-    ereport(ERROR,
-            (errcode(ERRCODE_INTERNAL_ERROR),
-             errmsg("unknown C++ exception in postgres_protobuf extension")));
-  }
+  });
 }
 
 Datum protobuf_to_json_text(PG_FUNCTION_ARGS) {
@@ -277,41 +1374,21 @@ Datum protobuf_to_json_text(PG_FUNCTION_ARGS) {
   pstring protobuf_type_str(VARDATA_ANY(protobuf_type_text),
                             VARSIZE_ANY_EXHDR(protobuf_type_text));
 
-  try {
+  return ReportExceptions([&]() -> Datum {
     bytea* proto_bytea = PG_GETARG_BYTEA_P(1);
-    const uint8* proto_data =
-        reinterpret_cast<const uint8*>(VARDATA_ANY(proto_bytea));
-    size_t proto_len = VARSIZE_ANY_EXHDR(proto_bytea);
-    std::string proto_str(reinterpret_cast<const char*>(proto_data), proto_len);
+    std::string_view proto_data(VARDATA_ANY(proto_bytea),
+                                VARSIZE_ANY_EXHDR(proto_bytea));
 
-    std::string type_url = "type.googleapis.com/";
-    pb::util::TypeResolver* type_resolver = nullptr;
-    GetProtobufInfoOrThrow(protobuf_type_str, &type_url, &type_resolver);
+    std::shared_ptr<descriptor_db::DescDb> desc_db;
+    const descriptor_db::DescSet* desc_set = nullptr;
+    const pb::Descriptor* desc =
+        GetDescriptorOrThrow(protobuf_type_str, &desc_db, &desc_set);
 
-    std::string json_str;
-    pb::util::Status status = pb::util::BinaryToJsonString(
-        type_resolver, type_url, proto_str, &json_str);
-    if (!status.ok()) {
-      throw BadProto(status.error_message());
-    }
+    std::string json_str = json_writer::ProtobufToJson(
+        desc_set->type_resolver.get(), desc, proto_data);
 
-    size_t result_size = VARHDRSZ + json_str.size();
-    bytea* result =
-        static_cast<bytea*>(palloc0_or_throw_bad_alloc(result_size));
-    SET_VARSIZE(result, result_size);
-    memcpy(VARDATA(result), json_str.data(), json_str.size());
-    PG_RETURN_TEXT_P(result);
-  } catch (const std::bad_alloc& e) {
-    ereport(ERROR, (errcode(ERRCODE_OUT_OF_MEMORY), errmsg("out of memory")));
-  } catch (const ProtobufNotFound& e) {
-    ereport(ERROR, (errcode(ERRCODE_INTERNAL_ERROR),
-                    errmsg("invalid query: protobuf type %s not found",
-                           protobuf_type_str.c_str())));
-  } catch (...) {
-    ereport(ERROR,
-            (errcode(ERRCODE_INTERNAL_ERROR),
-             errmsg("unknown C++ exception in postgres_protobuf extension")));
-  }
+    PG_RETURN_TEXT_P(VarlenaFromView(json_str));
+  });
 }
 
 Datum protobuf_from_json_text(PG_FUNCTION_ARGS) {
@@ -319,42 +1396,234 @@ Datum protobuf_from_json_text(PG_FUNCTION_ARGS) {
   pstring protobuf_type_str(VARDATA_ANY(protobuf_type_text),
                             VARSIZE_ANY_EXHDR(protobuf_type_text));
 
-  try {
+  return ReportExceptions([&]() -> Datum {
     text* json_text = PG_GETARG_TEXT_P(1);
-    std::string json_str(VARDATA_ANY(json_text), VARSIZE_ANY_EXHDR(json_text));
+    const char* json_data = VARDATA_ANY(json_text);
+    int json_len = VARSIZE_ANY_EXHDR(json_text);
+    const char* json_utf8 = pg_server_to_any(json_data, json_len, PG_UTF8);
+    if (json_utf8 != json_data) {
+      json_len = strlen(json_utf8);
+    }
 
-    std::string type_url = "type.googleapis.com/";
-    pb::util::TypeResolver* type_resolver = nullptr;
-    GetProtobufInfoOrThrow(protobuf_type_str, &type_url, &type_resolver);
+    std::shared_ptr<descriptor_db::DescDb> desc_db;
+    const descriptor_db::DescSet* desc_set = nullptr;
+    const pb::Descriptor* desc =
+        GetDescriptorOrThrow(protobuf_type_str, &desc_db, &desc_set);
 
-    std::string proto_str;
-    pb::util::Status status = pb::util::JsonToBinaryString(
-        type_resolver, type_url, json_str, &proto_str);
-    if (!status.ok()) {
-      throw BadProto(status.error_message());
-    }
+    std::string proto_str = json_reader::JsonToProtobuf(
+        *desc_set, desc, std::string_view(json_utf8, json_len));
 
-    size_t result_size = VARHDRSZ + proto_str.size();
-    bytea* result =
-        static_cast<bytea*>(palloc0_or_throw_bad_alloc(result_size));
-    SET_VARSIZE(result, result_size);
-    memcpy(VARDATA(result), proto_str.data(), proto_str.size());
-    PG_RETURN_BYTEA_P(result);
-  } catch (const std::bad_alloc& e) {
-    ereport(ERROR, (errcode(ERRCODE_OUT_OF_MEMORY), errmsg("out of memory")));
-  } catch (const ProtobufNotFound& e) {
-    ereport(ERROR, (errcode(ERRCODE_INTERNAL_ERROR),
-                    errmsg("invalid query: protobuf type %s not found",
-                           protobuf_type_str.c_str())));
-  } catch (...) {
+    PG_RETURN_BYTEA_P(VarlenaFromView(proto_str));
+  }, Input::Json);
+}
+
+Datum protobuf_to_jsonb(PG_FUNCTION_ARGS) {
+  text* protobuf_type_text = PG_GETARG_TEXT_P(0);
+  pstring protobuf_type_str(VARDATA_ANY(protobuf_type_text),
+                            VARSIZE_ANY_EXHDR(protobuf_type_text));
+
+  return ReportExceptions([&]() -> Datum {
+    bytea* proto_bytea = PG_GETARG_BYTEA_P(1);
+    const uint8* proto_data =
+        reinterpret_cast<const uint8*>(VARDATA_ANY(proto_bytea));
+    size_t proto_len = VARSIZE_ANY_EXHDR(proto_bytea);
+
+    std::shared_ptr<descriptor_db::DescDb> desc_db;
+    const descriptor_db::DescSet* desc_set = nullptr;
+    const pb::Descriptor* desc =
+        GetDescriptorOrThrow(protobuf_type_str, &desc_db, &desc_set);
+
+    PG_RETURN_POINTER(jsonb_conversion::ProtobufToJsonb(
+        *desc_set, desc, proto_data, proto_len));
+  });
+}
+
+Datum protobuf_from_jsonb(PG_FUNCTION_ARGS) {
+  text* protobuf_type_text = PG_GETARG_TEXT_P(0);
+  pstring protobuf_type_str(VARDATA_ANY(protobuf_type_text),
+                            VARSIZE_ANY_EXHDR(protobuf_type_text));
+
+  return ReportExceptions([&]() -> Datum {
+    struct varlena* jsonb = PG_DETOAST_DATUM(PG_GETARG_DATUM(1));
+
+    std::shared_ptr<descriptor_db::DescDb> desc_db;
+    const descriptor_db::DescSet* desc_set = nullptr;
+    const pb::Descriptor* desc =
+        GetDescriptorOrThrow(protobuf_type_str, &desc_db, &desc_set);
+
+    std::string proto_str =
+        jsonb_conversion::JsonbToProtobuf(*desc_set, desc, jsonb);
+
+    PG_RETURN_BYTEA_P(VarlenaFromView(proto_str));
+  }, Input::Json);
+}
+
+// Statement trigger on `protobuf_file_descriptor_sets`.
+// The relcache invalidation makes every backend drop its cached descriptors
+// once the change is committed.
+Datum protobuf_file_descriptor_sets_changed(PG_FUNCTION_ARGS) {
+  if (!CALLED_AS_TRIGGER(fcinfo)) {
     ereport(ERROR,
-            (errcode(ERRCODE_INTERNAL_ERROR),
-             errmsg("unknown C++ exception in postgres_protobuf extension")));
+            (errcode(ERRCODE_TRIGGERED_ACTION_EXCEPTION),
+             errmsg("protobuf_file_descriptor_sets_changed: not called by "
+                    "trigger manager")));
+  }
+  TriggerData* trigdata = reinterpret_cast<TriggerData*>(fcinfo->context);
+  CacheInvalidateRelcache(trigdata->tg_relation);
+  shared_cache::ClearAtCommit();
+  return PointerGetDatum(nullptr);
+}
+
+// `protobuf_agg` appends each protobuf to its state as an entry of the given
+// repeated field, so the result is the concatenation of those entries.
+// The state is a StringInfo in the aggregate's memory context.
+
+Datum protobuf_agg_transfn(PG_FUNCTION_ARGS) {
+  MemoryContext agg_context;
+  if (!AggCheckCallContext(fcinfo, &agg_context)) {
+    ereport(ERROR, (errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+                    errmsg("protobuf_agg_transfn called in non-aggregate "
+                           "context")));
+  }
+  StringInfo state = PG_ARGISNULL(0) ? nullptr
+                                      : reinterpret_cast<StringInfo>(
+                                            PG_GETARG_POINTER(0));
+
+  if (!PG_ARGISNULL(1)) {
+    if (PG_ARGISNULL(2)) {
+      ereport(ERROR, (errcode(ERRCODE_NULL_VALUE_NOT_ALLOWED),
+                      errmsg("protobuf_agg field number must not be null")));
+    }
+    int32 field_number = PG_GETARG_INT32(2);
+    if (field_number < 1 || field_number > pb::FieldDescriptor::kMaxNumber) {
+      ereport(ERROR, (errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+                      errmsg("invalid protobuf field number: %d",
+                             field_number)));
+    }
+    bytea* item = PG_GETARG_BYTEA_PP(1);
+
+    if (state == nullptr) {
+      MemoryContext old_context = MemoryContextSwitchTo(agg_context);
+      state = makeStringInfo();
+      MemoryContextSwitchTo(old_context);
+    }
+    // The tag for a length-delimited field, then the length
+    char header[10];
+    size_t header_len = 0;
+    for (uint64 x : {(static_cast<uint64>(field_number) << 3) | 2,
+                     static_cast<uint64>(VARSIZE_ANY_EXHDR(item))}) {
+      while (x >= 0x80) {
+        header[header_len++] = static_cast<char>(x | 0x80);
+        x >>= 7;
+      }
+      header[header_len++] = static_cast<char>(x);
+    }
+    appendBinaryStringInfo(state, header, header_len);
+    appendBinaryStringInfo(state, VARDATA_ANY(item), VARSIZE_ANY_EXHDR(item));
+  }
+
+  if (state == nullptr) {
+    PG_RETURN_NULL();
+  }
+  PG_RETURN_POINTER(state);
+}
+
+Datum protobuf_agg_finalfn(PG_FUNCTION_ARGS) {
+  if (PG_ARGISNULL(0)) {
+    PG_RETURN_NULL();
+  }
+  StringInfo state = reinterpret_cast<StringInfo>(PG_GETARG_POINTER(0));
+  PG_RETURN_BYTEA_P(AggStateToBytea(state));
+}
+
+Datum protobuf_agg_combinefn(PG_FUNCTION_ARGS) {
+  MemoryContext agg_context;
+  if (!AggCheckCallContext(fcinfo, &agg_context)) {
+    ereport(ERROR, (errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+                    errmsg("protobuf_agg_combinefn called in non-aggregate "
+                           "context")));
+  }
+  StringInfo state1 = PG_ARGISNULL(0) ? nullptr
+                                      : reinterpret_cast<StringInfo>(
+                                            PG_GETARG_POINTER(0));
+  StringInfo state2 = PG_ARGISNULL(1) ? nullptr
+                                      : reinterpret_cast<StringInfo>(
+                                            PG_GETARG_POINTER(1));
+
+  if (state2 != nullptr) {
+    if (state1 == nullptr) {
+      MemoryContext old_context = MemoryContextSwitchTo(agg_context);
+      state1 = makeStringInfo();
+      MemoryContextSwitchTo(old_context);
+    }
+    appendBinaryStringInfo(state1, state2->data, state2->len);
+  }
+
+  if (state1 == nullptr) {
+    PG_RETURN_NULL();
   }
+  PG_RETURN_POINTER(state1);
+}
+
+Datum protobuf_agg_serialfn(PG_FUNCTION_ARGS) {
+  StringInfo state = reinterpret_cast<StringInfo>(PG_GETARG_POINTER(0));
+  PG_RETURN_BYTEA_P(AggStateToBytea(state));
+}
+
+Datum protobuf_agg_deserialfn(PG_FUNCTION_ARGS) {
+  if (!AggCheckCallContext(fcinfo, nullptr)) {
+    ereport(ERROR, (errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+                    errmsg("protobuf_agg_deserialfn called in non-aggregate "
+                           "context")));
+  }
+  bytea* serialized = PG_GETARG_BYTEA_PP(0);
+  StringInfo state = makeStringInfo();
+  appendBinaryStringInfo(state, VARDATA_ANY(serialized),
+                         VARSIZE_ANY_EXHDR(serialized));
+  PG_RETURN_POINTER(state);
+}
+
+// Module initializer
+void _PG_init() {
+  DefineCustomEnumVariable(
+      "postgres_protobuf.query_engine", "Selects how queries are executed.",
+      "'flat' runs queries compiled into a flat instruction list. "
+      "'visitor' is the original implementation, kept for reference.",
+      &query_engine_setting, query_engine_setting, query_engine_options,
+      PGC_USERSET, 0, nullptr, &AssignQueryEngine, nullptr);
+  DefineCustomEnumVariable(
+      "postgres_protobuf.json_writer",
+      "Selects how protobufs are converted to JSON text.",
+      "'native' walks the wire format with the message descriptors. "
+      "'library' uses the protobuf library's converter, kept for comparison.",
+      &json_writer_setting, json_writer_setting, json_writer_options,
+      PGC_USERSET, 0, nullptr, &AssignJsonWriter, nullptr);
+  DefineCustomEnumVariable(
+      "postgres_protobuf.json_reader",
+      "Selects how JSON text is converted to protobufs.",
+      "'native' parses straight into the wire format with the message "
+      "descriptors. 'library' uses the protobuf library's converter, kept for "
+      "comparison.",
+      &json_reader_setting, json_reader_setting, json_reader_options,
+      PGC_USERSET, 0, nullptr, &AssignJsonReader, nullptr);
+  DefineCustomIntVariable(
+      "postgres_protobuf.max_depth",
+      "Sets how deeply messages may be nested in protobufs that are queried "
+      "or converted.",
+      nullptr, &max_depth_setting, max_depth_setting, 1, INT_MAX, PGC_USERSET,
+      0, nullptr, &AssignMaxDepth, nullptr);
+  shared_cache::Init();
+  wire_format::Init();
+  EmitWarningsOnPlaceholders("postgres_protobuf");
+
+  *find_rendezvous_variable(POSTGRES_PROTOBUF_API_NAME) =
+      const_cast<PostgresProtobufApi*>(&api);
 }
 
 // Module finarlizer
 void _PG_fini() {
+  *find_rendezvous_variable(POSTGRES_PROTOBUF_API_NAME) = nullptr;
+  querying::Query::ClearCache();
   descriptor_db::DescDb::ClearCache();
   pb::ShutdownProtobufLibrary();
 }
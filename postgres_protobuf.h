@@ -0,0 +1,60 @@
+/*
+ * C API of postgres_protobuf for other extensions.
+ *
+ * The API is published as a rendezvous variable, so extensions don't need to
+ * link against postgres_protobuf:
+ *
+ *   const PostgresProtobufApi *api = postgres_protobuf_get_api();
+ *   api->query_batch("MyProto:some_field", n, protos, NULL, results, nulls);
+ *
+ * The functions raise Postgres errors like the SQL functions do.
+ */
+#ifndef POSTGRES_PROTOBUF_H_
+#define POSTGRES_PROTOBUF_H_
+
+#include <postgres.h>
+
+#include <fmgr.h>
+
+#define POSTGRES_PROTOBUF_API_NAME "postgres_protobuf_api"
+
+/* Incremented whenever functions are added to `PostgresProtobufApi`. */
+#define POSTGRES_PROTOBUF_API_VERSION 1
+
+typedef struct PostgresProtobufApi
+{
+	int			version;
+
+	/*
+	 * Like `protobuf_query`, for each of `num_protos` bytea datums in
+	 * `protos`, which may be toasted. Sets `results[i]` to a palloc'd text
+	 * datum with the first result on the i'th protobuf, or sets
+	 * `result_nulls[i]` if there's none. `proto_nulls` may be NULL if none
+	 * of the protobufs are null. The query is compiled once for the batch,
+	 * and the compiled query is cached for later batches.
+	 */
+	void		(*query_batch) (const char *query, int num_protos,
+								const Datum *protos, const bool *proto_nulls,
+								Datum *results, bool *result_nulls);
+} PostgresProtobufApi;
+
+/*
+ * Loads postgres_protobuf if it isn't loaded yet and returns its API.
+ * Callers should check that `version` is at least the version they need.
+ */
+static inline const PostgresProtobufApi *
+postgres_protobuf_get_api(void)
+{
+	const PostgresProtobufApi **api = (const PostgresProtobufApi **)
+		find_rendezvous_variable(POSTGRES_PROTOBUF_API_NAME);
+
+	if (*api == NULL)
+		load_file("$libdir/postgres_protobuf", false);
+	if (*api == NULL)
+		ereport(ERROR,
+				(errcode(ERRCODE_UNDEFINED_OBJECT),
+				 errmsg("postgres_protobuf API is not available")));
+	return *api;
+}
+
+#endif							/* POSTGRES_PROTOBUF_H_ */
@@ -26,52 +26,71 @@ void* palloc0_or_throw_bad_alloc(size_t size) {
   return p;
 }
 
-std::string float_to_string(float x) {
+void* palloc_or_throw_bad_alloc(size_t size) {
+  void* p = palloc_extended(size, MCXT_ALLOC_NO_OOM);
+  if (p == nullptr) {
+    throw std::bad_alloc();
+  }
+  return p;
+}
+
+void CallCatchingPostgresErrors(void (*f)(void*), void* arg) {
+  MemoryContext mctx = CurrentMemoryContext;
+  ErrorData* error = nullptr;
+  PG_TRY();
+  { f(arg); }
+  PG_CATCH();
+  {
+    // `CopyErrorData` mustn't allocate in `ErrorContext`.
+    MemoryContextSwitchTo(mctx);
+    error = CopyErrorData();
+    FlushErrorState();
+  }
+  PG_END_TRY();
+  if (error != nullptr) {
+    throw PostgresError(error);
+  }
+}
+
+size_t float_to_buf(float x, char* buf) {
   // Matches behaviour of `float4out`
 #if PG_VERSION_NUM >= 120000
-  char buf[32];
-  static_assert(32 >= FLOAT_SHORTEST_DECIMAL_LEN);
+  static_assert(kFloatBufSize >= FLOAT_SHORTEST_DECIMAL_LEN);
   if (extra_float_digits > 0) {
-    float_to_shortest_decimal_buf(x, buf);
+    return float_to_shortest_decimal_buf(x, buf);
   } else {
-    pg_strfromd(buf, 32, FLT_DIG + extra_float_digits, x);
+    return pg_strfromd(buf, kFloatBufSize, FLT_DIG + extra_float_digits, x);
   }
-  return std::string(buf);
 #else
   if (std::isnan(x)) {
-    return "NaN";
+    return strlcpy(buf, "NaN", kFloatBufSize);
   }
   int inf = std::isinf(x);
   if (inf == 1) {
-    return "Infinity";
+    return strlcpy(buf, "Infinity", kFloatBufSize);
   } else if (inf == -1) {
-    return "-Infinity";
+    return strlcpy(buf, "-Infinity", kFloatBufSize);
   } else {
     int digits = std::max(1, FLT_DIG + extra_float_digits);
-    char* buf = psprintf("%.*g", digits, x);
-    std::string s(buf);
-    pfree(buf);
-    return s;
+    return snprintf(buf, kFloatBufSize, "%.*g", digits, x);
   }
 #endif
 }
 
-std::string double_to_string(double x) {
+size_t double_to_buf(double x, char* buf) {
   // Matches behaviour of `float8out`
 #if PG_VERSION_NUM >= 120000
-  char buf[32];
-  static_assert(32 >= DOUBLE_SHORTEST_DECIMAL_LEN);
+  static_assert(kFloatBufSize >= DOUBLE_SHORTEST_DECIMAL_LEN);
   if (extra_float_digits > 0) {
-    double_to_shortest_decimal_buf(x, buf);
+    return double_to_shortest_decimal_buf(x, buf);
   } else {
-    pg_strfromd(buf, 32, DBL_DIG + extra_float_digits, x);
+    return pg_strfromd(buf, kFloatBufSize, DBL_DIG + extra_float_digits, x);
   }
-  return std::string(buf);
 #else
-  char* buf = float8out_internal(x);
-  std::string s(buf);
-  pfree(buf);
-  return s;
+  char* s = float8out_internal(x);
+  size_t len = strlcpy(buf, s, kFloatBufSize);
+  pfree(s);
+  return len;
 #endif
 }
 
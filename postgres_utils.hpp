@@ -14,6 +14,7 @@ extern "C" {
 // We don't want to include `postgres.h` here since it pollutes the namespace,
 // causing problems with any protobuf includes that come after it.
 extern void pfree(void* pointer);
+struct ErrorData;
 }
 
 namespace postgres_protobuf {
@@ -47,8 +48,41 @@ void pdelete(T* p) {
   pfree(p);
 }
 
-std::string float_to_string(float x);
-std::string double_to_string(double x);
+// Like palloc0_or_throw_bad_alloc but doesn't zero the memory.
+void* palloc_or_throw_bad_alloc(size_t size);
+
+// Large enough for `float_to_buf` and `double_to_buf`, with the terminator.
+constexpr size_t kFloatBufSize = 32;
+
+// Format like `float4out` and `float8out` into `buf`, which must have room for
+// `kFloatBufSize` bytes. Return the length without the terminator.
+size_t float_to_buf(float x, char* buf);
+size_t double_to_buf(double x, char* buf);
+
+// ===================================================================
+// ==================== Error conversion helpers =====================
+// ===================================================================
+
+// A Postgres error caught by `CatchPostgresErrors`. `data` is palloc'd and
+// can be raised again with `ReThrowError`.
+class PostgresError {
+ public:
+  explicit PostgresError(ErrorData* data) : data(data) {}
+  ErrorData* const data;
+};
+
+void CallCatchingPostgresErrors(void (*f)(void*), void* arg);
+
+// Calls `f`, turning a Postgres error that it raises into a PostgresError,
+// so that Postgres functions can be called while C++ objects are live.
+// `f` itself must not throw or keep anything on the C++ heap. The error is
+// caught without a subtransaction, so it must be raised again (as
+// `ReportExceptions` does) before anything else is done in Postgres.
+template <typename F>
+void CatchPostgresErrors(F f) {
+  CallCatchingPostgresErrors([](void* arg) { (*static_cast<F*>(arg))(); },
+                             &f);
+}
 
 // TODO: pass memory context explicitly?
 template <typename T>
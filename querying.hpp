@@ -5,8 +5,10 @@
 
 #include <cstdint>
 #include <functional>
+#include <memory>
 #include <optional>
 #include <string>
+#include <string_view>
 #include <unordered_map>
 #include <vector>
 
@@ -17,8 +19,6 @@ class DescDb;
 
 namespace querying {
 
-// TODO: query cache
-
 class BadQuery {
  public:
   BadQuery(std::string&& msg) : msg(msg) {}
@@ -27,21 +27,225 @@ class BadQuery {
 
 class RecursionDepthExceeded {};
 
+class ResultOutOfRange {
+ public:
+  ResultOutOfRange(std::string&& msg) : msg(msg) {}
+  const std::string msg;
+};
+
 class QueryImpl;
 
+// How compiled queries are executed. The results are the same either way.
+enum class Engine {
+  // Passes every field through a chain of visitor objects.
+  Visitor,
+  // Runs the query compiled into a flat list of instructions.
+  Flat,
+};
+
+void SetEngine(Engine engine);
+
+// How deeply messages may be nested in what's queried or converted. Queries
+// keep the messages they're in on an explicit stack rather than recursing.
+void SetMaxDepth(int max_depth);
+
+// For code that recurses into nested messages, with the top-level message at
+// depth 0. Throws RecursionDepthExceeded if `depth` is beyond the maximum, or
+// if the C stack is running out.
+void CheckRecursionDepth(int depth);
+
+// Type of the results of a query. All but `Text` skip formatting values as
+// text, and their results are returned by `Query::RunTyped`.
+enum class ResultType {
+  Text,
+  Int8,     // Integers and enum numbers
+  Float8,   // Floating point numbers and integers
+  Bool,     // Booleans
+  Bytea,    // Strings, bytes and serialized messages
+  Numeric,  // Integers and floating point numbers
+};
+
+const char* ResultTypeName(ResultType result_type);
+
+// Where the types of the fields in a query come from.
+enum class Schema {
+  // `[<descriptor_set>:]<message_name>:<path>`, with the message looked up in
+  // `protobuf_file_descriptor_sets`.
+  DescriptorSet,
+  // `<type>:<path>`, where the path has only field numbers and index
+  // selectors, and `<type>` is the scalar type of the last field. Such
+  // queries don't depend on anything that may change.
+  None,
+};
+
+// Parses the `<type>` of a `Schema::None` query, which is the name of any
+// protobuf type but message, group or enum. Throws BadQuery.
+::google::protobuf::FieldDescriptor::Type ParseScalarType(
+    const std::string& name);
+
+// Parse the values that `Match` and containment queries compare with, which
+// are written like query results. Throw BadQuery.
+//
+// Bytes are written in hex, like `\x0123`.
+std::string ParseBytesValue(const std::string& s);
+// Bools are written `true` or `false`.
+bool ParseBoolValue(const std::string& s);
+// Rejects what `strtod` and friends would accept but a number can't look
+// like, i.e. an empty string or leading space.
+void CheckNumberValue(const std::string& s);
+
+// Comparison operators for `Match`.
+enum class CompareOp { Eq, Ne, Lt, Le, Gt, Ge };
+
+// Parses `=`, `!=`, `<>`, `<`, `<=`, `>` or `>=`. Throws BadQuery.
+CompareOp ParseCompareOp(std::string_view op);
+
+// Splits `<query> <op> <value>`, where the operator has a space on both
+// sides, at the first operator. Throws BadQuery if there's none.
+void SplitPredicate(const std::string& predicate, std::string* query,
+                    CompareOp* op, std::string* value);
+
+// A comparison of the results of a query with a value.
+struct Predicate {
+  CompareOp op;
+  std::string value;
+
+  bool operator==(const Predicate& that) const {
+    return op == that.op && value == that.value;
+  }
+};
+
+// A result of a query whose `ResultType` isn't `Text`.
+struct TypedValue {
+  enum class Kind { Int64, UInt64, Double, Bool, Bytes };
+  Kind kind;
+  union {
+    int64_t as_int64;
+    uint64_t as_uint64;  // Only for numeric results above the int64 range
+    double as_double;
+    bool as_bool;
+  };
+  std::string_view as_bytes;  // Valid like the results of `Query::Run`
+};
+
+// Compiled queries are kept in a per-backend LRU cache keyed by the query
+// text, the result limit and the generation of the descriptor database they
+// were compiled against, so constructing a `Query` is normally just a lookup.
 class Query {
  public:
-  Query(const std::string& query, std::optional<uint64_t> limit);
+  Query(const std::string& query, std::optional<uint64_t> limit,
+        ResultType result_type = ResultType::Text,
+        Schema schema = Schema::DescriptorSet);
   Query(const Query&) = delete;
   void operator=(const Query&) = delete;
 
   ~Query();
 
-  std::vector<std::string> Run(const std::uint8_t* proto_data,
-                               size_t proto_len);
+  // Whether the query was compiled against the current descriptor database.
+  // If not, it must not be run, since the schema may have changed.
+  bool IsUpToDate() const;
+
+  // The results point into `proto_data` or into buffers owned by the
+  // compiled query. They are valid until `proto_data` is freed or a query
+  // with the same text is run again, so copy them out right away.
+  const std::vector<std::string_view>& Run(const std::uint8_t* proto_data,
+                                           size_t proto_len);
+
+  // For queries whose result type isn't `Text`.
+  const std::vector<TypedValue>& RunTyped(const std::uint8_t* proto_data,
+                                          size_t proto_len);
+
+  // Like `RunTyped` for queries whose result type is `Int8` or `Float8`
+  // respectively, with the results laid out like the elements of an array,
+  // so that arrays can be built with one copy.
+  const std::vector<int64_t>& RunInt8(const std::uint8_t* proto_data,
+                                      size_t proto_len);
+  const std::vector<double>& RunFloat8(const std::uint8_t* proto_data,
+                                       size_t proto_len);
+
+  // Whether the last run stopped at the result limit, i.e. whether it would
+  // have had the same results on any longer protobuf with the same prefix.
+  bool ReachedLimit() const;
+
+  static void ClearCache();
+
+ private:
+  std::shared_ptr<QueryImpl> impl_;
+};
+
+// Tells whether any result of a query compares with a value as given.
+// Results are compared as decoded, without formatting them as text, and the
+// scan stops at the first one that matches. Numbers compare numerically,
+// strings and bytes byte by byte, enums by number (or value name) and bools
+// as `false` < `true`. Bytes values are written in hex like `\x0123`.
+class Match {
+ public:
+  // Throws BadQuery, also if the value can't be compared with the result.
+  Match(const std::string& query, const Predicate& predicate,
+        Schema schema = Schema::DescriptorSet);
+  Match(const Match&) = delete;
+  void operator=(const Match&) = delete;
+
+  ~Match();
+
+  bool IsUpToDate() const;
+
+  bool Run(const std::uint8_t* proto_data, size_t proto_len);
+
+  // Whether the last run found a match, which any longer protobuf with the
+  // same prefix would also have.
+  bool ReachedLimit() const;
+
+ private:
+  std::shared_ptr<QueryImpl> impl_;
+};
+
+// Runs a query producing only a few results at a time, so that a caller
+// that stops early doesn't pay for decoding the rest of the protobuf.
+class QueryStream {
+ public:
+  explicit QueryStream(const std::string& query);
+  QueryStream(const QueryStream&) = delete;
+  void operator=(const QueryStream&) = delete;
+
+  ~QueryStream();
+
+  // `proto_data` must stay alive until the stream is done with it.
+  void Start(const std::uint8_t* proto_data, size_t proto_len);
+
+  // Returns the next results, or an empty vector once there are no more.
+  // They are valid like the results of `Query::Run` until the next call.
+  const std::vector<std::string_view>& Next();
+
+ private:
+  const std::string query_;
+  std::shared_ptr<QueryImpl> impl_;
+};
+
+// Runs several queries over the same protobuf, scanning its top-level fields
+// only once. Each query still scans the parts it descends into on its own.
+class QuerySet {
+ public:
+  QuerySet(const std::vector<std::string>& queries,
+           std::optional<uint64_t> limit);
+  QuerySet(const QuerySet&) = delete;
+  void operator=(const QuerySet&) = delete;
+
+  ~QuerySet();
+
+  bool IsUpToDate() const;
+
+  void Run(const std::uint8_t* proto_data, size_t proto_len);
+
+  size_t size() const { return result_index_.size(); }
+
+  // Results of the i'th query of the last `Run`, valid as for `Query::Run`.
+  const std::vector<std::string_view>& Results(size_t i) const;
 
  private:
-  QueryImpl* impl_;
+  std::vector<std::shared_ptr<QueryImpl>> impls_;
+  std::vector<size_t> result_index_;  // Query index to `impls_` index
+  std::vector<QueryImpl*> scanning_;
 };
 
 }  // namespace querying
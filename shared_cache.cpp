@@ -0,0 +1,309 @@
+#include "shared_cache.hpp"
+
+#include "postgres_protobuf_common.hpp"
+
+#include <cstring>
+
+extern "C" {
+// Must be included before other Postgres headers
+#include <postgres.h>
+
+#include <access/twophase.h>
+#include <access/xact.h>
+#include <miscadmin.h>
+#include <storage/ipc.h>
+#include <storage/lwlock.h>
+#include <storage/procarray.h>
+#include <storage/shmem.h>
+#include <utils/guc.h>
+}
+
+namespace postgres_protobuf {
+namespace shared_cache {
+
+namespace {
+
+const char* const kName = "postgres_protobuf";
+
+// Followed by room for `max_prepared_xacts` IDs of prepared transactions
+// that changed the table, and then the entries, which are appended until
+// the cache is cleared.
+struct Header {
+  LWLock* lock;
+  uint64 generation;
+  Size capacity;  // Bytes available for entries
+  Size used;
+  int num_entries;
+  int num_prepared;
+};
+
+// Followed by the name and then the data.
+struct Entry {
+  uint32 name_len;
+  uint32 data_len;
+};
+
+int cache_size_kb = 8192;
+
+Header* header = nullptr;
+bool clear_at_commit = false;
+bool xact_callback_registered = false;
+
+shmem_startup_hook_type prev_shmem_startup_hook = nullptr;
+#if PG_VERSION_NUM >= 150000
+shmem_request_hook_type prev_shmem_request_hook = nullptr;
+#endif
+
+Size PreparedSize() {
+  return MAXALIGN(sizeof(TransactionId) * max_prepared_xacts);
+}
+
+Size SharedSize() {
+  return MAXALIGN(sizeof(Header)) + PreparedSize() +
+         static_cast<Size>(cache_size_kb) * 1024;
+}
+
+TransactionId* Prepared() {
+  return reinterpret_cast<TransactionId*>(reinterpret_cast<char*>(header) +
+                                          MAXALIGN(sizeof(Header)));
+}
+
+char* EntriesStart() {
+  return reinterpret_cast<char*>(header) + MAXALIGN(sizeof(Header)) +
+         PreparedSize();
+}
+
+// Requires the lock in exclusive mode.
+void ClearLocked() {
+  ++header->generation;
+  header->used = 0;
+  header->num_entries = 0;
+}
+
+// Requires the lock in exclusive mode. The commit of a prepared transaction
+// can't be hooked into, so once one that changed the table is over, the
+// first backend to notice clears the cache. Until then, it's not visible.
+void ForgetFinishedPrepared() {
+  TransactionId* prepared = Prepared();
+  int num_running = 0;
+  for (int i = 0; i < header->num_prepared; ++i) {
+    if (TransactionIdIsInProgress(prepared[i])) {
+      prepared[num_running++] = prepared[i];
+    }
+  }
+  if (num_running < header->num_prepared) {
+    PGPROTO_DEBUG("Clearing shared cache after prepared transaction");
+    header->num_prepared = num_running;
+    ClearLocked();
+  }
+}
+
+// Takes the lock, having first cleared the cache if needed.
+void AcquireLock(LWLockMode mode) {
+  LWLockAcquire(header->lock, mode);
+  if (header->num_prepared > 0) {
+    if (mode != LW_EXCLUSIVE) {
+      LWLockRelease(header->lock);
+      LWLockAcquire(header->lock, LW_EXCLUSIVE);
+    }
+    ForgetFinishedPrepared();
+  }
+}
+
+// Called before a transaction that changed the table is prepared.
+void RememberPrepared() {
+  if (max_prepared_xacts == 0) {
+    return;  // Preparing will fail anyway
+  }
+  LWLockAcquire(header->lock, LW_EXCLUSIVE);
+  ForgetFinishedPrepared();
+  if (header->num_prepared >= max_prepared_xacts) {
+    LWLockRelease(header->lock);
+    ereport(ERROR,
+            (errcode(ERRCODE_INSUFFICIENT_RESOURCES),
+             errmsg("too many prepared transactions change "
+                    "protobuf_file_descriptor_sets")));
+  }
+  Prepared()[header->num_prepared++] = GetTopTransactionId();
+  LWLockRelease(header->lock);
+}
+
+Size EntrySize(const Entry* entry) {
+  return MAXALIGN(sizeof(Entry) + entry->name_len + entry->data_len);
+}
+
+const char* EntryName(const Entry* entry) {
+  return reinterpret_cast<const char*>(entry) + sizeof(Entry);
+}
+
+// Requires the lock.
+const Entry* FindEntry(std::string_view name) {
+  const char* p = EntriesStart();
+  for (int i = 0; i < header->num_entries; ++i) {
+    const Entry* entry = reinterpret_cast<const Entry*>(p);
+    if (std::string_view(EntryName(entry), entry->name_len) == name) {
+      return entry;
+    }
+    p += EntrySize(entry);
+  }
+  return nullptr;
+}
+
+void RequestSharedMemory() {
+  RequestAddinShmemSpace(SharedSize());
+  RequestNamedLWLockTranche(kName, 1);
+}
+
+#if PG_VERSION_NUM >= 150000
+void ShmemRequest() {
+  if (prev_shmem_request_hook != nullptr) {
+    prev_shmem_request_hook();
+  }
+  RequestSharedMemory();
+}
+#endif
+
+void ShmemStartup() {
+  if (prev_shmem_startup_hook != nullptr) {
+    prev_shmem_startup_hook();
+  }
+  LWLockAcquire(AddinShmemInitLock, LW_EXCLUSIVE);
+  bool found;
+  header = static_cast<Header*>(
+      ShmemInitStruct("postgres_protobuf shared cache", SharedSize(), &found));
+  if (!found) {
+    header->lock = &(GetNamedLWLockTranche(kName))->lock;
+    header->generation = 1;
+    header->capacity = static_cast<Size>(cache_size_kb) * 1024;
+    header->used = 0;
+    header->num_entries = 0;
+    header->num_prepared = 0;
+  }
+  LWLockRelease(AddinShmemInitLock);
+}
+
+void XactCallback(XactEvent event, void*) {
+  switch (event) {
+    case XACT_EVENT_COMMIT:
+      if (clear_at_commit) {
+        PGPROTO_DEBUG("Clearing shared cache after commit");
+        Clear();
+      }
+      clear_at_commit = false;
+      break;
+    case XACT_EVENT_PRE_PREPARE:
+      if (clear_at_commit) {
+        RememberPrepared();
+      }
+      break;
+    case XACT_EVENT_ABORT:
+    case XACT_EVENT_PREPARE:
+      // Nothing changed yet
+      clear_at_commit = false;
+      break;
+    default:
+      break;
+  }
+}
+
+}  // namespace
+
+void Init() {
+  // Like pg_stat_statements, the setting only exists when preloaded, since
+  // a PGC_POSTMASTER setting can't be defined after startup.
+  if (!process_shared_preload_libraries_in_progress) {
+    return;
+  }
+  DefineCustomIntVariable(
+      "postgres_protobuf.shared_cache_size",
+      "Size of the descriptor set cache shared by all backends.",
+      "Only used when postgres_protobuf is in shared_preload_libraries. "
+      "0 disables the shared cache.",
+      &cache_size_kb, cache_size_kb, 0, MAX_KILOBYTES, PGC_POSTMASTER,
+      GUC_UNIT_KB, nullptr, nullptr, nullptr);
+
+  if (cache_size_kb == 0) {
+    return;
+  }
+#if PG_VERSION_NUM >= 150000
+  prev_shmem_request_hook = shmem_request_hook;
+  shmem_request_hook = &ShmemRequest;
+#else
+  RequestSharedMemory();
+#endif
+  prev_shmem_startup_hook = shmem_startup_hook;
+  shmem_startup_hook = &ShmemStartup;
+}
+
+bool IsEnabled() { return header != nullptr; }
+
+uint64_t Generation() {
+  AcquireLock(LW_SHARED);
+  uint64_t generation = header->generation;
+  LWLockRelease(header->lock);
+  return generation;
+}
+
+struct varlena* Lookup(std::string_view name) {
+  // The cache doesn't have this transaction's own changes.
+  if (clear_at_commit) {
+    return nullptr;
+  }
+  struct varlena* result = nullptr;
+  AcquireLock(LW_SHARED);
+  const Entry* entry = FindEntry(name);
+  if (entry != nullptr) {
+    // An error here releases the lock along with the transaction.
+    result = static_cast<struct varlena*>(palloc(VARHDRSZ + entry->data_len));
+    SET_VARSIZE(result, VARHDRSZ + entry->data_len);
+    memcpy(VARDATA(result), EntryName(entry) + entry->name_len,
+           entry->data_len);
+  }
+  LWLockRelease(header->lock);
+  return result;
+}
+
+void Store(uint64_t generation, std::string_view name, std::string_view data) {
+  if (clear_at_commit) {
+    return;
+  }
+  Size size = MAXALIGN(sizeof(Entry) + name.size() + data.size());
+  AcquireLock(LW_EXCLUSIVE);
+  if (header->generation == generation &&
+      header->capacity - header->used >= size && FindEntry(name) == nullptr) {
+    Entry* entry = reinterpret_cast<Entry*>(EntriesStart() + header->used);
+    entry->name_len = static_cast<uint32>(name.size());
+    entry->data_len = static_cast<uint32>(data.size());
+    char* p = reinterpret_cast<char*>(entry) + sizeof(Entry);
+    memcpy(p, name.data(), name.size());
+    memcpy(p + name.size(), data.data(), data.size());
+    header->used += size;
+    ++header->num_entries;
+    PGPROTO_DEBUG("Shared descriptor set %.*s (%lu bytes)",
+                  static_cast<int>(name.size()), name.data(), data.size());
+  }
+  LWLockRelease(header->lock);
+}
+
+void Clear() {
+  if (header == nullptr) {
+    return;
+  }
+  LWLockAcquire(header->lock, LW_EXCLUSIVE);
+  ClearLocked();
+  LWLockRelease(header->lock);
+}
+
+void ClearAtCommit() {
+  if (header == nullptr) {
+    return;
+  }
+  if (!xact_callback_registered) {
+    RegisterXactCallback(&XactCallback, nullptr);
+    xact_callback_registered = true;
+  }
+  clear_at_commit = true;
+}
+
+}  // namespace shared_cache
+}  // namespace postgres_protobuf
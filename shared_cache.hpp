@@ -0,0 +1,55 @@
+#ifndef POSTGRES_PROTOBUF_SHARED_CACHE_HPP_
+#define POSTGRES_PROTOBUF_SHARED_CACHE_HPP_
+
+#include <cstdint>
+#include <string_view>
+
+extern "C" {
+struct varlena;
+}
+
+namespace postgres_protobuf {
+namespace shared_cache {
+
+// Serialized descriptor sets from `protobuf_file_descriptor_sets`, kept in
+// shared memory so that backends can load them without querying the table.
+// Only available when the extension is in `shared_preload_libraries`.
+// The descriptor pools built from them are still per backend, since the
+// protobuf library keeps them on the C++ heap.
+//
+// The cache is cleared once for every change to the table, which bumps its
+// generation: by the backend that commits it, or for a prepared transaction,
+// by the first backend to use the cache after it's committed. Other
+// backends' invalidations don't touch it. These functions raise Postgres
+// errors.
+
+// While shared libraries are being preloaded, defines
+// `postgres_protobuf.shared_cache_size` and sets up the shared memory.
+// Otherwise does nothing. Called from `_PG_init`.
+void Init();
+
+bool IsEnabled();
+
+// Must be read before taking the snapshot that data passed to `Store` is
+// read with, so that a change committed in between is noticed.
+uint64_t Generation();
+
+// Returns a palloc'd bytea copy of the named descriptor set,
+// or nullptr if it's not cached.
+struct varlena* Lookup(std::string_view name);
+
+// Adds a descriptor set, unless the cache has been cleared since
+// `generation` or there's no room left.
+void Store(uint64_t generation, std::string_view name, std::string_view data);
+
+void Clear();
+
+// Clears the cache once the current transaction, which has changed the table,
+// commits. Until then, this backend doesn't use the cache, and other backends
+// may still fill it from the table.
+void ClearAtCommit();
+
+}  // namespace shared_cache
+}  // namespace postgres_protobuf
+
+#endif  // POSTGRES_PROTOBUF_SHARED_CACHE_HPP_
@@ -0,0 +1,260 @@
+#include "wire_format.hpp"
+
+#include <cstddef>
+#include <cstring>
+#include <limits>
+
+#if defined(__x86_64__)
+#include <cpuid.h>
+#include <immintrin.h>
+#endif
+
+namespace postgres_protobuf {
+namespace wire_format {
+
+namespace {
+
+const uint8_t* ReadVarintPortable(const uint8_t* p, const uint8_t* end,
+                                  uint64_t* value) {
+  uint64_t result = 0;
+  for (int shift = 0; shift < 64 && p < end; shift += 7) {
+    uint8_t byte = *p++;
+    result |= static_cast<uint64_t>(byte & 0x7F) << shift;
+    if (byte < 0x80) {
+      *value = result;
+      return p;
+    }
+  }
+  return nullptr;
+}
+
+const uint8_t* SkipVarintPortable(const uint8_t* p, const uint8_t* end) {
+  for (int i = 0; i < 10 && p < end; ++i) {
+    if (*p++ < 0x80) {
+      return p;
+    }
+  }
+  return nullptr;
+}
+
+#if defined(__x86_64__)
+
+// The decoders below load this much at once, enough for any varint. Closer to
+// the end of the buffer, they fall back to the portable ones.
+constexpr ptrdiff_t kLoadSize = 16;
+
+constexpr uint64_t kPayloadBits = 0x7F7F7F7F7F7F7F7F;
+
+// Returns the length of the varint at `p`, or 0 if it's over 10 bytes.
+// SSE2 is part of x86-64, so this needs no check.
+inline int VarintLength(const uint8_t* p) {
+  __m128i bytes = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p));
+  // The bits past the 16 loaded bytes are set, so there's always a last byte.
+  uint32_t last_bytes = ~static_cast<uint32_t>(_mm_movemask_epi8(bytes));
+  int length = __builtin_ctz(last_bytes) + 1;
+  return length <= 10 ? length : 0;
+}
+
+// Packs the 7-bit groups of up to 8 bytes together, in lanes that double in
+// width at each step.
+inline uint64_t CompactSwar(uint64_t x) {
+  x = ((x & 0x7F007F007F007F00) >> 1) | (x & 0x007F007F007F007F);
+  x = ((x & 0x3FFF00003FFF0000) >> 2) | (x & 0x00003FFF00003FFF);
+  x = ((x & 0x0FFFFFFF00000000) >> 4) | (x & 0x000000000FFFFFFF);
+  return x;
+}
+
+__attribute__((target("bmi2"))) inline uint64_t CompactPext(uint64_t x) {
+  return _pext_u64(x, kPayloadBits);
+}
+
+// Decodes without a branch per byte.
+template <uint64_t (*Compact)(uint64_t)>
+inline __attribute__((always_inline)) const uint8_t* ReadVarintWith(
+    const uint8_t* p, const uint8_t* end, uint64_t* value) {
+  if (end - p < kLoadSize) {
+    return ReadVarintPortable(p, end, value);
+  }
+  int length = VarintLength(p);
+  if (length == 0) {
+    return nullptr;
+  }
+  uint64_t low_bytes;
+  std::memcpy(&low_bytes, p, sizeof(low_bytes));
+  uint64_t varint_bytes =
+      length >= 8 ? std::numeric_limits<uint64_t>::max()
+                  : (static_cast<uint64_t>(1) << (8 * length)) - 1;
+  uint64_t result = Compact(low_bytes & varint_bytes & kPayloadBits);
+  if (length > 8) {
+    result |= static_cast<uint64_t>(p[8] & 0x7F) << 56;
+    if (length == 10) {
+      result |= static_cast<uint64_t>(p[9]) << 63;
+    }
+  }
+  *value = result;
+  return p + length;
+}
+
+const uint8_t* ReadVarintSse2(const uint8_t* p, const uint8_t* end,
+                              uint64_t* value) {
+  return ReadVarintWith<&CompactSwar>(p, end, value);
+}
+
+__attribute__((target("bmi2"))) const uint8_t* ReadVarintBmi2(
+    const uint8_t* p, const uint8_t* end, uint64_t* value) {
+  return ReadVarintWith<&CompactPext>(p, end, value);
+}
+
+// Stores 16 bytes as 16 uint64_t.
+inline void WidenBytes(__m128i bytes, uint64_t* values) {
+  const __m128i zero = _mm_setzero_si128();
+  __m128i halves[2] = {_mm_unpacklo_epi8(bytes, zero),
+                       _mm_unpackhi_epi8(bytes, zero)};
+  for (int h = 0; h < 2; ++h) {
+    __m128i quarters[2] = {_mm_unpacklo_epi16(halves[h], zero),
+                           _mm_unpackhi_epi16(halves[h], zero)};
+    for (int q = 0; q < 2; ++q) {
+      uint64_t* out = values + 8 * h + 4 * q;
+      _mm_storeu_si128(reinterpret_cast<__m128i*>(out),
+                       _mm_unpacklo_epi32(quarters[q], zero));
+      _mm_storeu_si128(reinterpret_cast<__m128i*>(out + 2),
+                       _mm_unpackhi_epi32(quarters[q], zero));
+    }
+  }
+}
+
+bool HasFastPext() {
+  unsigned int eax, ebx, ecx, edx;
+  if (!__get_cpuid_count(7, 0, &eax, &ebx, &ecx, &edx) ||
+      (ebx & bit_BMI2) == 0) {
+    return false;
+  }
+  // AMD CPUs before Zen 3 (family 19h) implement pext in slow microcode.
+  __get_cpuid(0, &eax, &ebx, &ecx, &edx);
+  if (ebx != signature_AMD_ebx) {
+    return true;
+  }
+  __get_cpuid(1, &eax, &ebx, &ecx, &edx);
+  unsigned int family = (eax >> 8) & 0xF;
+  if (family == 0xF) {
+    family += (eax >> 20) & 0xFF;
+  }
+  return family >= 0x19;
+}
+
+#endif  // defined(__x86_64__)
+
+}  // namespace
+
+namespace internal {
+#if defined(__x86_64__)
+const uint8_t* (*read_long_varint)(const uint8_t*, const uint8_t*,
+                                   uint64_t*) = &ReadVarintSse2;
+#else
+const uint8_t* (*read_long_varint)(const uint8_t*, const uint8_t*,
+                                   uint64_t*) = &ReadVarintPortable;
+#endif
+}  // namespace internal
+
+void Init() {
+#if defined(__x86_64__)
+  if (HasFastPext()) {
+    internal::read_long_varint = &ReadVarintBmi2;
+  }
+#endif
+}
+
+const uint8_t* SkipVarint(const uint8_t* p, const uint8_t* end) {
+#if defined(__x86_64__)
+  if (end - p >= kLoadSize) {
+    int length = VarintLength(p);
+    return length != 0 ? p + length : nullptr;
+  }
+#endif
+  return SkipVarintPortable(p, end);
+}
+
+size_t CountVarints(const uint8_t* p, const uint8_t* end) {
+  size_t count = 0;
+#if defined(__x86_64__)
+  for (; end - p >= kLoadSize; p += kLoadSize) {
+    __m128i bytes = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p));
+    count += kLoadSize - __builtin_popcount(_mm_movemask_epi8(bytes));
+  }
+#endif
+  for (; p < end; ++p) {
+    count += *p < 0x80;
+  }
+  return count;
+}
+
+bool ReadPackedVarints(const uint8_t* p, const uint8_t* end, size_t count,
+                       uint64_t* values) {
+  uint64_t* values_end = values + count;
+  while (values < values_end) {
+#if defined(__x86_64__)
+    // Small numbers are common in large packed fields, so single-byte
+    // varints are copied out 16 at a time.
+    if (end - p >= kLoadSize && values_end - values >= kLoadSize) {
+      __m128i bytes = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p));
+      uint32_t continuations = _mm_movemask_epi8(bytes);
+      if (continuations == 0) {
+        WidenBytes(bytes, values);
+        p += kLoadSize;
+        values += kLoadSize;
+        continue;
+      }
+      for (int i = __builtin_ctz(continuations); i > 0; --i) {
+        *values++ = *p++;
+      }
+    }
+#endif
+    p = ReadVarint(p, end, values++);
+    if (p == nullptr) {
+      return false;
+    }
+  }
+  return p == end;
+}
+
+const uint8_t* SkipToField(const uint8_t* p, const uint8_t* end,
+                           uint32_t number) {
+  while (p < end) {
+    const uint8_t* field_start = p;
+    uint64_t tag;
+    p = ReadVarint(p, end, &tag);
+    if (p == nullptr || tag > std::numeric_limits<uint32_t>::max() ||
+        (tag >> 3) == number || (tag >> 3) == 0) {
+      return field_start;
+    }
+    switch (tag & 0x7) {
+      case 0:
+        p = p < end && *p < 0x80 ? p + 1 : SkipVarint(p, end);
+        break;
+      case 1:
+        p = end - p >= 8 ? p + 8 : nullptr;
+        break;
+      case 2: {
+        uint64_t size;
+        p = ReadVarint(p, end, &size);
+        if (p != nullptr) {
+          p = size <= static_cast<uint64_t>(end - p) ? p + size : nullptr;
+        }
+        break;
+      }
+      case 5:
+        p = end - p >= 4 ? p + 4 : nullptr;
+        break;
+      default:
+        p = nullptr;
+        break;
+    }
+    if (p == nullptr) {
+      return field_start;
+    }
+  }
+  return end;
+}
+
+}  // namespace wire_format
+}  // namespace postgres_protobuf
@@ -0,0 +1,56 @@
+#ifndef POSTGRES_PROTOBUF_WIRE_FORMAT_HPP_
+#define POSTGRES_PROTOBUF_WIRE_FORMAT_HPP_
+
+#include <cstddef>
+#include <cstdint>
+
+namespace postgres_protobuf {
+namespace wire_format {
+
+// Decoding of the protobuf wire format straight from a buffer, for code that
+// doesn't need the generality of `CodedInputStream`. Functions return the
+// position after what they read, or nullptr if it's invalid or runs past
+// `end`, leaving it to the caller to report the error.
+
+// Picks the fastest varint decoder the CPU supports. Called from `_PG_init`.
+// Until then, the portable one is used.
+void Init();
+
+namespace internal {
+extern const uint8_t* (*read_long_varint)(const uint8_t* p,
+                                          const uint8_t* end,
+                                          uint64_t* value);
+}
+
+// Like the protobuf library, takes the low 64 bits of varints up to 10 bytes.
+inline const uint8_t* ReadVarint(const uint8_t* p, const uint8_t* end,
+                                 uint64_t* value) {
+  // Most tags and many values fit in a byte.
+  if (p < end && *p < 0x80) {
+    *value = *p;
+    return p + 1;
+  }
+  return internal::read_long_varint(p, end, value);
+}
+
+const uint8_t* SkipVarint(const uint8_t* p, const uint8_t* end);
+
+// Counts the varints in the contents of a packed field, i.e. the bytes that
+// end one. Whether the contents are valid is left to `ReadPackedVarints`.
+size_t CountVarints(const uint8_t* p, const uint8_t* end);
+
+// Decodes the `count` varints that `CountVarints` found into `values`.
+// Returns false if they're invalid.
+bool ReadPackedVarints(const uint8_t* p, const uint8_t* end, size_t count,
+                       uint64_t* values);
+
+// Skips fields until one numbered `number`. Returns where that field starts,
+// or where the first field that can't be skipped starts, so that reading it
+// gives the usual error. Returns `end` if there's no such field.
+const uint8_t* SkipToField(const uint8_t* p, const uint8_t* end,
+                           uint32_t number);
+
+}  // namespace wire_format
+}  // namespace postgres_protobuf
+
+#endif  // POSTGRES_PROTOBUF_WIRE_FORMAT_HPP_